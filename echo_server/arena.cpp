@@ -0,0 +1,375 @@
+/*
+ * arena.cpp
+ * 分配和释放只动当前线程的 freelist，不加锁；
+ * 只有切新 chunk、线程退出或者 freelist 太长时才经过全局的 depot
+ */
+
+#include "arena.h"
+#include "perf_counter.h"
+
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+using namespace std;
+
+// ASan 看不到 freelist 里的 buffer 被重复使用，用 ASan 编译时全部退回 malloc，越界和释放后使用才查得出来
+#if defined(__SANITIZE_ADDRESS__)
+#define ARENA_USE_MALLOC 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define ARENA_USE_MALLOC 1
+#endif
+#endif
+
+static const size_t g_class_size[ARENA_CLASS_NUM] = {64, 256, 1024, 4096, 16384, 65536};
+
+struct free_block
+{
+	free_block *next;
+};
+
+/* 每个线程的 freelist 和统计，统计只有本线程写，别的线程读 */
+struct thread_cache
+{
+	thread_cache();
+	~thread_cache();
+
+	free_block *free_list[ARENA_CLASS_NUM];
+	size_t free_count[ARENA_CLASS_NUM];
+	int numa_node;		// 线程绑定在单个 cpu 上时才有值，否则为 -1
+
+	atomic<uint64_t> allocs[ARENA_CLASS_NUM];
+	atomic<uint64_t> frees[ARENA_CLASS_NUM];
+	atomic<uint64_t> requested[ARENA_CLASS_NUM];
+};
+
+static atomic<char*> g_base(NULL);
+static size_t g_size = 0;
+static size_t g_chunk_num = 0;
+static uint8_t *g_chunk_class = NULL;		// 每个 chunk 切成了哪个 class
+static atomic<size_t> g_next_chunk(0);
+static const char *g_page_mode = "4k";
+static perf_counter g_dtlb;
+
+static mutex g_mutex;						// 保护下面这些
+static free_block *g_depot[ARENA_CLASS_NUM];
+static size_t g_depot_count[ARENA_CLASS_NUM];
+static vector<thread_cache*> g_caches;
+static uint64_t g_retired_allocs[ARENA_CLASS_NUM];	// 已经退出的线程的统计
+static uint64_t g_retired_frees[ARENA_CLASS_NUM];
+static uint64_t g_retired_requested[ARENA_CLASS_NUM];
+
+static atomic<uint64_t> g_carved[ARENA_CLASS_NUM];
+static atomic<uint64_t> g_fallback(0);
+
+static thread_local thread_cache t_cache;
+
+static int class_of(size_t size)
+{
+	for (int i = 0; i < ARENA_CLASS_NUM; ++i)
+		if (size <= g_class_size[i])
+			return i;
+	return -1;
+}
+
+static size_t blocks_per_chunk(int cls)
+{
+	return ARENA_CHUNK_SIZE / g_class_size[cls];
+}
+
+static bool in_arena(const void *p)
+{
+	char *base = g_base.load(memory_order_acquire);
+	return base && (const char*)p >= base && (const char*)p < base + g_size;
+}
+
+thread_cache::thread_cache()
+{
+	numa_node = -1;
+	for (int i = 0; i < ARENA_CLASS_NUM; ++i)
+	{
+		free_list[i] = NULL;
+		free_count[i] = 0;
+		allocs[i] = 0;
+		frees[i] = 0;
+		requested[i] = 0;
+	}
+
+	// 只有绑了核的线程才知道以后在哪个 node 上跑
+	cpu_set_t set;
+	unsigned cpu, node;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) == 1
+		&& syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+		numa_node = node;
+
+	lock_guard<mutex> lock(g_mutex);
+	g_caches.push_back(this);
+}
+
+thread_cache::~thread_cache()
+{
+	lock_guard<mutex> lock(g_mutex);
+	for (int i = 0; i < ARENA_CLASS_NUM; ++i)
+	{
+		// 线程退出时把空闲的 buffer 还给 depot，别的线程还能用
+		while (free_list[i])
+		{
+			free_block *b = free_list[i];
+			free_list[i] = b->next;
+			b->next = g_depot[i];
+			g_depot[i] = b;
+			++g_depot_count[i];
+		}
+		g_retired_allocs[i] += allocs[i];
+		g_retired_frees[i] += frees[i];
+		g_retired_requested[i] += requested[i];
+	}
+
+	for (auto it = g_caches.begin(); it != g_caches.end(); ++it)
+	{
+		if (*it == this)
+		{
+			g_caches.erase(it);
+			break;
+		}
+	}
+}
+
+bool arena_init(size_t reserve, bool hugepage)
+{
+	lock_guard<mutex> lock(g_mutex);
+	if (g_base.load())
+		return true;
+
+	reserve = (reserve + ARENA_CHUNK_SIZE - 1) & ~(ARENA_CHUNK_SIZE - 1);
+
+	void *p = MAP_FAILED;
+	if (hugepage)
+	{
+		// 要先在 /proc/sys/vm/nr_hugepages 里预留足够的大页，不够时 mmap 直接失败
+		p = mmap(NULL, reserve, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			g_page_mode = "hugetlb";
+	}
+
+	if (p == MAP_FAILED)
+	{
+		// 多映射一个 chunk 用来对齐，这样透明大页才能整页映射
+		size_t len = reserve + ARENA_CHUNK_SIZE;
+		char *raw = (char*)mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (raw == MAP_FAILED)
+		{
+			perror("arena mmap ERROR");
+			return false;
+		}
+
+		char *aligned = (char*)(((uintptr_t)raw + ARENA_CHUNK_SIZE - 1) & ~(ARENA_CHUNK_SIZE - 1));
+		if (aligned > raw)
+			munmap(raw, aligned - raw);
+		munmap(aligned + reserve, raw + len - (aligned + reserve));
+		p = aligned;
+
+		if (hugepage && madvise(p, reserve, MADV_HUGEPAGE) == 0)
+			g_page_mode = "thp";
+	}
+
+	g_size = reserve;
+	g_chunk_num = reserve / ARENA_CHUNK_SIZE;
+	g_chunk_class = new uint8_t[g_chunk_num]();
+
+	// 之后创建的线程一起统计
+	g_dtlb.open(PERF_TYPE_HW_CACHE, PERF_DTLB_LOAD_MISSES, true);
+
+	g_base.store((char*)p, memory_order_release);
+	return true;
+}
+
+/* 从 depot 拿或者切一个新的 chunk */
+static free_block *refill(thread_cache &tc, int cls)
+{
+	{
+		lock_guard<mutex> lock(g_mutex);
+		if (g_depot[cls])
+		{
+			free_block *list = g_depot[cls];
+			tc.free_count[cls] = g_depot_count[cls];
+			g_depot[cls] = NULL;
+			g_depot_count[cls] = 0;
+			return list;
+		}
+	}
+
+	size_t idx = g_next_chunk.fetch_add(1);
+	if (idx >= g_chunk_num)
+		return NULL;
+
+	char *chunk = g_base.load(memory_order_relaxed) + idx * ARENA_CHUNK_SIZE;
+	g_chunk_class[idx] = cls;
+
+	// 在第一次写之前把 chunk 放到线程所在的 node 上
+	if (tc.numa_node >= 0)
+	{
+		unsigned long nodemask = 1UL << tc.numa_node;
+		syscall(SYS_mbind, chunk, ARENA_CHUNK_SIZE, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0);
+	}
+
+	size_t n = blocks_per_chunk(cls);
+	size_t size = g_class_size[cls];
+	for (size_t i = 0; i < n - 1; ++i)
+		((free_block*)(chunk + i * size))->next = (free_block*)(chunk + (i + 1) * size);
+	((free_block*)(chunk + (n - 1) * size))->next = NULL;
+
+	tc.free_count[cls] = n;
+	g_carved[cls] += n;
+	return (free_block*)chunk;
+}
+
+void *arena_alloc(size_t size)
+{
+#ifdef ARENA_USE_MALLOC
+	++g_fallback;
+	return malloc(size);
+#endif
+
+	int cls = class_of(size);
+	if (cls < 0 || (!g_base.load(memory_order_acquire) && !arena_init()))
+	{
+		++g_fallback;
+		return malloc(size);
+	}
+
+	thread_cache &tc = t_cache;
+	free_block *b = tc.free_list[cls];
+	if (b == NULL)
+	{
+		b = refill(tc, cls);
+		if (b == NULL)
+		{
+			++g_fallback;
+			return malloc(size);
+		}
+	}
+
+	tc.free_list[cls] = b->next;
+	--tc.free_count[cls];
+	tc.allocs[cls].store(tc.allocs[cls].load(memory_order_relaxed) + 1, memory_order_relaxed);
+	tc.requested[cls].store(tc.requested[cls].load(memory_order_relaxed) + size, memory_order_relaxed);
+	return b;
+}
+
+void arena_free(void *p)
+{
+	if (p == NULL)
+		return;
+
+	if (!in_arena(p))
+	{
+		free(p);
+		return;
+	}
+
+	char *base = g_base.load(memory_order_relaxed);
+	int cls = g_chunk_class[((char*)p - base) / ARENA_CHUNK_SIZE];
+
+	thread_cache &tc = t_cache;
+	free_block *b = (free_block*)p;
+	b->next = tc.free_list[cls];
+	tc.free_list[cls] = b;
+	++tc.free_count[cls];
+	tc.frees[cls].store(tc.frees[cls].load(memory_order_relaxed) + 1, memory_order_relaxed);
+
+	// 一个线程分配另一个线程释放时，freelist 会一直变长，多出来的还给 depot
+	if (tc.free_count[cls] > 2 * blocks_per_chunk(cls))
+	{
+		free_block *tail = tc.free_list[cls];
+		while (tail->next)
+			tail = tail->next;
+
+		lock_guard<mutex> lock(g_mutex);
+		tail->next = g_depot[cls];
+		g_depot[cls] = tc.free_list[cls];
+		g_depot_count[cls] += tc.free_count[cls];
+		tc.free_list[cls] = NULL;
+		tc.free_count[cls] = 0;
+	}
+}
+
+size_t arena_block_size(const void *p)
+{
+	if (!in_arena(p))
+		return 0;
+	char *base = g_base.load(memory_order_relaxed);
+	return g_class_size[g_chunk_class[((const char*)p - base) / ARENA_CHUNK_SIZE]];
+}
+
+void arena_get_stats(arena_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->page_mode = g_page_mode;
+	stats->reserved = g_size;
+	stats->chunks_used = min(g_next_chunk.load(), g_chunk_num);
+	stats->fallback_allocs = g_fallback;
+	stats->dtlb_valid = g_dtlb.valid();
+	stats->dtlb_misses = g_dtlb.read();
+
+	lock_guard<mutex> lock(g_mutex);
+	for (int i = 0; i < ARENA_CLASS_NUM; ++i)
+	{
+		arena_class_stats &c = stats->classes[i];
+		uint64_t frees = g_retired_frees[i];
+		c.block_size = g_class_size[i];
+		c.allocs = g_retired_allocs[i];
+		c.requested_bytes = g_retired_requested[i];
+		for (auto tc : g_caches)
+		{
+			c.allocs += tc->allocs[i].load(memory_order_relaxed);
+			c.requested_bytes += tc->requested[i].load(memory_order_relaxed);
+			frees += tc->frees[i].load(memory_order_relaxed);
+		}
+		c.in_use = c.allocs > frees ? c.allocs - frees : 0;
+		c.carved = g_carved[i];
+	}
+}
+
+void arena_print_stats()
+{
+	arena_stats stats;
+	arena_get_stats(&stats);
+
+	cout << "arena: " << (stats.reserved >> 20) << "M reserved (" << stats.page_mode << "), "
+		<< stats.chunks_used << " chunks used, " << stats.fallback_allocs << " fallback allocs, dTLB load misses ";
+	if (stats.dtlb_valid)
+		cout << stats.dtlb_misses << endl;
+	else
+		cout << "unavailable" << endl;
+
+	for (int i = 0; i < ARENA_CLASS_NUM; ++i)
+	{
+		arena_class_stats &c = stats.classes[i];
+		if (c.carved == 0)
+			continue;
+
+		double internal = c.allocs ? 100.0 * (1.0 - (double)c.requested_bytes / (c.allocs * c.block_size)) : 0;
+		double external = 100.0 * (c.carved - c.in_use) / c.carved;
+		cout << "  class ";
+		if (c.block_size < 1024)
+			cout << c.block_size << ": allocs " << c.allocs;
+		else
+			cout << (c.block_size >> 10) << "K: allocs " << c.allocs;
+		cout
+			<< " in_use " << c.in_use << " carved " << c.carved
+			<< " internal frag " << internal << "%"
+			<< " idle " << external << "%" << endl;
+	}
+}
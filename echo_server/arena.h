@@ -0,0 +1,54 @@
+/*
+ * arena.h
+ * I/O buffer 用的内存池：启动时一次预留一大块（尽量用大页），
+ * 按 2M 切成 chunk 分给各线程，再切成固定大小的 buffer 放到线程自己的 freelist
+ */
+
+#ifndef __arena_h__
+#define __arena_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_DEFAULT_SIZE (256UL << 20)	// 默认预留 256M
+#define ARENA_CHUNK_SIZE (2UL << 20)		// 跟 x86_64 的大页一样大
+#define ARENA_CLASS_NUM 6					// buffer 大小：64 256 1K 4K 16K 64K，小的两个给 kv 的 key 和 value 用
+
+/* 不调用的话第一次 arena_alloc 时按默认参数初始化 */
+bool arena_init(size_t reserve = ARENA_DEFAULT_SIZE, bool hugepage = true);
+
+/* 返回至少 size 字节的 buffer，超过最大的 class 或者预留空间用完时退回 malloc */
+void *arena_alloc(size_t size);
+
+/* 可以在任意线程释放，buffer 回到释放线程的 freelist */
+void arena_free(void *p);
+
+/* p 所在 buffer 的实际大小 */
+size_t arena_block_size(const void *p);
+
+struct arena_class_stats
+{
+	size_t block_size;
+	uint64_t allocs;			// 累计分配次数
+	uint64_t in_use;			// 正在使用的 buffer 数
+	uint64_t carved;			// 已经切出来的 buffer 数
+	uint64_t requested_bytes;	// 累计请求的字节数，跟 allocs * block_size 比就是内部碎片
+};
+
+struct arena_stats
+{
+	const char *page_mode;		// "hugetlb" / "thp" / "4k"
+	size_t reserved;
+	size_t chunks_used;
+	uint64_t fallback_allocs;	// 退回 malloc 的次数
+	bool dtlb_valid;			// perf counter 可用时才有 dtlb_misses
+	uint64_t dtlb_misses;		// 从 arena_init 开始的 dTLB load miss
+	arena_class_stats classes[ARENA_CLASS_NUM];
+};
+
+void arena_get_stats(arena_stats *stats);
+
+/* 打印到 stdout，包括内部碎片（请求大小跟 buffer 大小之差）和外部碎片（切出来但空闲的） */
+void arena_print_stats();
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * capture.cpp
+ * 流量记录，文件一开始就 ftruncate 到预留大小再整个 mmap 进来，
+ * 记录时只是 memcpy 到映射区，不在 loop 里做 write 系统调用，落盘交给内核回写
+ */
+
+#include "capture.h"
+
+#include <iostream>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+static int g_fd = -1;
+static capture_header *g_header = NULL;
+static char *g_data = NULL;			// header 之后的数据区
+static size_t g_capacity = 0;		// 数据区大小
+static bool g_with_payload = false;
+static uint64_t g_start_mono = 0;
+
+static atomic<uint64_t> g_tail(0);		// 已经分配出去的位置
+static atomic<uint64_t> g_dropped(0);
+static atomic<uint32_t> g_conn_id(0);
+
+static uint64_t now_ns(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool capture_open(const char *path, bool with_payload, size_t max_size)
+{
+	if (max_size <= sizeof(capture_header))
+		return false;
+
+	g_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (g_fd == -1)
+	{
+		perror("capture open ERROR");
+		return false;
+	}
+
+	// 只是预留，稀疏文件不占磁盘，关闭时再截到实际大小
+	if (ftruncate(g_fd, max_size) == -1)
+	{
+		perror("capture ftruncate ERROR");
+		close(g_fd);
+		g_fd = -1;
+		return false;
+	}
+
+	void *p = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, g_fd, 0);
+	if (p == MAP_FAILED)
+	{
+		perror("capture mmap ERROR");
+		close(g_fd);
+		g_fd = -1;
+		return false;
+	}
+	madvise(p, max_size, MADV_SEQUENTIAL);
+
+	g_header = (capture_header*)p;
+	g_data = (char*)p + sizeof(capture_header);
+	g_capacity = max_size - sizeof(capture_header);
+	g_with_payload = with_payload;
+	g_start_mono = now_ns(CLOCK_MONOTONIC);
+
+	g_header->magic = CAPTURE_MAGIC;
+	g_header->version = CAPTURE_VERSION;
+	g_header->start_ns = now_ns(CLOCK_REALTIME);
+	g_header->data_size = 0;
+	g_header->dropped = 0;
+
+	cout << "capture traffic to " << path << (with_payload ? " (with payload)" : "") << endl;
+	return true;
+}
+
+bool capture_enabled()
+{
+	return g_header != NULL;
+}
+
+uint32_t capture_new_conn()
+{
+	return ++g_conn_id;
+}
+
+void capture_write(uint32_t conn_id, capture_dir dir, const void *data, size_t len)
+{
+	if (g_header == NULL)
+		return;
+
+	uint32_t payload_len = (g_with_payload && data) ? len : 0;
+	uint64_t size = (sizeof(capture_record) + payload_len + 7) & ~7ULL;
+
+	// 多个线程同时写时各自抢一段位置，写满了就丢掉
+	uint64_t off = g_tail.load(memory_order_relaxed);
+	do
+	{
+		if (off + size > g_capacity)
+		{
+			g_header->dropped = ++g_dropped;
+			return;
+		}
+	}
+	while (!g_tail.compare_exchange_weak(off, off + size, memory_order_relaxed));
+
+	capture_record *rec = (capture_record*)(g_data + off);
+	rec->ts_ns = now_ns(CLOCK_MONOTONIC) - g_start_mono;
+	rec->conn_id = conn_id;
+	rec->dir = dir;
+	rec->flags = 0;
+	memset(rec->reserved, 0, sizeof(rec->reserved));
+	rec->len = len;
+	rec->payload_len = payload_len;
+	if (payload_len)
+		memcpy(rec + 1, data, payload_len);
+
+	// 前面的字段和 payload 都写完才能置上，进程被杀掉时读的一方靠它找到连续写完的部分
+	__atomic_store_n(&rec->flags, (uint8_t)CAPTURE_COMMITTED, __ATOMIC_RELEASE);
+}
+
+void capture_close()
+{
+	if (g_header == NULL)
+		return;
+
+	// 调用方保证已经没有线程在 capture_write 里，分配出去的位置都写完了
+	uint64_t data_size = g_tail.load(memory_order_acquire);
+	g_header->data_size = data_size;
+	g_header->dropped = g_dropped.load();
+
+	munmap(g_header, g_capacity + sizeof(capture_header));
+	if (ftruncate(g_fd, sizeof(capture_header) + data_size) == -1)
+		perror("capture ftruncate ERROR");
+	close(g_fd);
+
+	g_header = NULL;
+	g_data = NULL;
+	g_fd = -1;
+}
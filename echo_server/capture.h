@@ -0,0 +1,65 @@
+/*
+ * capture.h
+ * 把服务器收发的流量记录到 mmap 的只追加二进制文件，给 replay_client 离线重放
+ *
+ * 文件格式：capture_header 后面紧跟若干条 capture_record，
+ * 每条 record 后面跟 payload_len 字节的数据，整条记录按 8 字节对齐
+ *
+ * 多个线程同时记录时位置是先抢后写的，后抢的可能先写完，
+ * 所以每条记录写完最后才置上 CAPTURE_COMMITTED，读的时候遇到没置上的就停下
+ */
+
+#ifndef __capture_h__
+#define __capture_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAPTURE_MAGIC 0x31504345	// "ECP1"
+#define CAPTURE_VERSION 2
+#define CAPTURE_DEFAULT_SIZE (1UL << 30)	// 默认预留 1G 的文件空间
+#define CAPTURE_COMMITTED 0x1		// capture_record::flags，这条记录已经写完
+
+enum capture_dir
+{
+	CAPTURE_OPEN = 0,	// 新连接
+	CAPTURE_IN = 1,		// client -> server
+	CAPTURE_OUT = 2,	// server -> client
+	CAPTURE_CLOSE = 3,	// 连接关闭
+};
+
+struct capture_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t start_ns;		// 开始记录时的 CLOCK_REALTIME，只用来展示
+	uint64_t data_size;		// header 之后有效数据的长度，capture_close 时才写，没正常关闭时是 0
+	uint64_t dropped;		// 文件写满后丢掉的记录数
+};
+
+struct capture_record
+{
+	uint64_t ts_ns;			// 相对开始记录的时间
+	uint32_t conn_id;
+	uint8_t dir;
+	uint8_t flags;			// CAPTURE_COMMITTED
+	uint8_t reserved[2];
+	uint32_t len;			// 实际收发的字节数
+	uint32_t payload_len;	// 后面跟着的数据长度，不记 payload 时为 0
+};
+
+/* 打开记录文件，max_size 是预留的文件大小，写满之后的记录直接丢掉 */
+bool capture_open(const char *path, bool with_payload, size_t max_size = CAPTURE_DEFAULT_SIZE);
+
+/* 是否在记录，没打开时 capture_write 什么也不做 */
+bool capture_enabled();
+
+/* 分配一个新的连接 id，fd 会被复用，不能直接拿来当 id */
+uint32_t capture_new_conn();
+
+void capture_write(uint32_t conn_id, capture_dir dir, const void *data, size_t len);
+
+/* 截断文件到实际大小并关闭 */
+void capture_close();
+
+#endif
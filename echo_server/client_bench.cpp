@@ -0,0 +1,323 @@
+/*
+ * client_bench.cpp
+ * pipeline_client 的基准测试：对着 echo 服务器一直发固定大小的消息，报告每秒请求数、吞吐、
+ * 平均几个请求合成一次写和每个请求从 send 到回调的延迟
+ *
+ * -B 换成阻塞的对照组：每个连接一个线程，发一条收完再发下一条，再加 -C 就是每个请求新建一个连接，
+ * 也就是原来各个服务自己写的那种用法：
+ *   ./client_bench -c 4 -d 16 -s 64
+ *   ./client_bench -B -c 4 -s 64
+ *   ./client_bench -B -C -c 4 -s 64
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <ctime>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <uv.h>
+#include "pipeline_client.h"
+#include "histogram.h"
+
+using namespace std;
+
+#define PORT "12321"			// 连接端口
+#define BENCH_DURATION 5
+#define BENCH_SIZE 64			// 每个请求多少字节
+#define BENCH_TIMEOUT 5			// 阻塞模式收发超时的秒数
+
+struct bench_result
+{
+	uint64_t requests = 0;
+	uint64_t errors = 0;		// 回复内容不对或者连接出错
+	histogram latency;
+};
+
+/* 异步模式里一个在路上的请求，回调里再用它发下一个 */
+struct bench_slot
+{
+	struct bench_state *bench;
+	uint64_t start;
+};
+
+struct bench_state
+{
+	pipeline_client *client;
+	string payload;
+	uint64_t deadline;
+	bench_result result;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void send_slot(bench_slot *slot);
+
+static void on_reply(void *arg, int status, const char *data, size_t len)
+{
+	bench_slot *slot = (bench_slot*)arg;
+	bench_state *bench = slot->bench;
+	uint64_t now = now_ns();
+	if (status < 0)
+	{
+		// 一个连接断了上面的请求会一起失败，只打印第一个
+		if (status != UV_ECANCELED && bench->result.errors == 0)
+			cerr << "request ERROR: " << uv_strerror(status) << endl;
+		++bench->result.errors;
+		if (bench->client->pending() == 0)
+			bench->client->close();
+		return;
+	}
+	if (len != bench->payload.size() || memcmp(data, bench->payload.data(), len) != 0)
+		++bench->result.errors;
+
+	++bench->result.requests;
+	bench->result.latency.record(now - slot->start);
+	if (now < bench->deadline)
+		send_slot(slot);
+	else if (bench->client->pending() == 0)
+		bench->client->close();
+}
+
+static void send_slot(bench_slot *slot)
+{
+	bench_state *bench = slot->bench;
+	slot->start = now_ns();
+	bench->client->send(bench->payload.data(), bench->payload.size(), on_reply, slot);
+}
+
+/* 一直保持 window 个请求在路上，到时间以后不再补发，收完最后一个回复就关掉 */
+double run_async(const char *host, const char *port, const client_options &options, int window, int duration, bench_state &bench)
+{
+	uv_loop_t *loop = uv_default_loop();
+	pipeline_client client(loop, options);
+	int ret = client.connect(host, port);
+	if (ret < 0)
+	{
+		cerr << "connect ERROR: " << uv_strerror(ret) << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	bench.client = &client;
+	vector<bench_slot> slots(window);
+	uint64_t start = now_ns();
+	bench.deadline = start + (uint64_t)duration * 1000000000;
+	for (auto &slot : slots)
+	{
+		slot.bench = &bench;
+		send_slot(&slot);
+	}
+	uv_run(loop, UV_RUN_DEFAULT);
+	double elapsed = (now_ns() - start) / 1e9;
+
+	const client_stats &stats = client.stats();
+	if (stats.writes)
+		cout << setprecision(2) << (double)stats.requests / stats.writes << " requests per write, " << stats.queued << " queued" << endl;
+	uv_loop_close(loop);
+	return elapsed;
+}
+
+int connect_server(const char *host, const char *port)
+{
+	struct addrinfo hints, *server_addr;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(host, port, &hints, &server_addr);
+	if (ret != 0)
+	{
+		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int sock = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+	if (sock == -1 || connect(sock, server_addr->ai_addr, server_addr->ai_addrlen) == -1)
+	{
+		if (sock != -1)
+			close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(server_addr);
+	if (sock == -1)
+		return -1;
+
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	struct timeval tv = {BENCH_TIMEOUT, 0};
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return sock;
+}
+
+/* 阻塞地发一个请求并收完回复 */
+bool blocking_request(int sock, const string &payload, vector<char> &buf)
+{
+	size_t sent = 0;
+	while (sent < payload.size())
+	{
+		ssize_t n = send(sock, payload.data() + sent, payload.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+
+	size_t got = 0;
+	while (got < payload.size())
+	{
+		ssize_t n = recv(sock, buf.data() + got, payload.size() - got, 0);
+		if (n <= 0)
+			return false;
+		got += n;
+	}
+	return memcmp(buf.data(), payload.data(), payload.size()) == 0;
+}
+
+void blocking_worker(const char *host, const char *port, const string &payload, bool reconnect, uint64_t deadline, bench_result &result)
+{
+	vector<char> buf(payload.size());
+	int sock = -1;
+	while (now_ns() < deadline)
+	{
+		uint64_t start = now_ns();
+		if (sock == -1 && (sock = connect_server(host, port)) == -1)
+		{
+			perror("connect ERROR");
+			++result.errors;
+			return;
+		}
+		bool ok = blocking_request(sock, payload, buf);
+		if (!ok || reconnect)
+		{
+			close(sock);
+			sock = -1;
+		}
+		if (!ok)
+		{
+			++result.errors;
+			continue;
+		}
+		++result.requests;
+		result.latency.record(now_ns() - start);
+	}
+	if (sock != -1)
+		close(sock);
+}
+
+double run_blocking(const char *host, const char *port, int conns, int duration, const string &payload, bool reconnect, bench_result &total)
+{
+	vector<bench_result> results(conns);
+	vector<thread> threads;
+	uint64_t start = now_ns();
+	uint64_t deadline = start + (uint64_t)duration * 1000000000;
+	for (int i = 0; i < conns; ++i)
+		threads.push_back(thread(blocking_worker, host, port, cref(payload), reconnect, deadline, ref(results[i])));
+	for (auto &t : threads)
+		t.join();
+	double elapsed = (now_ns() - start) / 1e9;
+
+	for (auto &r : results)
+	{
+		total.requests += r.requests;
+		total.errors += r.errors;
+		total.latency.merge(r.latency);
+	}
+	return elapsed;
+}
+
+void usage(const char *prog)
+{
+	client_options options;
+	cerr << "usage: " << prog << " [-h host] [-p port] [-c conns] [-d depth] [-w window] [-b batch] [-s size] [-t duration] [-B [-C]]" << endl;
+	cerr << "  -c  connections, default " << options.connections << endl;
+	cerr << "  -d  requests in flight per connection, default " << options.depth << endl;
+	cerr << "  -w  requests kept in flight in total, default conns * depth" << endl;
+	cerr << "  -b  write as soon as this many bytes are batched, default " << options.batch_bytes << endl;
+	cerr << "  -s  request size, default " << BENCH_SIZE << endl;
+	cerr << "  -t  seconds to run, default " << BENCH_DURATION << endl;
+	cerr << "  -B  blocking client instead: a thread per connection, one request at a time" << endl;
+	cerr << "  -C  with -B, a new connection for every request" << endl;
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *host = "127.0.0.1";
+	const char *port = PORT;
+	client_options options;
+	int window = 0;
+	size_t size = BENCH_SIZE;
+	int duration = BENCH_DURATION;
+	bool blocking = false;
+	bool reconnect = false;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "h:p:c:d:w:b:s:t:BC")) != -1)
+	{
+		switch (ch)
+		{
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'c': options.connections = atoi(optarg); break;
+		case 'd': options.depth = atoi(optarg); break;
+		case 'w': window = atoi(optarg); break;
+		case 'b': options.batch_bytes = strtoul(optarg, NULL, 10); break;
+		case 's': size = strtoul(optarg, NULL, 10); break;
+		case 't': duration = atoi(optarg); break;
+		case 'B': blocking = true; break;
+		case 'C': reconnect = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (options.connections <= 0 || options.depth <= 0 || window < 0 || size == 0 || duration <= 0 || (reconnect && !blocking))
+		usage(argv[0]);
+	if (window == 0)
+		window = options.connections * options.depth;
+
+	string payload(size, 0);
+	for (size_t i = 0; i < size; ++i)
+		payload[i] = 'a' + i % 26;
+
+	bench_state bench;
+	bench.payload = payload;
+	double elapsed;
+	if (blocking)
+	{
+		cout << "blocking, " << options.connections << " threads, " << (reconnect ? "a connection per request" : "keep-alive")
+			<< ", " << size << " bytes per request" << endl;
+		elapsed = run_blocking(host, port, options.connections, duration, payload, reconnect, bench.result);
+	}
+	else
+	{
+		cout << "pipelined, " << options.connections << " connections, depth " << options.depth << ", window " << window
+			<< ", " << size << " bytes per request" << endl;
+		elapsed = run_async(host, port, options, window, duration, bench);
+	}
+
+	bench_result &result = bench.result;
+	cout << fixed << setprecision(1)
+		<< result.requests / elapsed << " requests/s, "
+		<< setprecision(1) << result.requests * size / elapsed / 1e6 << " MB/s"
+		<< " (" << result.requests << " requests in " << setprecision(2) << elapsed << "s";
+	if (result.errors)
+		cout << ", " << result.errors << " errors";
+	cout << ")" << endl;
+	cout << setprecision(6);
+	cout.unsetf(ios::floatfield);
+	result.latency.print("request");
+	return result.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,275 @@
+/*
+ * connect_bench.cpp
+ * 短连接的基准测试：每次新建一个连接，发一条消息，收完回包就关掉，
+ * 比较普通的 connect 和 TCP Fast Open 的延迟，并统计 SYN 里带的数据有多少被服务器收下了
+ *
+ * TFO 的 cookie 由内核按服务器地址缓存，第一次连接只是拿到 cookie，之后的连接才会把数据放进 SYN，
+ * 服务器要用 --fastopen 启动，net.ipv4.tcp_fastopen 要打开 client 和 server 对应的位（本机测试设成 3）
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <ctime>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "server_core.h"
+#include "histogram.h"
+
+using namespace std;
+
+#define PORT "12321"			// 连接端口
+#define BENCH_COUNT 10000		// 每种模式跑多少次
+#define BENCH_SIZE 64			// 每次发多少字节，超过一个 MSS 的部分不会放进 SYN
+#define BENCH_TIMEOUT 5			// 收发超时的秒数
+
+enum connect_mode
+{
+	MODE_PLAIN,		// connect 完再 send，数据要等握手完成
+	MODE_CONNECT,	// 设了 TCP_FASTOPEN_CONNECT 的 connect，数据跟着第一次 send 放进 SYN
+	MODE_SENDTO,	// 不 connect，直接 sendto MSG_FASTOPEN
+	MODE_COUNT,
+};
+
+static const char *g_mode_names[MODE_COUNT] = {"plain", "connect", "sendto"};
+
+struct mode_stat
+{
+	histogram latency;		// 从 socket 到收完回包
+	uint64_t syn_data = 0;	// SYN 里的数据被服务器确认了的次数
+	uint64_t errors = 0;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+addrinfo *resolve(const char *host, const char *port)
+{
+	struct addrinfo hints, *server_addr;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(host, port, &hints, &server_addr);
+	if (ret != 0)
+	{
+		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl;
+		exit(EXIT_FAILURE);
+	}
+	return server_addr;
+}
+
+static bool send_all(int sock, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t ret = send(sock, data, len, MSG_NOSIGNAL);
+		if (ret == -1)
+		{
+			perror("send ERROR");
+			return false;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/* 建连接、发 msg、收回同样长度的数据，成功返回 true，latency 和 syn_data 记到 stat 里 */
+bool request_once(const addrinfo *ai, int mode, const string &msg, vector<char> &buf, mode_stat &stat)
+{
+	int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (sock == -1)
+	{
+		perror("socket ERROR");
+		return false;
+	}
+
+	struct timeval tv = {BENCH_TIMEOUT, 0};
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (mode == MODE_CONNECT)
+	{
+		int on = 1;
+		if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) == -1)
+		{
+			perror("fastopen connect ERROR");
+			close(sock);
+			return false;
+		}
+	}
+
+	uint64_t start = now_ns();
+	const char *data = msg.data();
+	size_t len = msg.size();
+	if (mode == MODE_SENDTO)
+	{
+		// 没有 cookie 时内核先正常握手，阻塞的 socket 等连上之后再把数据发出去
+		ssize_t ret = sendto(sock, data, len, MSG_FASTOPEN | MSG_NOSIGNAL, ai->ai_addr, ai->ai_addrlen);
+		if (ret == -1)
+		{
+			perror("sendto ERROR");
+			close(sock);
+			return false;
+		}
+		data += ret;
+		len -= ret;
+	}
+	else if (connect(sock, ai->ai_addr, ai->ai_addrlen) == -1)
+	{
+		// TCP_FASTOPEN_CONNECT 的 connect 有 cookie 时直接返回 0，SYN 推迟到第一次 send 才发
+		perror("connect ERROR");
+		close(sock);
+		return false;
+	}
+
+	if (!send_all(sock, data, len))
+	{
+		close(sock);
+		return false;
+	}
+
+	size_t received = 0;
+	while (received < msg.size())
+	{
+		ssize_t ret = recv(sock, buf.data(), buf.size(), 0);
+		if (ret <= 0)
+		{
+			if (ret == 0)
+				cerr << "server closed after " << received << " bytes" << endl;
+			else
+				perror("recv ERROR");
+			close(sock);
+			return false;
+		}
+		received += ret;
+	}
+	stat.latency.record(now_ns() - start);
+
+	struct tcp_info info;
+	socklen_t info_len = sizeof(info);
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA))
+		++stat.syn_data;
+
+	close(sock);
+	return true;
+}
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-h host] [-p port] [-n count] [-s size] [-m mode]" << endl;
+	cerr << "  -n  requests per mode, default " << BENCH_COUNT << endl;
+	cerr << "  -s  bytes per request, default " << BENCH_SIZE << endl;
+	cerr << "  -m  plain, connect (TCP_FASTOPEN_CONNECT) or sendto (MSG_FASTOPEN), may repeat, default all three" << endl;
+	cerr << "  start the server with --fastopen QLEN, modes run interleaved so they see the same conditions" << endl;
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *host = "127.0.0.1";
+	const char *port = PORT;
+	int count = BENCH_COUNT;
+	size_t size = BENCH_SIZE;
+	vector<int> modes;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "h:p:n:s:m:")) != -1)
+	{
+		switch (ch)
+		{
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'n': count = atoi(optarg); break;
+		case 's': size = strtoul(optarg, NULL, 10); break;
+		case 'm':
+		{
+			int mode = 0;
+			while (mode < MODE_COUNT && strcmp(g_mode_names[mode], optarg) != 0)
+				++mode;
+			if (mode == MODE_COUNT)
+				usage(argv[0]);
+			modes.push_back(mode);
+			break;
+		}
+		default: usage(argv[0]);
+		}
+	}
+	if (count <= 0 || size == 0)
+		usage(argv[0]);
+	if (modes.empty())
+		modes = {MODE_PLAIN, MODE_CONNECT, MODE_SENDTO};
+
+	// 这里只能看本机的设置，服务器在别的机器上要自己确认
+	int tfo = tcp_fastopen_sysctl();
+	if (tfo >= 0 && !(tfo & TFO_CLIENT))
+		cerr << "warning: net.ipv4.tcp_fastopen is " << tfo << ", needs bit " << TFO_CLIENT << " to send data in SYN" << endl;
+	if (tfo >= 0 && !(tfo & TFO_SERVER) && (strcmp(host, "127.0.0.1") == 0 || strcmp(host, "localhost") == 0))
+		cerr << "warning: net.ipv4.tcp_fastopen is " << tfo << ", a local server needs bit " << TFO_SERVER << " too" << endl;
+
+	addrinfo *ai = resolve(host, port);
+	string msg(size, 'x');
+	vector<char> buf(size < 65536 ? size : 65536);
+	mode_stat stats[MODE_COUNT];
+
+	cout << count << " requests of " << size << " bytes per mode to " << host << ":" << port << endl;
+
+	// 轮流跑各个模式，机器的状态变化对每个模式的影响一样
+	uint64_t start = now_ns();
+	for (int i = 0; i < count; ++i)
+	{
+		for (int mode : modes)
+		{
+			if (!request_once(ai, mode, msg, buf, stats[mode]))
+				++stats[mode].errors;
+		}
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+	freeaddrinfo(ai);
+
+	cout << "done in " << elapsed << "s" << endl;
+	bool failed = false;
+	for (int mode : modes)
+	{
+		mode_stat &stat = stats[mode];
+		stat.latency.print(g_mode_names[mode]);
+		uint64_t ok = stat.latency.count();
+		cout << "  data in SYN " << stat.syn_data << "/" << ok
+			<< " (" << fixed << setprecision(1) << (ok ? stat.syn_data * 100.0 / ok : 0) << "%)"
+			<< ", errors " << stat.errors << endl;
+		cout << setprecision(6);
+		cout.unsetf(ios::floatfield);
+		if (stat.errors)
+			failed = true;
+	}
+
+	// 跟 plain 比，省掉的应该正好是一次握手的 RTT
+	if (stats[MODE_PLAIN].latency.count())
+	{
+		const histogram &plain = stats[MODE_PLAIN].latency;
+		for (int mode : modes)
+		{
+			const histogram &h = stats[mode].latency;
+			if (mode == MODE_PLAIN || h.count() == 0)
+				continue;
+			cout << g_mode_names[mode] << " vs plain: avg " << (h.mean() - plain.mean()) / 1000.0 << "us"
+				<< " p50 " << ((double)h.percentile(0.5) - plain.percentile(0.5)) / 1000.0 << "us"
+				<< " p99 " << ((double)h.percentile(0.99) - plain.percentile(0.99)) / 1000.0 << "us" << endl;
+		}
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -11,128 +11,297 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <vector>
-#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <ctime>
+#include "capture.h"
+#include "arena.h"
+#include "histogram.h"
+#include "server_core.h"
+#include "resp.h"
+#include "http.h"
+#include "perf_counter.h"
+#include "trace.h"
+#include "watchdog.h"
 
 using namespace std;
 
-#define PORT "12321"	// 连接端口
-#define BACKLOG 10		// 等待连接队列大小
-#define ECHO_LEN 1024
+#define SHARED_MAX_EVENTS 8		// 共享 epoll 时每个线程一次只拿几个事件，避免慢连接后面压着一堆事件
+#define MAX_EVENTS 1024			// 单线程 loop 一次最多拿多少事件，剩下的下次 epoll_wait 再拿
 
-/* 拿 ipv4 或者 ipv6 的 in_addr */
-const void *get_sin_addr(const sockaddr_storage *ss)
+/*
+ * 单线程 loop 的连接记录，按 fd 下标放在一个 vector 里，不用每个连接单独分配；
+ * 地址只在打日志的时候才从 fd 取，空闲连接只占这几十个字节加上内核的 socket
+ */
+struct client_info
 {
-	if (ss->ss_family == AF_INET)
-		return &(((const sockaddr_in*)ss)->sin_addr);
-	else
-		return &(((const sockaddr_in6*)ss)->sin6_addr);
+	uint32_t conn_id;	// 记录流量用的连接 id
+	uint32_t want;		// 注册在 epoll 里的事件
+	string in;			// kv 和 http 模式下还不完整的请求
+	string out;			// 还没发出去的回复，echo 模式下是 send 没发完的部分
+};
+
+/* 共享 epoll 模式下的连接，EPOLLONESHOT 保证同一时刻只有一个线程在处理它 */
+struct conn_t
+{
+	int fd;
+	bool listener;		// 监听 socket，可读时去 accept
+	uint32_t conn_id;
+	string in;
+	string out;
+};
+
+/* 每个 loop 线程的统计，只有本线程写 */
+struct loop_stats
+{
+	uint64_t start_ns;
+	atomic<uint64_t> busy_ns;	// 处理事件的时间，不包括 epoll_wait 里等待的时间
+	atomic<uint64_t> events;
+	histogram latency;			// 从 epoll_wait 返回到这个事件处理完的时间
+	loop_counters counters;		// 开了 -P 才有
+};
+
+/* kv 和 http 模式都是收到完整的请求再回复，由 feed 解析 */
+typedef bool (*feed_fn)(string &in, string &out, const char *data, size_t len);
+feed_fn g_feed = NULL;						// NULL 表示 echo
+int g_date_timer = -1;						// http 模式下每秒刷新 Date 头的 timerfd
+int g_stop_fd = -1;							// 记录流量时收到 SIGINT/SIGTERM 写这个 eventfd，各个 loop 处理完手上这批就退出
+volatile sig_atomic_t g_print_stats = 0;	// 收到 SIGUSR1 时在 loop 里打印统计
+vector<loop_stats*> g_loop_stats;			// 线程启动前就创建好，之后不再改
+uint64_t g_counter_every = 0;				// 每多少轮采一次硬件计数器，0 不采
+
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+loop_stats *new_loop_stats()
+{
+	loop_stats *stats = new loop_stats;
+	stats->start_ns = now_ns();
+	stats->busy_ns = 0;
+	stats->events = 0;
+	g_loop_stats.push_back(stats);
+	return stats;
 }
 
-int make_sock()
+void print_loop_stats()
 {
-	struct addrinfo hints, *server_addr;
+	uint64_t now = now_ns();
+	histogram total;
+	for (size_t i = 0; i < g_loop_stats.size(); ++i)
+	{
+		loop_stats *stats = g_loop_stats[i];
+		uint64_t busy = stats->busy_ns.load(memory_order_relaxed);
+		cout << "thread " << i << ": utilization " << 100.0 * busy / (now - stats->start_ns) << "%"
+			<< " events " << stats->events.load(memory_order_relaxed) << endl;
+		string name = "thread " + to_string(i);
+		stats->counters.print(name.c_str());
+		total.merge(stats->latency);
+	}
+	total.print("event latency");
+}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;		// ipv4 or ipv6
-	hints.ai_socktype = SOCK_STREAM;	
-	hints.ai_flags = AI_PASSIVE;		// use bind
+/* 计数器只统计打开它的线程，要在 loop 线程里打开 */
+void open_counters(loop_stats *stats)
+{
+	if (g_counter_every && !stats->counters.open(g_counter_every))
+		perror("perf_event_open ERROR, running without counters");
+}
 
-	int ret = getaddrinfo(NULL, PORT, &hints, &server_addr);
-	if (ret != 0)
+/* 多个线程都可能被信号打断，只让一个线程打印 */
+void check_print_stats()
+{
+	static atomic<int> printing(0);
+	if (!g_print_stats || printing.exchange(1))
+		return;
+	g_print_stats = 0;
+	arena_print_stats();
+	print_loop_stats();
+	watchdog_print_stats();
+	printing = 0;
+}
+
+void add_sock(int epollfd, int sock)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = sock;
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) == -1) 
 	{
-		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl; 
+		perror("epoll_ctl ERROR");
 		exit(EXIT_FAILURE);
 	}
+}
 
-	// 循环找可用的 addr
-	int server_sock;
-	struct addrinfo *p;
-	for(p = server_addr; p != NULL; p = p->ai_next)
-	{
-		server_sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (server_sock == -1)
-		{
-			perror("socket ERROR");
-			continue;
-		}
+void del_sock(int epollfd, int sock)
+{
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, sock , NULL);
+}
 
-		int opt = 1;
-		
-		ret = setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-		if (ret == -1)
-		{
-			perror("reuseaddr ERROR");
-			exit(EXIT_FAILURE);
-		}
+void mod_sock(int epollfd, int sock, uint32_t events)
+{
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.fd = sock;
 
-		ret = bind(server_sock, p->ai_addr, p->ai_addrlen);
+	if (epoll_ctl(epollfd, EPOLL_CTL_MOD, sock, &ev) == -1)
+		perror("epoll_ctl mod ERROR");
+}
+
+/* 尽量把回复发出去，发不完的留在 out 里等可写，出错返回 false */
+bool flush_out(int fd, uint32_t conn_id, string &out)
+{
+	size_t sent = 0;
+	while (sent < out.size())
+	{
+		TRACE_SCOPE("send");
+		int ret = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
 		if (ret == -1)
 		{
-			close(server_sock);
-			perror("bind ERROR");
-			continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			perror("send ERROR");
+			return false;
 		}
-		break;
+		capture_write(conn_id, CAPTURE_OUT, out.data() + sent, ret);
+		sent += ret;
 	}
+	out.erase(0, sent);
+
+	// 积压的回复发完就把 buffer 还回去，不让闲下来的连接一直占着
+	if (out.empty())
+		out.shrink_to_fit();
+	return true;
+}
 
-	if (p == NULL)
+/*
+ * 处理一次可读或者可写，返回接下来要等的事件，0 表示连接要关掉
+ * 回复没发完之前不读新的请求，client 只发不收时回复不会无限堆积
+ */
+uint32_t request_event(int fd, uint32_t conn_id, string &in, string &out, char *buf)
+{
+	if (!flush_out(fd, conn_id, out))
+		return 0;
+	if (!out.empty())
+		return EPOLLOUT;
+
+	int ret;
 	{
-		cerr << "failed to make socket!" << endl;
-		exit(EXIT_FAILURE);
+		TRACE_SCOPE("recv");
+		ret = recv(fd, buf, g_config.buffer_size, 0);
+	}
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return EPOLLIN;
+	if (ret <= 0)
+	{
+		if (ret < 0)
+			perror("recv ERROR");
+		return 0;
 	}
 
-	freeaddrinfo(server_addr);
+	capture_write(conn_id, CAPTURE_IN, buf, ret);
 
-	ret = listen(server_sock, BACKLOG);
-	if (ret == -1)
+	// echo 直接从 buf 发，client 收得慢时才把没发完的拷到 out
+	if (g_feed == NULL)
 	{
-		perror("listen ERROR");
-		exit(EXIT_FAILURE);
+		TRACE_SCOPE("send");
+		int sent = send(fd, buf, ret, MSG_NOSIGNAL);
+		if (sent == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				perror("send ERROR");
+				return 0;
+			}
+			sent = 0;
+		}
+		if (sent > 0)
+			capture_write(conn_id, CAPTURE_OUT, buf, sent);
+		if (sent == ret)
+			return EPOLLIN;
+		out.assign(buf + sent, ret - sent);
+		return EPOLLOUT;
+	}
+
+	bool ok;
+	{
+		TRACE_SCOPE("feed");
+		ok = g_feed(in, out, buf, ret);
 	}
 
-	return server_sock;
+	// 协议错误或者 http 不要 keep-alive 时也把回复发出去再关
+	if (!flush_out(fd, conn_id, out) || !ok)
+		return 0;
+	return out.empty() ? EPOLLIN : EPOLLOUT;
 }
 
-void setnonblocking(int fd) 
+/* 到点了刷新 http 的 Date 头，timerfd 要读掉才不会一直可读 */
+void on_date_timer()
 {
-	int flag = fcntl(fd, F_GETFL, 0);
-	if (flag < 0) 
-	{
-		perror("fcntl F_GETFL ERROR");
-		exit(EXIT_FAILURE);
-	}
-	if (fcntl(fd, F_SETFL, flag | O_NONBLOCK) < 0) 
+	uint64_t expirations;
+	if (read(g_date_timer, &expirations, sizeof(expirations)) > 0)
+		http_update_date();
+}
+
+int make_date_timer()
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (fd == -1)
 	{
-		perror("fcntl F_SETFL ERROR");
+		perror("timerfd_create ERROR");
 		exit(EXIT_FAILURE);
 	}
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = 1;
+	its.it_interval.tv_sec = 1;
+	timerfd_settime(fd, 0, &its, NULL);
+	return fd;
 }
 
-void add_sock(int epollfd, int sock)
+void close_client(int epollfd, vector<client_info> &clients, int sock)
 {
-	struct epoll_event ev;
-	ev.events = EPOLLIN;
-	ev.data.fd = sock;
-
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) == -1) 
+	TRACE_SCOPE("close");
+	client_info &info = clients[sock];
 	{
-		perror("epoll_ctl ERROR");
-		exit(EXIT_FAILURE);
+		// 对方 RST 之后 getpeername 会失败，这时地址是空的
+		TRACE_SCOPE("log");
+		cout << "client closed " << get_sock_addr(sock) << endl;
 	}
+	capture_write(info.conn_id, CAPTURE_CLOSE, NULL, 0);
+	del_sock(epollfd, sock);
+	close(sock);
+
+	// fd 会被下一个连接复用，留下的 buffer 要真正释放掉
+	info.in.clear();
+	info.in.shrink_to_fit();
+	info.out.clear();
+	info.out.shrink_to_fit();
 }
 
-void del_sock(int epollfd, int sock)
+bool is_listener(const vector<int> &listeners, int sock)
 {
-	epoll_ctl(epollfd, EPOLL_CTL_DEL, sock , NULL);
+	for (int fd : listeners)
+		if (fd == sock)
+			return true;
+	return false;
 }
 
-void main_loop(int server_sock)
+void main_loop(const vector<int> &listeners)
 {
-	vector<epoll_event> events;
+	vector<epoll_event> events(MAX_EVENTS);
 
 	int epollfd = epoll_create(1);
 	if (epollfd == -1) 
@@ -141,76 +310,426 @@ void main_loop(int server_sock)
 	   exit(EXIT_FAILURE);
 	}
 
-	add_sock(epollfd, server_sock);
-
-	char buf[ECHO_LEN];
-	char addr_str[INET6_ADDRSTRLEN];
-	unordered_map<int, string> addr_map;
-	addr_map.emplace(server_sock, "");
-
-	struct sockaddr_storage client_addr;
-	socklen_t addr_size = sizeof(client_addr);
-	for (;;)
+	char *buf = (char*)arena_alloc(g_config.buffer_size);
+	vector<client_info> clients;
+	for (int server_sock : listeners)
+		add_sock(epollfd, server_sock);
+	if (g_date_timer != -1)
+		add_sock(epollfd, g_date_timer);
+	if (g_stop_fd != -1)
+		add_sock(epollfd, g_stop_fd);
+
+	loop_stats *stats = new_loop_stats();
+	open_counters(stats);
+	loop_heartbeat *heartbeat = watchdog_register("loop");
+	bool stopping = false;
+	while (!stopping)
 	{
-		if (events.size() < addr_map.size())
-			events.resize(addr_map.size());
-
-		int nfds = epoll_wait(epollfd, events.data(), events.size(), -1);
+		int nfds;
+		{
+			TRACE_SCOPE("epoll_wait");
+			nfds = epoll_wait(epollfd, events.data(), events.size(), -1);
+		}
+		if (nfds == -1 && errno == EINTR)
+		{
+			check_print_stats();
+			trace_check();
+			continue;
+		}
 		if (nfds == -1)
 		{
 			perror("epoll_wait ERROR");
 			exit(EXIT_FAILURE);
 		}
 
+		// 同一批里后面的事件要等前面的处理完，这段排队时间也算到延迟里，
+		// 开始处理第 n 个时第 n - 1 个刚处理完，最后一个在循环外面记
+		uint64_t woke = now_ns();
+		watchdog_begin(heartbeat, woke);
 		for (int n = 0; n < nfds; ++n)
 		{
-			// server accept
-			if (events[n].data.fd == server_sock)
+			if (n > 0)
+				stats->latency.record(now_ns() - woke);
+
+			// server accept, tcp 和 unix socket 的连接一样处理
+			if (is_listener(listeners, events[n].data.fd))
 			{
-				int client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_size);
+				TRACE_SCOPE("accept");
+				int client_sock = accept(events[n].data.fd, NULL, NULL);
 				if (client_sock == -1)
 				{
 					perror("accept ERROR");
 					continue;
 				}
 
-				inet_ntop(client_addr.ss_family, get_sin_addr(&client_addr), addr_str, sizeof(addr_str));
-				cout << "client from " << addr_str << endl;
+				if ((size_t)client_sock >= clients.size())
+					clients.resize(client_sock + 1);
+				client_info &info = clients[client_sock];
+				info.want = EPOLLIN;
+				{
+					TRACE_SCOPE("log");
+					cout << "client from " << get_sock_addr(client_sock) << endl;
+				}
 
 				setnonblocking(client_sock);
 				add_sock(epollfd, client_sock);
-				addr_map.emplace(client_sock, addr_str);
+
+				info.conn_id = capture_new_conn();
+				capture_write(info.conn_id, CAPTURE_OPEN, NULL, 0);
 			}
 
-			// recv from client
-			else if (events[n].events & EPOLLIN)
+			else if (events[n].data.fd == g_date_timer)
+			{
+				on_date_timer();
+			}
+
+			else if (events[n].data.fd == g_stop_fd)
+			{
+				stopping = true;
+			}
+
+			// echo, kv or http request from client
+			else
 			{
 				int sock = events[n].data.fd;
-				int ret = recv(events[n].data.fd, buf, ECHO_LEN, 0);
-				if (ret <= 0)
+				client_info &info = clients[sock];
+				uint32_t want = request_event(sock, info.conn_id, info.in, info.out, buf);
+				if (want == 0)
 				{
-					if (ret < 0)
-						perror("recv ERROR");
-					else
-						cout << "client closed " << addr_map[sock] << endl;
-
-					close(sock);
-					del_sock(epollfd, sock);
-					addr_map.erase(sock);
+					close_client(epollfd, clients, sock);
 					continue;
 				}
-				send(sock, buf, ret, 0);
+				if (want != info.want)
+				{
+					mod_sock(epollfd, sock, want);
+					info.want = want;
+				}
 			}
 		}
 
+		uint64_t done = now_ns();
+		watchdog_end(heartbeat, done);
+		stats->latency.record(done - woke);
+		stats->busy_ns.store(stats->busy_ns.load(memory_order_relaxed) + done - woke, memory_order_relaxed);
+		stats->events.store(stats->events.load(memory_order_relaxed) + nfds, memory_order_relaxed);
+		stats->counters.tick(nfds);
 	}
 }
 
-int main()
+void rearm_sock(int epollfd, conn_t *c, uint32_t events)
 {
-	int server_sock = make_sock();
+	struct epoll_event ev;
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = c;
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+		perror("epoll_ctl rearm ERROR");
+}
+
+void accept_clients(int epollfd, conn_t *listener)
+{
+	TRACE_SCOPE("accept");
+	for (;;)
+	{
+		int client_sock = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK);
+		if (client_sock == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept ERROR");
+			break;
+		}
+
+		conn_t *c = new conn_t;
+		c->fd = client_sock;
+		c->listener = false;
+		{
+			TRACE_SCOPE("log");
+			cout << "client from " << get_sock_addr(client_sock) << endl;
+		}
+		c->conn_id = capture_new_conn();
+		capture_write(c->conn_id, CAPTURE_OPEN, NULL, 0);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = c;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client_sock, &ev) == -1)
+		{
+			perror("epoll_ctl ERROR");
+			close(client_sock);
+			delete c;
+		}
+	}
+	rearm_sock(epollfd, listener, EPOLLIN);
+}
+
+void close_conn(conn_t *c)
+{
+	TRACE_SCOPE("close");
+	{
+		TRACE_SCOPE("log");
+		cout << "client closed " << get_sock_addr(c->fd) << endl;
+	}
+
+	// close 会把 fd 从 epoll 里去掉，ONESHOT 没有重新注册，别的线程不会再拿到 c
+	capture_write(c->conn_id, CAPTURE_CLOSE, NULL, 0);
+	close(c->fd);
+	delete c;
+}
+
+void worker_loop(int epollfd, int id, loop_stats *stats)
+{
+	struct epoll_event events[SHARED_MAX_EVENTS];
+	char *buf = (char*)arena_alloc(g_config.buffer_size);
+	loop_heartbeat *heartbeat = watchdog_register("thread " + to_string(id));
+	open_counters(stats);
+
+	bool stopping = false;
+	while (!stopping)
+	{
+		int nfds;
+		{
+			TRACE_SCOPE("epoll_wait");
+			nfds = epoll_wait(epollfd, events, SHARED_MAX_EVENTS, -1);
+		}
+		if (nfds == -1 && errno == EINTR)
+		{
+			check_print_stats();
+			trace_check();
+			continue;
+		}
+		if (nfds == -1)
+		{
+			perror("epoll_wait ERROR");
+			exit(EXIT_FAILURE);
+		}
+
+		uint64_t woke = now_ns();
+		watchdog_begin(heartbeat, woke);
+		for (int n = 0; n < nfds; ++n)
+		{
+			conn_t *c = (conn_t*)events[n].data.ptr;
+			if (c->listener)
+			{
+				accept_clients(epollfd, c);
+			}
+			else if (c->fd == g_date_timer)
+			{
+				on_date_timer();
+				rearm_sock(epollfd, c, EPOLLIN);
+			}
+			else if (c->fd == g_stop_fd)
+			{
+				stopping = true;
+			}
+			else
+			{
+				uint32_t want = request_event(c->fd, c->conn_id, c->in, c->out, buf);
+				if (want)
+					rearm_sock(epollfd, c, want);
+				else
+					close_conn(c);
+			}
+
+			stats->latency.record(now_ns() - woke);
+		}
+
+		uint64_t done = now_ns();
+		watchdog_end(heartbeat, done);
+		stats->busy_ns.store(stats->busy_ns.load(memory_order_relaxed) + done - woke, memory_order_relaxed);
+		stats->events.store(stats->events.load(memory_order_relaxed) + nfds, memory_order_relaxed);
+		stats->counters.tick(nfds);
+	}
+}
+
+/* 一个 epoll 给多个线程一起 epoll_wait，连接用 EPOLLONESHOT 注册，处理完再重新打开 */
+void shared_loop(const vector<int> &listeners, int threads)
+{
+	int epollfd = epoll_create1(0);
+	if (epollfd == -1)
+	{
+		perror("epoll_create ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	// 定时器跟连接一样注册，只有一个线程会拿到
+	if (g_date_timer != -1)
+	{
+		conn_t *timer = new conn_t;
+		timer->fd = g_date_timer;
+		timer->listener = false;
+		timer->conn_id = 0;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = timer;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, g_date_timer, &ev) == -1)
+		{
+			perror("epoll_ctl ERROR");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// 监听 socket 也用 ONESHOT，一次只让一个线程去 accept
+	for (int server_sock : listeners)
+	{
+		setnonblocking(server_sock);
+		conn_t *listener = new conn_t;
+		listener->fd = server_sock;
+		listener->listener = true;
+		listener->conn_id = 0;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = listener;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, server_sock, &ev) == -1)
+		{
+			perror("epoll_ctl ERROR");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// 不用 ONESHOT 也不读，一直是可读的，每个线程都会拿到，各自退出
+	if (g_stop_fd != -1)
+	{
+		conn_t *stop = new conn_t;
+		stop->fd = g_stop_fd;
+		stop->listener = false;
+		stop->conn_id = 0;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = stop;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, g_stop_fd, &ev) == -1)
+		{
+			perror("epoll_ctl ERROR");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	vector<loop_stats*> stats;
+	for (int i = 0; i < threads; ++i)
+		stats.push_back(new_loop_stats());
+
+	vector<thread> workers;
+	for (int i = 1; i < threads; ++i)
+		workers.emplace_back(worker_loop, epollfd, i, stats[i]);
+	worker_loop(epollfd, 0, stats[0]);
+	for (auto &t : workers)
+		t.join();
+}
+
+/*
+ * 信号处理函数里只通知 loop 退出，不能直接 capture_close：
+ * 别的线程可能正在 capture_write，映射一拿掉就是 SIGSEGV，要等所有 loop 都停下来
+ */
+void on_signal(int sig)
+{
+	uint64_t one = 1;
+	if (write(g_stop_fd, &one, sizeof(one)) < 0)
+		_exit(EXIT_FAILURE);
+}
+
+void on_print_stats(int sig)
+{
+	g_print_stats = 1;
+}
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-c capture_file] [-d] [-H] [-k | -h] [-t threads] [-T trace_file] [-W stall_ms] [-P every]" << endl;
+	cerr << "  -c  record traffic to capture_file" << endl;
+	cerr << "  -d  record payload as well, not only length" << endl;
+	cerr << "  -H  do not use hugepages for buffers" << endl;
+	cerr << "  -k  serve GET/SET/DEL/INCR/PING over the redis protocol instead of echo" << endl;
+	cerr << "  -h  answer every HTTP/1.1 request with a static response instead of echo" << endl;
+	cerr << "  -t  number of threads sharing one epoll fd, default 1 (single threaded loop)" << endl;
+	cerr << "  -T  kill -USR2 turns tracing on, the next USR2 writes chrome trace json to trace_file" << endl;
+	cerr << "  -W  print the phase and stack of any loop iteration that runs longer than stall_ms" << endl;
+	cerr << "  -P  read cycles, instructions, cache and branch misses around every n-th loop iteration,"
+		<< " kill -USR1 prints them per event" << endl;
+	server_usage();
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *capture_path = NULL;
+	bool with_payload = false;
+	bool hugepage = true;
+	int threads = 1;
+	const char *trace_path = NULL;
+	uint64_t stall_ms = 0;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c:dHkht:T:W:P:", server_long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'c': capture_path = optarg; break;
+		case 'd': with_payload = true; break;
+		case 'H': hugepage = false; break;
+		case 'k': g_feed = kv_feed; break;
+		case 'h': g_feed = http_feed; break;
+		case 't': threads = atoi(optarg); break;
+		case 'T': trace_path = optarg; break;
+		case 'W': stall_ms = strtoull(optarg, NULL, 10); break;
+		case 'P': g_counter_every = strtoull(optarg, NULL, 10); break;
+		default:
+			if (!server_parse_option(opt, optarg))
+				usage(argv[0]);
+		}
+	}
+
+	arena_init(ARENA_DEFAULT_SIZE, hugepage);
+
+	// 每个线程一个分片，减少线程之间抢锁
+	if (g_feed == kv_feed)
+		kv_init(threads);
+	if (g_feed == http_feed)
+	{
+		http_init();
+		g_date_timer = make_date_timer();
+	}
+
+	// 不用 SA_RESTART，让 epoll_wait 返回 EINTR 去打印
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_print_stats;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	if (trace_path)
+	{
+		trace_init(trace_path);
+		sa.sa_handler = trace_signal;
+		sigaction(SIGUSR2, &sa, NULL);
+	}
+	watchdog_start(stall_ms);
+
+	if (capture_path)
+	{
+		if (!capture_open(capture_path, with_payload))
+			exit(EXIT_FAILURE);
+		g_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (g_stop_fd == -1)
+		{
+			perror("eventfd ERROR");
+			exit(EXIT_FAILURE);
+		}
+		sa.sa_handler = on_signal;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+	}
+
+	vector<int> listeners = make_listeners();
 	cout << "wairting for clients..." << endl;
-	main_loop(server_sock);
+	if (threads > 1)
+		shared_loop(listeners, threads);
+	else
+		main_loop(listeners);
+
+	// 只有记录流量时 loop 才会返回，这时所有线程都停了
+	capture_close();
 	return EXIT_SUCCESS;
 }
 
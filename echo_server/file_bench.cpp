@@ -0,0 +1,291 @@
+/*
+ * file_bench.cpp
+ * 静态文件模式的基准测试：每个连接 keep-alive，一个请求收完再发下一个，路径轮流用，
+ * 报告每秒请求数、吞吐和每个请求从发出到收完的延迟
+ *
+ * 正文只数字节不检查内容，对比 sendfile 和拷贝两种发法时服务器分别用 -f 和 -f -R 启动：
+ *   ./file_bench -c 16 -d 10 -u /large.bin
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <ctime>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <strings.h>
+#include "server_core.h"
+#include "histogram.h"
+
+using namespace std;
+
+#define PORT "12321"				// 连接端口
+#define BENCH_CONNS 16
+#define BENCH_DURATION 10
+#define BENCH_RECV (256 << 10)		// 每次 recv 多少，正文直接丢掉
+#define BENCH_MAX_HEADER (16 << 10)
+
+struct bench_conn
+{
+	int fd = -1;
+	size_t next_path = 0;
+	string header;				// 还没收完的响应头
+	bool in_body = false;
+	uint64_t body_left = 0;
+	uint64_t start = 0;			// 这个请求发出的时间
+};
+
+struct bench_result
+{
+	uint64_t requests = 0;
+	uint64_t bytes = 0;			// 正文的字节数，不算响应头
+	uint64_t errors = 0;		// 状态码不是 200 的响应
+	histogram latency;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int connect_server(const char *host, const char *port)
+{
+	struct addrinfo hints, *server_addr;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(host, port, &hints, &server_addr);
+	if (ret != 0)
+	{
+		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int sock = -1;
+	for (struct addrinfo *p = server_addr; p != NULL; p = p->ai_next)
+	{
+		sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (sock == -1)
+			continue;
+		if (connect(sock, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(server_addr);
+	if (sock == -1)
+	{
+		perror("connect ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	setnonblocking(sock);
+	return sock;
+}
+
+/* 请求很小，一次 send 发得完 */
+bool send_request(bench_conn &c, const vector<string> &requests)
+{
+	const string &req = requests[c.next_path++ % requests.size()];
+	c.start = now_ns();
+	c.header.clear();
+	c.in_body = false;
+	return send(c.fd, req.data(), req.size(), MSG_NOSIGNAL) == (ssize_t)req.size();
+}
+
+/*
+ * 收完了响应头就解析状态码和 Content-Length，剩下的都是正文；
+ * 返回这次数据里属于正文的字节数，响应头格式不对返回 -1
+ */
+ssize_t parse_header(bench_conn &c, const char *data, size_t len, bench_result &result)
+{
+	c.header.append(data, len);
+	size_t end = c.header.find("\r\n\r\n");
+	if (end == string::npos)
+		return c.header.size() > BENCH_MAX_HEADER ? -1 : 0;
+
+	if (c.header.compare(0, 9, "HTTP/1.1 ") != 0)
+		return -1;
+	if (c.header.compare(9, 3, "200") != 0)
+		++result.errors;
+
+	c.body_left = 0;
+	for (size_t line = c.header.find("\r\n") + 2; line < end; line = c.header.find("\r\n", line) + 2)
+	{
+		if (strncasecmp(c.header.c_str() + line, "content-length:", 15) == 0)
+			c.body_left = strtoull(c.header.c_str() + line + 15, NULL, 10);
+	}
+	c.in_body = true;
+	return c.header.size() - (end + 4);
+}
+
+/* 处理一次可读，一个响应收完了就发下一个请求，连接出错返回 false */
+bool on_readable(bench_conn &c, const vector<string> &requests, vector<char> &buf, bench_result &result)
+{
+	for (;;)
+	{
+		ssize_t n = recv(c.fd, buf.data(), buf.size(), 0);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n <= 0)
+		{
+			if (n == 0)
+				cerr << "server closed the connection" << endl;
+			else
+				perror("recv ERROR");
+			return false;
+		}
+
+		ssize_t body = n;
+		if (!c.in_body)
+		{
+			body = parse_header(c, buf.data(), n, result);
+			if (body < 0)
+			{
+				cerr << "bad response header" << endl;
+				return false;
+			}
+			if (!c.in_body)
+				continue;
+		}
+		if ((uint64_t)body > c.body_left)
+		{
+			cerr << "got " << body - c.body_left << " bytes past the response" << endl;
+			return false;
+		}
+
+		c.body_left -= body;
+		result.bytes += body;
+		if (c.body_left == 0)
+		{
+			++result.requests;
+			result.latency.record(now_ns() - c.start);
+			if (!send_request(c, requests))
+			{
+				perror("send ERROR");
+				return false;
+			}
+		}
+	}
+}
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-h host] [-p port] [-c conns] [-d duration] -u path [-u path ...]" << endl;
+	cerr << "  -c  keep-alive connections, each with one request in flight, default " << BENCH_CONNS << endl;
+	cerr << "  -d  seconds to run, default " << BENCH_DURATION << endl;
+	cerr << "  -u  path to request, several are used in turn" << endl;
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *host = "127.0.0.1";
+	const char *port = PORT;
+	int conns = BENCH_CONNS;
+	int duration = BENCH_DURATION;
+	vector<string> paths;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "h:p:c:d:u:")) != -1)
+	{
+		switch (ch)
+		{
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'c': conns = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 'u': paths.push_back(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (conns <= 0 || duration <= 0 || paths.empty())
+		usage(argv[0]);
+
+	vector<string> requests;
+	for (auto &path : paths)
+		requests.push_back("GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n");
+
+	raise_nofile_limit();
+	int epollfd = epoll_create1(0);
+	if (epollfd == -1)
+	{
+		perror("epoll_create ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	vector<bench_conn> clients(conns);
+	for (int i = 0; i < conns; ++i)
+	{
+		bench_conn &c = clients[i];
+		c.fd = connect_server(host, port);
+		c.next_path = i;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+	}
+
+	cout << conns << " connections to " << host << ":" << port << " for " << duration << "s, paths";
+	for (auto &path : paths)
+		cout << " " << path;
+	cout << endl;
+
+	bench_result result;
+	vector<char> buf(BENCH_RECV);
+	vector<epoll_event> events(conns);
+	uint64_t start = now_ns();
+	uint64_t deadline = start + (uint64_t)duration * 1000000000;
+	for (auto &c : clients)
+	{
+		if (!send_request(c, requests))
+		{
+			perror("send ERROR");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bool failed = false;
+	while (!failed && now_ns() < deadline)
+	{
+		int nfds = epoll_wait(epollfd, events.data(), events.size(), 100);
+		if (nfds == -1 && errno != EINTR)
+		{
+			perror("epoll_wait ERROR");
+			exit(EXIT_FAILURE);
+		}
+		for (int n = 0; n < nfds && !failed; ++n)
+			failed = !on_readable(clients[events[n].data.u32], requests, buf, result);
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	cout << fixed << setprecision(1)
+		<< result.requests / elapsed << " requests/s, "
+		<< setprecision(3) << result.bytes / elapsed / 1e9 << " GB/s"
+		<< " (" << result.requests << " requests, " << result.bytes << " bytes in " << setprecision(2) << elapsed << "s";
+	if (result.errors)
+		cout << ", " << result.errors << " not 200";
+	cout << ")" << endl;
+	cout << setprecision(6);
+	cout.unsetf(ios::floatfield);
+	result.latency.print("request");
+
+	for (auto &c : clients)
+		close(c.fd);
+	return failed || result.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,290 @@
+/*
+ * file_cache.cpp
+ */
+
+#include "file_cache.h"
+
+#include <iostream>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+using namespace std;
+
+// 各个线程的缓存一起算，只有统计用，relaxed 就够了
+static atomic<uint64_t> g_hits(0);
+static atomic<uint64_t> g_misses(0);
+static atomic<uint64_t> g_changed(0);		// 重新检查时发现文件变了
+static atomic<uint64_t> g_evictions(0);
+static atomic<int64_t> g_open_fds(0);
+static atomic<int64_t> g_memory_bytes(0);
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* 请求的路径转成相对 root 的路径，去掉参数和开头的 /，有 .. 的不让出 root */
+static bool normalize(const string &target, string &path)
+{
+	if (target.empty() || target[0] != '/')
+		return false;
+
+	size_t end = target.find_first_of("?#");
+	if (end == string::npos)
+		end = target.size();
+	size_t begin = target.find_first_not_of('/');
+	if (begin == string::npos || begin >= end)
+		return false;
+	path.assign(target, begin, end - begin);
+
+	for (size_t pos = 0; pos <= path.size();)
+	{
+		size_t slash = path.find('/', pos);
+		if (slash == string::npos)
+			slash = path.size();
+		if (path.compare(pos, slash - pos, "..") == 0)
+			return false;
+		pos = slash + 1;
+	}
+	return path.find('\0') == string::npos;
+}
+
+static atomic<bool> g_no_openat2(false);	// 内核不支持 openat2，以后直接走逐级打开
+
+/*
+ * 没有 openat2 时一级一级地 O_NOFOLLOW 打开，路径上任何一级是符号链接都失败（ELOOP 或 ENOTDIR），
+ * 比 RESOLVE_BENEATH 严格，根目录里面指向里面的链接也不跟
+ */
+static int open_nofollow(int root_fd, const string &path)
+{
+	int dir_fd = root_fd;
+	size_t pos = 0;
+	for (;;)
+	{
+		size_t slash = path.find('/', pos);
+		if (slash == string::npos)
+			break;
+		if (slash > pos)
+		{
+			string name(path, pos, slash - pos);
+			int fd = openat(dir_fd, name.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			int saved = errno;
+			if (dir_fd != root_fd)
+				close(dir_fd);
+			if (fd == -1)
+			{
+				errno = saved;
+				return -1;
+			}
+			dir_fd = fd;
+		}
+		pos = slash + 1;
+	}
+
+	int fd = openat(dir_fd, path.c_str() + pos, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	int saved = errno;
+	if (dir_fd != root_fd)
+		close(dir_fd);
+	errno = saved;
+	return fd;
+}
+
+/*
+ * 打开 root 下面的文件，不让符号链接把路径带出 root：
+ * openat2 的 RESOLVE_BENEATH 在解析过程中出了 root 就返回 EXDEV，/proc 里那种魔法链接也不跟
+ */
+static int open_beneath(int root_fd, const string &path)
+{
+	if (!g_no_openat2.load(memory_order_relaxed))
+	{
+		struct open_how how;
+		memset(&how, 0, sizeof(how));
+		how.flags = O_RDONLY | O_CLOEXEC;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		int fd = syscall(SYS_openat2, root_fd, path.c_str(), &how, sizeof(how));
+		if (fd != -1 || (errno != ENOSYS && errno != EPERM))
+			return fd;
+		// 老内核没有这个调用，容器的 seccomp 不认识它时返回 EPERM
+		g_no_openat2.store(true, memory_order_relaxed);
+	}
+	return open_nofollow(root_fd, path);
+}
+
+static void destroy(file_entry *entry)
+{
+	if (entry->fd != -1)
+	{
+		close(entry->fd);
+		--g_open_fds;
+	}
+	g_memory_bytes -= entry->data.size();
+	delete entry;
+}
+
+file_cache::file_cache(int root_fd, size_t max_entries, size_t small_limit)
+	: root_fd_(root_fd), max_entries_(max_entries ? max_entries : 1), small_limit_(small_limit)
+{
+}
+
+file_cache::~file_cache()
+{
+	for (auto &kv : map_)
+		destroy(kv.second);
+}
+
+file_entry *file_cache::open_entry(const string &path, int &status)
+{
+	int fd = open_beneath(root_fd_, path);
+	if (fd == -1)
+	{
+		// EXDEV 是链接指出了 root，ELOOP 是没有 openat2 时碰到了链接
+		if (errno == EACCES || errno == EXDEV || errno == ELOOP)
+			status = 403;
+		else
+			status = (errno == ENOENT || errno == ENOTDIR) ? 404 : 500;
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		status = 404;
+		return NULL;
+	}
+
+	file_entry *entry = new file_entry;
+	entry->path = path;
+	entry->fd = fd;
+	entry->size = st.st_size;
+	entry->ino = st.st_ino;
+	entry->mtime = st.st_mtim;
+	entry->in_memory = false;
+	entry->refs = 0;
+	entry->detached = false;
+	entry->checked_ms = now_ms();
+	++g_open_fds;
+
+	// 小文件在 loop 线程里一次读完，之后都从内存回复
+	if ((size_t)st.st_size <= small_limit_)
+	{
+		entry->data.resize(st.st_size);
+		size_t done = 0;
+		while (done < entry->data.size())
+		{
+			ssize_t n = pread(fd, &entry->data[done], entry->data.size() - done, done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		if (done == entry->data.size())
+		{
+			entry->in_memory = true;
+			g_memory_bytes += done;
+			close(fd);
+			entry->fd = -1;
+			--g_open_fds;
+		}
+		else
+		{
+			entry->data.clear();
+		}
+	}
+	return entry;
+}
+
+/* 隔一段时间重新 stat 一次，文件被替换或者改过了就不能再用缓存 */
+bool file_cache::still_valid(file_entry *entry)
+{
+	uint64_t now = now_ms();
+	if (now - entry->checked_ms < FILE_CACHE_VALID_MS)
+		return true;
+
+	struct stat st;
+	if (fstatat(root_fd_, entry->path.c_str(), &st, 0) == -1)
+		return false;
+	if (st.st_ino != entry->ino || st.st_size != entry->size
+		|| st.st_mtim.tv_sec != entry->mtime.tv_sec || st.st_mtim.tv_nsec != entry->mtime.tv_nsec)
+		return false;
+	entry->checked_ms = now;
+	return true;
+}
+
+void file_cache::detach(file_entry *entry)
+{
+	map_.erase(entry->path);
+	lru_.erase(entry->lru);
+	entry->detached = true;
+	if (entry->refs == 0)
+		destroy(entry);
+}
+
+void file_cache::evict()
+{
+	while (map_.size() > max_entries_)
+	{
+		++g_evictions;
+		detach(lru_.back());
+	}
+}
+
+file_entry *file_cache::acquire(const string &target, int &status)
+{
+	string path;
+	if (!normalize(target, path))
+	{
+		status = 404;
+		return NULL;
+	}
+
+	auto it = map_.find(path);
+	if (it != map_.end())
+	{
+		file_entry *entry = it->second;
+		if (still_valid(entry))
+		{
+			++g_hits;
+			lru_.splice(lru_.begin(), lru_, entry->lru);
+			++entry->refs;
+			return entry;
+		}
+		++g_changed;
+		detach(entry);
+	}
+
+	++g_misses;
+	file_entry *entry = open_entry(path, status);
+	if (entry == NULL)
+		return NULL;
+
+	lru_.push_front(entry);
+	entry->lru = lru_.begin();
+	map_[path] = entry;
+	++entry->refs;
+	evict();
+	return entry;
+}
+
+void file_cache::release(file_entry *entry)
+{
+	if (--entry->refs == 0 && entry->detached)
+		destroy(entry);
+}
+
+void file_cache_print_stats()
+{
+	uint64_t hits = g_hits, misses = g_misses;
+	cout << "file cache: hits " << hits << " misses " << misses
+		<< " (" << (hits + misses ? hits * 100.0 / (hits + misses) : 0) << "% hit)"
+		<< " changed " << g_changed << " evictions " << g_evictions
+		<< " open fds " << g_open_fds << " in memory " << g_memory_bytes << " bytes" << endl;
+}
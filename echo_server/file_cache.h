@@ -0,0 +1,74 @@
+/*
+ * file_cache.h
+ * 静态文件模式用的缓存：按路径缓存打开的 fd 和 stat 结果，热门文件不用每次 open/fstat，
+ * 不超过 small_limit 的小文件直接把内容读进内存，回复时跟响应头一起写出去，不占 fd
+ *
+ * 最近用过的放在 LRU 的前面，超过 max_entries 从后面淘汰；
+ * 正在 sendfile 的文件有引用，淘汰或者发现文件变了时只从表里拿掉，最后一个引用释放时才关 fd
+ *
+ * 不加锁，多个 loop 时每个线程一个
+ */
+
+#ifndef __file_cache_h__
+#define __file_cache_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <sys/types.h>
+
+#define FILE_CACHE_ENTRIES 1024			// 默认最多缓存多少个文件
+#define FILE_CACHE_SMALL (16 << 10)		// 默认不超过这个大小的文件放在内存里
+#define FILE_CACHE_VALID_MS 1000		// 缓存的 stat 结果多久之后要重新检查一次
+
+struct file_entry
+{
+	std::string path;		// 相对 root 的路径，也是缓存的 key
+	int fd;					// 小文件读进内存之后是 -1
+	off_t size;
+	ino_t ino;
+	struct timespec mtime;
+	std::string data;		// 小文件的内容
+	bool in_memory;
+	int refs;
+	bool detached;			// 已经不在表里了，最后一个引用释放时删掉
+	uint64_t checked_ms;	// 上次确认文件没变的时间
+	std::list<file_entry*>::iterator lru;
+};
+
+class file_cache
+{
+public:
+	/* root_fd 是打开的根目录，路径都相对它打开，符号链接不能把路径带出 root */
+	file_cache(int root_fd, size_t max_entries = FILE_CACHE_ENTRIES, size_t small_limit = FILE_CACHE_SMALL);
+	~file_cache();
+
+	/*
+	 * target 是请求行里的路径，不能有 ..，问号后面的参数不管
+	 * 找不到返回 NULL，status 是要回的 http 状态码
+	 */
+	file_entry *acquire(const std::string &target, int &status);
+	void release(file_entry *entry);
+
+private:
+	file_cache(const file_cache&);
+	file_cache &operator=(const file_cache&);
+
+	file_entry *open_entry(const std::string &path, int &status);
+	bool still_valid(file_entry *entry);
+	void detach(file_entry *entry);
+	void evict();
+
+	int root_fd_;
+	size_t max_entries_;
+	size_t small_limit_;
+	std::unordered_map<std::string, file_entry*> map_;
+	std::list<file_entry*> lru_;
+};
+
+/* 所有线程的缓存加在一起的命中情况，kill -USR1 时打印 */
+void file_cache_print_stats();
+
+#endif
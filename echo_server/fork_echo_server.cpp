@@ -1,6 +1,9 @@
 /*
  * fork_echo_server.cpp 
  * 一个基于 fork 的 echo server，客户端可以 telnet 上来，服务器返回跟客户端输入同样的内容给客户端
+ *
+ * -t 换成每个连接一个线程，还是阻塞的 echos，线程从线程池里拿，连接关了线程停回池子里，
+ * 不用每个连接 fork 一个进程或者新建一个线程，栈用 -s 设小，每个连接只多占一个小栈
  */
 
 #include <iostream>
@@ -11,13 +14,13 @@
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <vector>
+#include <poll.h>
+#include "server_core.h"
+#include "thread_pool.h"
 
 using namespace std;
 
-#define PORT "12321"	// 连接端口
-#define BACKLOG 10		// 等待连接队列大小
-#define ECHO_LEN 1024
-
 void wait_child(int s)
 {
 	while(waitpid(-1, NULL, WNOHANG) > 0);
@@ -39,137 +42,161 @@ void set_child_handler()
 
 }
 
-/* 拿 ipv4 或者 ipv6 的 in_addr */
-const void *get_sin_addr(const sockaddr_storage *ss)
+/* 返回跟客户端输入同样的内容给客户端，buffer 在堆上，线程模式下栈可以很小 */
+void echos(int client_sock)
 {
-	if (ss->ss_family == AF_INET)
-		return &(((const struct sockaddr_in*)ss)->sin_addr);
-	else
-		return &(((const struct sockaddr_in6*)ss)->sin6_addr);
+	int ret;
+	vector<char> buf(g_config.buffer_size);
+	while ((ret = recv(client_sock, buf.data(), buf.size(), 0)) > 0)
+	{
+		// 线程模式下 SIGPIPE 会杀掉整个服务器
+		send(client_sock, buf.data(), ret, MSG_NOSIGNAL);
+	}
 }
 
-/* 返回跟客户端输入同样的内容给客户端 */
-void echos(int client_sock)
+/* 线程模式下在池子里的线程上跑，地址也在这里取，accept 的线程只管交出去 */
+void serve_client(void *arg)
 {
-	int ret;
-	char buf[ECHO_LEN];
-	while ((ret = recv(client_sock, buf, ECHO_LEN, 0)) > 0)
+	int client_sock = (int)(intptr_t)arg;
+	string addr = get_sock_addr(client_sock);
+	cout << "client from " << addr << endl;
+	echos(client_sock);
+	close(client_sock);
+	cout << "client closed " << addr << endl;
+}
+
+/* 只有一个监听 socket 时直接阻塞在 accept 上，同时监听 tcp 和 unix socket 时先 poll */
+int wait_listener(vector<pollfd> &fds)
+{
+	if (fds.size() == 1)
+		return fds[0].fd;
+
+	for (;;)
 	{
-		send(client_sock, buf, ret, 0);
+		int ret = poll(fds.data(), fds.size(), -1);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+		{
+			perror("poll ERROR");
+			exit(EXIT_FAILURE);
+		}
+		for (auto &p : fds)
+			if (p.revents & POLLIN)
+				return p.fd;
 	}
 }
 
-void main_loop(int server_sock)
+void main_loop(const vector<int> &listeners)
 {
-	char addr_str[INET6_ADDRSTRLEN];
+	vector<pollfd> fds;
+	for (int server_sock : listeners)
+		fds.push_back({server_sock, POLLIN, 0});
 
 	// 主循环，接受 client 并 fork 处理
 	for(;;)
 	{
-		struct sockaddr_storage client_addr;
-		socklen_t addr_size = sizeof(client_addr);
-
-		int client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_size);
+		int client_sock = accept(wait_listener(fds), NULL, NULL);
 		if (client_sock == -1)
 		{
 			perror("accept ERROR");
 			continue;
 		}
 
-		inet_ntop(client_addr.ss_family, get_sin_addr(&client_addr), addr_str, sizeof(addr_str));
-		cout << "client from " << addr_str << endl;
+		string addr = get_sock_addr(client_sock);
+		cout << "client from " << addr << endl;
 
 		// child
-		if (fork() == 0)
+		pid_t pid = fork();
+		if (pid == 0)
 		{
-			close(server_sock);
+			for (int server_sock : listeners)
+				close(server_sock);
 			echos(client_sock);
 			close(client_sock);
-			cout << "client closed " << addr_str << endl;
+			cout << "client closed " << addr << endl;
 			break;
 		}
 		// parent
 		else
 		{
+			if (pid == -1)
+				perror("fork ERROR");
 			close(client_sock);
 		}
 	}
 
 }
 
-int make_sock()
+void thread_loop(const vector<int> &listeners, thread_pool &pool)
 {
-	struct addrinfo hints, *server_addr;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;		// ipv4 or ipv6
-	hints.ai_socktype = SOCK_STREAM;	
-	hints.ai_flags = AI_PASSIVE;		// use bind
+	vector<pollfd> fds;
+	for (int server_sock : listeners)
+		fds.push_back({server_sock, POLLIN, 0});
 
-	int ret = getaddrinfo(NULL, PORT, &hints, &server_addr);
-	if (ret != 0)
+	for (;;)
 	{
-		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl; 
-		exit(EXIT_FAILURE);
-	}
-
-	// 循环找可用的 addr
-	int server_sock;
-	struct addrinfo *p;
-	for(p = server_addr; p != NULL; p = p->ai_next)
-	{
-		server_sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (server_sock == -1)
+		int client_sock = accept(wait_listener(fds), NULL, NULL);
+		if (client_sock == -1)
 		{
-			perror("socket ERROR");
+			perror("accept ERROR");
 			continue;
 		}
 
-		int opt = 1;
-		
-		ret = setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-		if (ret == -1)
-		{
-			perror("reuseaddr ERROR");
-			exit(EXIT_FAILURE);
-		}
-
-		ret = bind(server_sock, p->ai_addr, p->ai_addrlen);
-		if (ret == -1)
+		if (!pool.run(serve_client, (void*)(intptr_t)client_sock))
 		{
-			close(server_sock);
-			perror("bind ERROR");
-			continue;
+			perror("pthread_create ERROR");
+			close(client_sock);
 		}
-		break;
 	}
+}
 
-	if (p == NULL)
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-t] [-s stack_kb] [-n prestart] [options]" << endl;
+	cerr << "  -t  a thread per connection from a pool of parked threads instead of a process per connection" << endl;
+	cerr << "  -s  thread stack size in KB, default " << THREAD_POOL_STACK / 1024 << endl;
+	cerr << "  -n  threads to start before accepting, default 0" << endl;
+	server_usage();
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	bool threads = false;
+	size_t stack_size = THREAD_POOL_STACK;
+	int prestart = 0;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "ts:n:", server_long_options, NULL)) != -1)
 	{
-		cerr << "failed to make socket!" << endl;
-		exit(EXIT_FAILURE);
+		switch (opt)
+		{
+		case 't': threads = true; break;
+		case 's': stack_size = strtoul(optarg, NULL, 10) << 10; break;
+		case 'n': prestart = atoi(optarg); break;
+		default:
+			if (!server_parse_option(opt, optarg))
+				usage(argv[0]);
+		}
 	}
 
-	freeaddrinfo(server_addr);
+	vector<int> listeners = make_listeners();
 
-	ret = listen(server_sock, BACKLOG);
-	if (ret == -1)
+	if (threads)
 	{
-		perror("listen ERROR");
-		exit(EXIT_FAILURE);
+		thread_pool pool(stack_size, prestart);
+		cout << "thread per connection, " << pool.stack_size() / 1024 << "K stacks, " << pool.threads() << " started" << endl;
+		cout << "wairting for clients..." << endl;
+		thread_loop(listeners, pool);
+		return EXIT_SUCCESS;
 	}
 
-	return server_sock;
-}
-
-int main()
-{
-	int server_sock = make_sock();
 	set_child_handler();
 
 	cout << "wairting for clients..." << endl;
 
-	main_loop(server_sock);
+	main_loop(listeners);
 
 	return EXIT_SUCCESS;
 }
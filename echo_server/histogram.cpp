@@ -0,0 +1,112 @@
+/*
+ * histogram.cpp
+ */
+
+#include "histogram.h"
+
+#include <iostream>
+
+using namespace std;
+
+// 只有一个线程写，不需要原子的加法，relaxed 读写就够了
+static inline void add(atomic<uint64_t> &a, uint64_t v)
+{
+	a.store(a.load(memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+histogram::histogram()
+{
+	reset();
+}
+
+void histogram::reset()
+{
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		buckets_[i].store(0, memory_order_relaxed);
+	sum_.store(0, memory_order_relaxed);
+	max_.store(0, memory_order_relaxed);
+}
+
+int histogram::bucket_of(uint64_t value)
+{
+	// 小于 8 的值各占一个桶
+	if (value < (1 << HISTOGRAM_SUB_BITS))
+		return value;
+
+	int msb = 63 - __builtin_clzll(value);
+	int sub = (value >> (msb - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+	return ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+uint64_t histogram::bucket_upper(int bucket)
+{
+	if (bucket < (1 << HISTOGRAM_SUB_BITS))
+		return bucket;
+
+	int msb = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+	uint64_t sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+	uint64_t base = (1ULL << msb) | (sub << (msb - HISTOGRAM_SUB_BITS));
+	return base + (1ULL << (msb - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void histogram::record(uint64_t value)
+{
+	add(buckets_[bucket_of(value)], 1);
+	add(sum_, value);
+	if (value > max_.load(memory_order_relaxed))
+		max_.store(value, memory_order_relaxed);
+}
+
+void histogram::merge(const histogram &other)
+{
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		add(buckets_[i], other.buckets_[i].load(memory_order_relaxed));
+	add(sum_, other.sum_.load(memory_order_relaxed));
+	if (other.max() > max())
+		max_.store(other.max(), memory_order_relaxed);
+}
+
+uint64_t histogram::count() const
+{
+	uint64_t n = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		n += buckets_[i].load(memory_order_relaxed);
+	return n;
+}
+
+double histogram::mean() const
+{
+	uint64_t n = count();
+	return n ? (double)sum_.load(memory_order_relaxed) / n : 0;
+}
+
+uint64_t histogram::percentile(double p) const
+{
+	uint64_t n = count();
+	if (n == 0)
+		return 0;
+
+	uint64_t target = (uint64_t)(p * n);
+	if (target >= n)
+		target = n - 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		seen += buckets_[i].load(memory_order_relaxed);
+		if (seen > target)
+			return min(bucket_upper(i), max());
+	}
+	return max();
+}
+
+void histogram::print(const char *name) const
+{
+	cout << name << ": count " << count()
+		<< " avg " << mean() / 1000.0 << "us"
+		<< " p50 " << percentile(0.5) / 1000.0 << "us"
+		<< " p90 " << percentile(0.9) / 1000.0 << "us"
+		<< " p99 " << percentile(0.99) / 1000.0 << "us"
+		<< " p999 " << percentile(0.999) / 1000.0 << "us"
+		<< " max " << max() / 1000.0 << "us" << endl;
+}
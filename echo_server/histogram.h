@@ -0,0 +1,49 @@
+/*
+ * histogram.h
+ * 记录延迟用的对数直方图，每个 2 的幂区间再分 8 份，误差在 12.5% 以内
+ * 只允许一个线程写，别的线程可以随时读出来合并
+ */
+
+#ifndef __histogram_h__
+#define __histogram_h__
+
+#include <stdint.h>
+#include <atomic>
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BITS)
+
+class histogram
+{
+public:
+	histogram();
+
+	void record(uint64_t value);
+	void reset();
+
+	/* 把 other 的计数加到自己身上，用来汇总各个线程 */
+	void merge(const histogram &other);
+
+	uint64_t count() const;
+	uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+	double mean() const;
+
+	/* p 取 0 到 1，返回所在桶的上界 */
+	uint64_t percentile(double p) const;
+
+	/* 按纳秒打印 count/avg/p50/p90/p99/p999/max，单位换成 us */
+	void print(const char *name) const;
+
+private:
+	histogram(const histogram&);
+	histogram &operator=(const histogram&);
+
+	static int bucket_of(uint64_t value);
+	static uint64_t bucket_upper(int bucket);
+
+	std::atomic<uint64_t> buckets_[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> max_;
+};
+
+#endif
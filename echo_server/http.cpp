@@ -0,0 +1,243 @@
+/*
+ * http.cpp
+ */
+
+#include "http.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <strings.h>
+#include <sys/types.h>
+#include <atomic>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+#define HTTP_MAX_HEADER (64 << 10)		// 请求头最长多少
+#define HTTP_MAX_BODY (1 << 20)			// 请求体要先收完再跳过，不能太大
+#define HTTP_RESPONSE_MAX 256
+#define HTTP_BODY "Hello, World!"
+
+// 两份轮流用，刷新 Date 时写另一份再切过去，读的线程不会读到写了一半的响应
+static char g_response[2][HTTP_RESPONSE_MAX];
+static size_t g_response_len[2];
+static char g_date[2][64];
+static atomic<int> g_current(0);
+
+static const char g_bad_request[] =
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+void http_init()
+{
+	http_update_date();
+}
+
+void http_update_date()
+{
+	int next = !g_current.load(memory_order_relaxed);
+
+	char *date = g_date[next];
+	time_t now = time(NULL);
+	struct tm tm;
+	gmtime_r(&now, &tm);
+	strftime(date, sizeof(g_date[next]), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	g_response_len[next] = snprintf(g_response[next], HTTP_RESPONSE_MAX,
+		"HTTP/1.1 200 OK\r\n"
+		"Server: libuv_study\r\n"
+		"Date: %s\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: %zu\r\n"
+		"\r\n"
+		"%s", date, sizeof(HTTP_BODY) - 1, HTTP_BODY);
+	g_current.store(next, memory_order_release);
+}
+
+/* 返回 \r\n\r\n 的位置，先用 SSE2 一次找 16 个字节里的 \r，再逐个确认后面三个字节 */
+static const char *find_header_end(const char *p, size_t len)
+{
+	const char *end = p + len;
+#ifdef __SSE2__
+	const __m128i cr = _mm_set1_epi8('\r');
+	while (end - p >= 16 + 3)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+		while (mask)
+		{
+			int i = __builtin_ctz(mask);
+			if (p[i + 1] == '\n' && p[i + 2] == '\r' && p[i + 3] == '\n')
+				return p + i;
+			mask &= mask - 1;
+		}
+		p += 16;
+	}
+#endif
+	for (; end - p >= 4; ++p)
+		if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
+			return p;
+	return NULL;
+}
+
+/* 头的名字不区分大小写，name 要带上冒号 */
+static bool header_is(const char *line, const char *eol, const char *name)
+{
+	size_t len = strlen(name);
+	return (size_t)(eol - line) >= len && strncasecmp(line, name, len) == 0;
+}
+
+static bool value_has(const char *p, const char *end, const char *token)
+{
+	size_t len = strlen(token);
+	for (; end - p >= (ssize_t)len; ++p)
+		if (strncasecmp(p, token, len) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * 解析一个完整的请求，返回用掉的字节数，不够一个请求返回 0，格式错误返回 -1
+ * 只有返回完整请求时才设置 keep_alive，target 不为 NULL 时顺便取出请求的路径
+ */
+static ssize_t parse_request(const char *p, size_t len, bool &keep_alive, string *target = NULL)
+{
+	const char *hend = find_header_end(p, len);
+	if (hend == NULL)
+		return len > HTTP_MAX_HEADER ? -1 : 0;
+
+	// 请求行：METHOD SP target SP HTTP/1.x，1.0 默认不保持连接
+	const char *line_end = (const char*)memchr(p, '\r', hend - p + 1);
+	const char *version = line_end - 8;
+	if (line_end - p < 14 || version[-1] != ' ' || memcmp(version, "HTTP/1.", 7) != 0)
+		return -1;
+	if (version[7] != '0' && version[7] != '1')
+		return -1;
+	bool keep = version[7] == '1';
+	const char *path = (const char*)memchr(p, ' ', version - 1 - p);
+	if (target && path == NULL)
+		return -1;
+
+	// 最后一个头的 \r\n 就是 hend
+	size_t body = 0;
+	for (const char *line = line_end + 2; line < hend + 2;)
+	{
+		const char *eol = (const char*)memchr(line, '\r', hend - line + 1);
+		if (header_is(line, eol, "connection:"))
+		{
+			if (value_has(line + 11, eol, "close"))
+				keep = false;
+			else if (value_has(line + 11, eol, "keep-alive"))
+				keep = true;
+		}
+		else if (header_is(line, eol, "content-length:"))
+		{
+			// 只能是数字，前后可以有空白，"12x" 和 "abc" 都不认，不然 keep-alive 连接上后面的请求全错位
+			const char *v = line + 15;
+			while (v < eol && (*v == ' ' || *v == '\t'))
+				++v;
+			if (v == eol || *v < '0' || *v > '9')
+				return -1;
+			for (body = 0; v < eol && *v >= '0' && *v <= '9'; ++v)
+			{
+				body = body * 10 + (*v - '0');
+				if (body > HTTP_MAX_BODY)
+					return -1;
+			}
+			while (v < eol && (*v == ' ' || *v == '\t'))
+				++v;
+			if (v != eol)
+				return -1;
+		}
+		else if (header_is(line, eol, "transfer-encoding:"))
+		{
+			// 不支持 chunked
+			return -1;
+		}
+		line = eol + 2;
+	}
+
+	size_t total = hend + 4 - p + body;
+	if (total > len)
+		return 0;
+	keep_alive = keep;
+	if (target)
+		target->assign(path + 1, version - 1 - (path + 1));
+	return total;
+}
+
+bool http_feed(string &in, string &out, const char *data, size_t len)
+{
+	bool buffered = !in.empty();
+	if (buffered)
+	{
+		in.append(data, len);
+		data = in.data();
+		len = in.size();
+	}
+
+	int cur = g_current.load(memory_order_acquire);
+	bool keep_alive = true;
+	size_t used = 0;
+	while (used < len && keep_alive)
+	{
+		ssize_t n = parse_request(data + used, len - used, keep_alive);
+		if (n < 0)
+		{
+			out.append(g_bad_request, sizeof(g_bad_request) - 1);
+			return false;
+		}
+		if (n == 0)
+			break;
+
+		used += n;
+		out.append(g_response[cur], g_response_len[cur]);
+	}
+
+	if (buffered)
+		in.erase(0, used);
+	else
+		in.assign(data + used, len - used);
+	return keep_alive;
+}
+
+int http_take_request(string &in, string &target, bool &keep_alive)
+{
+	ssize_t n = parse_request(in.data(), in.size(), keep_alive, &target);
+	if (n <= 0)
+		return n;
+	in.erase(0, n);
+	return 1;
+}
+
+static const char *status_text(int status)
+{
+	switch (status)
+	{
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	default: return "Internal Server Error";
+	}
+}
+
+void http_append_header(string &out, int status, size_t content_length, bool keep_alive)
+{
+	char header[HTTP_RESPONSE_MAX];
+	int cur = g_current.load(memory_order_acquire);
+	int len = snprintf(header, sizeof(header),
+		"HTTP/1.1 %d %s\r\n"
+		"Server: libuv_study\r\n"
+		"Date: %s\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Length: %zu\r\n"
+		"%s"
+		"\r\n", status, status_text(status), g_date[cur], content_length, keep_alive ? "" : "Connection: close\r\n");
+	out.append(header, len);
+}
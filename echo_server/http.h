@@ -0,0 +1,37 @@
+/*
+ * http.h
+ * 给 wrk 之类的 http 压测工具用的最小 HTTP/1.1 应答：不管请求什么都回同一个静态响应，
+ * 支持 keep-alive 和 pipeline；静态文件模式只用这里解析请求和生成响应头，正文由 server 自己发
+ *
+ * 请求不拷贝，直接在收到的数据上找 \r\n\r\n（有 SSE2 时一次比 16 个字节），
+ * 只看请求行的版本和 Connection、Content-Length 两个头
+ */
+
+#ifndef __http_h__
+#define __http_h__
+
+#include <stddef.h>
+#include <string>
+
+/* 生成响应，之后由 loop 的定时器每秒调一次 http_update_date */
+void http_init();
+
+/* 按当前时间重新生成 Date 头，别的线程同时在读也没关系 */
+void http_update_date();
+
+/*
+ * 每个完整的请求往 out 追加一份响应，剩下的半个请求留在 in 里，用法跟 kv_feed 一样
+ * 请求出错或者不要 keep-alive 时返回 false，out 发完之后关掉连接
+ */
+bool http_feed(std::string &in, std::string &out, const char *data, size_t len);
+
+/*
+ * 按路径回复的模式用：从 in 的开头取出一个完整的请求，返回 1 并设置请求的路径和 keep_alive，
+ * 不够一个请求返回 0，格式错误返回 -1
+ */
+int http_take_request(std::string &in, std::string &target, bool &keep_alive);
+
+/* 往 out 追加一个响应头，正文由调用方自己发，状态码不是 200 时 content_length 给 0 */
+void http_append_header(std::string &out, int status, size_t content_length, bool keep_alive);
+
+#endif
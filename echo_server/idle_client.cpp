@@ -0,0 +1,426 @@
+/*
+ * idle_client.cpp
+ * 看服务器挂着大量空闲连接时每个连接占多少内存：
+ * 先开 n 个连接，每个连接发一个字节等回来，确认服务器真的接手了，然后就放着不动，
+ * 前后读服务器进程的 RSS，差值除以连接数就是每个连接的用户态开销，内核里的 socket 另外统计；
+ * 服务器 fork 了子进程时把子进程也算上，用 PSS，共享的页不重复算
+ *
+ * 一个源地址连同一个服务器端口最多用完本地端口范围（默认两万八千多个），
+ * 所以连接分散到 127.1.0.1、127.1.0.2 ... 这些源地址上，整个 127/8 本来就在 lo 上，不用另外配置；
+ * 100 万个连接要两边的 ulimit -n 都够，先调大 fs.nr_open 和硬上限
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <ctime>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "server_core.h"
+
+using namespace std;
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#define PORT "12321"				// 连接端口
+#define IDLE_CONNS 1000000
+#define IDLE_PER_SOURCE 25000		// 每个源地址开多少个连接，留一点余量给本地端口范围
+#define IDLE_CONCURRENCY 1000		// 同时在握手或者等回包的连接数，太多会把服务器的 accept 队列挤爆
+#define IDLE_STALL 10				// 多少秒没有进展就放弃
+#define IDLE_PROGRESS 100000		// 每连上多少个打印一次
+#define IDLE_MAX_ERRORS_SHOWN 10
+
+struct idle_options
+{
+	const char *host = "127.0.0.1";
+	const char *port = PORT;
+	size_t conns = IDLE_CONNS;
+	int sources = -1;				// 源地址个数，0 不绑定，-1 按连接数自动算
+	size_t concurrency = IDLE_CONCURRENCY;
+	int server_pid = 0;				// 不为 0 时统计这个进程和子进程的内存
+	int hold = 0;					// 测完之后连接再保持多少秒
+};
+
+/* 内存的快照，单位 KB，读不到的是 0 */
+struct mem_snapshot
+{
+	uint64_t rss = 0;				// 服务器进程和子进程的 PSS
+	uint64_t slab = 0;				// 内核 slab，socket 结构体都在这里面
+	uint64_t tcp_mem = 0;			// 内核给 tcp 收发缓冲记的账
+};
+
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 在 /proc 的文件里找 key 开头的一行，返回后面的第一个数 */
+uint64_t read_proc_value(const string &path, const char *key)
+{
+	ifstream file(path);
+	string line;
+	size_t len = strlen(key);
+	while (getline(file, line))
+		if (line.compare(0, len, key) == 0)
+			return strtoull(line.c_str() + len, NULL, 10);
+	return 0;
+}
+
+/* /proc/net/sockstat 里 "TCP: inuse 5 orphan 0 tw 0 alloc 7 mem 1" 的 mem，单位是页 */
+uint64_t read_tcp_mem()
+{
+	ifstream file("/proc/net/sockstat");
+	string line;
+	while (getline(file, line))
+	{
+		if (line.compare(0, 4, "TCP:") != 0)
+			continue;
+		istringstream fields(line.substr(4));
+		string name;
+		uint64_t value;
+		while (fields >> name >> value)
+			if (name == "mem")
+				return value;
+	}
+	return 0;
+}
+
+/*
+ * 进程和它 fork 出来的子进程一共占的内存，fork 的服务器每个连接一个子进程，只看父进程什么也看不出来；
+ * smaps_rollup 的 Pss 把跟别的进程共享的页按份摊开，父子之间 copy-on-write 的页不会重复算，
+ * 读不到时退回 VmRSS
+ */
+uint64_t read_tree_pss(int pid)
+{
+	string dir = "/proc/" + to_string(pid);
+	uint64_t kb = read_proc_value(dir + "/smaps_rollup", "Pss:");
+	if (kb == 0)
+		kb = read_proc_value(dir + "/status", "VmRSS:");
+
+	ifstream children(dir + "/task/" + to_string(pid) + "/children");
+	int child;
+	while (children >> child)
+		kb += read_tree_pss(child);
+	return kb;
+}
+
+mem_snapshot take_snapshot(int server_pid)
+{
+	mem_snapshot snap;
+	if (server_pid)
+		snap.rss = read_tree_pss(server_pid);
+	snap.slab = read_proc_value("/proc/meminfo", "Slab:");
+	snap.tcp_mem = read_tcp_mem() * (sysconf(_SC_PAGESIZE) / 1024);
+	return snap;
+}
+
+void print_delta(const char *stage, const mem_snapshot &base, const mem_snapshot &now, size_t conns)
+{
+	cout << stage << ":" << fixed << setprecision(1);
+	if (base.rss)
+		cout << " server pss " << base.rss / 1024.0 << "M -> " << now.rss / 1024.0 << "M, "
+			<< ((int64_t)now.rss - (int64_t)base.rss) * 1024.0 / conns << " bytes per connection;";
+	cout << " kernel slab " << showpos << ((int64_t)now.slab - (int64_t)base.slab) / 1024.0 << "M" << noshowpos
+		<< " (" << ((int64_t)now.slab - (int64_t)base.slab) * 1024.0 / conns << " bytes per connection)"
+		<< ", tcp buffers " << showpos << ((int64_t)now.tcp_mem - (int64_t)base.tcp_mem) << "K" << noshowpos << endl;
+	cout << setprecision(6);
+	cout.unsetf(ios::floatfield);
+}
+
+/* 第 i 个源地址：127.1.0.1 开始往后数 */
+sockaddr_in source_addr(int i)
+{
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(0x7f010000 + i + 1);
+	addr.sin_port = 0;
+	return addr;
+}
+
+/* 开一个非阻塞的连接，立刻连上返回 1，在握手返回 0，失败返回 -1 */
+int start_connect(const addrinfo *ai, int source, int &sock)
+{
+	sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+	if (sock == -1)
+	{
+		perror("socket ERROR");
+		return -1;
+	}
+
+	if (source >= 0)
+	{
+		// 端口推迟到 connect 时按四元组分配，bind 的时候不占端口
+		int on = 1;
+		setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+		sockaddr_in addr = source_addr(source);
+		if (bind(sock, (sockaddr*)&addr, sizeof(addr)) == -1)
+		{
+			perror("bind ERROR");
+			close(sock);
+			return -1;
+		}
+	}
+
+	if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+		return 1;
+	if (errno == EINPROGRESS)
+		return 0;
+
+	perror("connect ERROR");
+	close(sock);
+	return -1;
+}
+
+/* 同时最多 concurrency 个在握手，连上的 fd 放到 fds 里，返回失败的个数 */
+size_t connect_all(const addrinfo *ai, const idle_options &opt, vector<int> &fds)
+{
+	int epollfd = epoll_create1(0);
+	if (epollfd == -1)
+	{
+		perror("epoll_create ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	vector<epoll_event> events(opt.concurrency);
+	size_t started = 0, pending = 0, failed = 0;
+	size_t next_progress = IDLE_PROGRESS;
+	bool stop = false;
+	while ((started < opt.conns && !stop) || pending > 0)
+	{
+		while (started < opt.conns && pending < opt.concurrency && !stop)
+		{
+			int sock;
+			int source = opt.sources > 0 ? (int)(started % opt.sources) : -1;
+			int ret = start_connect(ai, source, sock);
+			++started;
+			if (ret == 1)
+			{
+				fds.push_back(sock);
+			}
+			else if (ret == 0)
+			{
+				struct epoll_event ev;
+				ev.events = EPOLLOUT;
+				ev.data.fd = sock;
+				epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev);
+				++pending;
+			}
+			else
+			{
+				// fd 用完了或者源地址的端口用完了，后面的也不会成功
+				++failed;
+				stop = errno == EMFILE || errno == ENFILE || errno == EADDRNOTAVAIL;
+			}
+		}
+
+		int nfds = epoll_wait(epollfd, events.data(), events.size(), IDLE_STALL * 1000);
+		if (nfds == -1)
+		{
+			perror("epoll_wait ERROR");
+			exit(EXIT_FAILURE);
+		}
+		if (nfds == 0)
+		{
+			cerr << pending << " connects made no progress in " << IDLE_STALL << "s, giving up" << endl;
+			failed += pending;
+			break;
+		}
+
+		for (int n = 0; n < nfds; ++n)
+		{
+			int sock = events[n].data.fd;
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+			epoll_ctl(epollfd, EPOLL_CTL_DEL, sock, NULL);
+			--pending;
+			if (err)
+			{
+				if (failed < IDLE_MAX_ERRORS_SHOWN)
+					cerr << "connect ERROR: " << strerror(err) << endl;
+				++failed;
+				close(sock);
+				continue;
+			}
+			fds.push_back(sock);
+		}
+
+		if (fds.size() >= next_progress)
+		{
+			cout << "connected " << fds.size() << endl;
+			next_progress += IDLE_PROGRESS;
+		}
+	}
+
+	// 放弃了的还挂在 epoll 里，跟 epoll 一起关掉
+	close(epollfd);
+	return failed;
+}
+
+/*
+ * 每个连接发一个字节等它回来，证明服务器已经 accept 并且读写过这个连接，
+ * 读写过之后服务器该释放的 buffer 也释放了，这时的 RSS 才是空闲连接真正的开销；返回没回来的个数
+ */
+size_t ping_all(const vector<int> &fds, size_t concurrency)
+{
+	int epollfd = epoll_create1(0);
+	if (epollfd == -1)
+	{
+		perror("epoll_create ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	vector<epoll_event> events(concurrency);
+	size_t failed = 0;
+	for (size_t begin = 0; begin < fds.size(); begin += concurrency)
+	{
+		size_t end = min(fds.size(), begin + concurrency);
+		size_t waiting = 0;
+		for (size_t i = begin; i < end; ++i)
+		{
+			if (send(fds[i], "p", 1, MSG_NOSIGNAL) != 1)
+			{
+				++failed;
+				continue;
+			}
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.fd = fds[i];
+			epoll_ctl(epollfd, EPOLL_CTL_ADD, fds[i], &ev);
+			++waiting;
+		}
+
+		while (waiting > 0)
+		{
+			int nfds = epoll_wait(epollfd, events.data(), events.size(), IDLE_STALL * 1000);
+			if (nfds <= 0)
+			{
+				cerr << waiting << " connections got no echo in " << IDLE_STALL << "s" << endl;
+				failed += waiting;
+				for (size_t i = begin; i < end; ++i)
+					epoll_ctl(epollfd, EPOLL_CTL_DEL, fds[i], NULL);
+				break;
+			}
+			for (int n = 0; n < nfds; ++n)
+			{
+				char c;
+				int sock = events[n].data.fd;
+				if (recv(sock, &c, 1, 0) != 1)
+					++failed;
+				epoll_ctl(epollfd, EPOLL_CTL_DEL, sock, NULL);
+				--waiting;
+			}
+		}
+	}
+
+	close(epollfd);
+	return failed;
+}
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-h host] [-p port] [-n conns] [-s sources] [-c concurrency] [-P server_pid] [-w hold]" << endl;
+	cerr << "  -n  connections to open, default " << IDLE_CONNS << endl;
+	cerr << "  -s  spread connections over this many source addresses from 127.1.0.1, 0 lets the kernel choose,"
+		<< " default one per " << IDLE_PER_SOURCE << " connections" << endl;
+	cerr << "  -c  connects or pings in flight at once, default " << IDLE_CONCURRENCY << endl;
+	cerr << "  -P  report the memory of this server process and its children" << endl;
+	cerr << "  -w  keep the connections open this many seconds after measuring" << endl;
+	cerr << "  start the server with a large --backlog, both sides need ulimit -n above conns" << endl;
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	idle_options opt;
+	int ch;
+	while ((ch = getopt(argc, argv, "h:p:n:s:c:P:w:")) != -1)
+	{
+		switch (ch)
+		{
+		case 'h': opt.host = optarg; break;
+		case 'p': opt.port = optarg; break;
+		case 'n': opt.conns = strtoul(optarg, NULL, 10); break;
+		case 's': opt.sources = atoi(optarg); break;
+		case 'c': opt.concurrency = strtoul(optarg, NULL, 10); break;
+		case 'P': opt.server_pid = atoi(optarg); break;
+		case 'w': opt.hold = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (opt.conns == 0 || opt.concurrency == 0)
+		usage(argv[0]);
+
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	int ret = getaddrinfo(opt.host, opt.port, &hints, &ai);
+	if (ret != 0)
+	{
+		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// 源地址只在连本机的时候有意义，连别的机器时要用那台机器能路由回来的地址
+	bool loopback = (ntohl(((sockaddr_in*)ai->ai_addr)->sin_addr.s_addr) >> 24) == 127;
+	if (opt.sources < 0)
+		opt.sources = loopback && opt.conns > IDLE_PER_SOURCE ? (opt.conns + IDLE_PER_SOURCE - 1) / IDLE_PER_SOURCE : 0;
+
+	rlim_t limit = raise_nofile_limit();
+	if (limit < opt.conns + 16)
+	{
+		cerr << "open file limit is " << limit << ", " << opt.conns << " connections need more:"
+			<< " raise the hard limit (ulimit -Hn, fs.nr_open) or use -n" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	cout << "opening " << opt.conns << " connections to " << opt.host << ":" << opt.port;
+	if (opt.sources > 0)
+		cout << " from " << opt.sources << " source addresses";
+	cout << endl;
+
+	mem_snapshot base = take_snapshot(opt.server_pid);
+	vector<int> fds;
+	fds.reserve(opt.conns);
+	uint64_t start = now_ns();
+	size_t failed = connect_all(ai, opt, fds);
+	freeaddrinfo(ai);
+	cout << fds.size() << " connected, " << failed << " failed in " << (now_ns() - start) / 1e9 << "s" << endl;
+	if (fds.empty())
+		return EXIT_FAILURE;
+
+	// 服务器 accept 跟得上之前有的连接还在队列里，ping 一遍之后才都算到服务器头上
+	mem_snapshot connected = take_snapshot(opt.server_pid);
+	start = now_ns();
+	size_t lost = ping_all(fds, opt.concurrency);
+	cout << fds.size() - lost << " echoed, " << lost << " lost in " << (now_ns() - start) / 1e9 << "s" << endl;
+
+	// 让服务器把最后一批写回调处理完
+	usleep(200000);
+	mem_snapshot idle = take_snapshot(opt.server_pid);
+	print_delta("after connect", base, connected, fds.size());
+	print_delta("idle after ping", base, idle, fds.size());
+	if (loopback)
+		cout << "kernel numbers count both ends of every connection" << endl;
+
+	if (opt.hold > 0)
+		sleep(opt.hold);
+	for (int fd : fds)
+		close(fd);
+	return failed || lost ? EXIT_FAILURE : EXIT_SUCCESS;
+}
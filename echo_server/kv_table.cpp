@@ -0,0 +1,138 @@
+/*
+ * kv_table.cpp
+ */
+
+#include "kv_table.h"
+#include "arena.h"
+
+#include <cstring>
+
+using namespace std;
+
+#define KV_INIT_SLOTS 1024
+#define KV_MAX_LOAD 0.7		// 线性探测超过这个装载率之后探测长度涨得很快
+
+kv_table::kv_table()
+	: slots_(KV_INIT_SLOTS), mask_(KV_INIT_SLOTS - 1), used_(0)
+{
+}
+
+kv_table::~kv_table()
+{
+	for (auto &e : slots_)
+		if (e.data)
+			arena_free(e.data);
+}
+
+/* FNV-1a，key 一般很短，够用了 */
+uint64_t kv_table::hash(const char *key, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i)
+	{
+		h ^= (uint8_t)key[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* 返回 key 所在的位置，不存在时返回探测到的第一个空位 */
+size_t kv_table::probe(uint64_t hash, const char *key, size_t klen) const
+{
+	size_t i = hash & mask_;
+	for (;;)
+	{
+		const kv_entry &e = slots_[i];
+		if (e.data == NULL)
+			return i;
+		if (e.hash == hash && e.klen == klen && memcmp(e.data, key, klen) == 0)
+			return i;
+		i = (i + 1) & mask_;
+	}
+}
+
+kv_entry *kv_table::find(uint64_t hash, const char *key, size_t klen)
+{
+	kv_entry &e = slots_[probe(hash, key, klen)];
+	return e.data ? &e : NULL;
+}
+
+void kv_table::set(uint64_t hash, const char *key, size_t klen, const char *value, size_t vlen)
+{
+	kv_entry *e = &slots_[probe(hash, key, klen)];
+	if (e->data && klen + vlen <= arena_block_size(e->data))
+	{
+		memcpy(e->data + klen, value, vlen);
+		e->vlen = vlen;
+		return;
+	}
+
+	char *data = (char*)arena_alloc(klen + vlen);
+	memcpy(data, key, klen);
+	memcpy(data + klen, value, vlen);
+
+	if (e->data)
+	{
+		arena_free(e->data);
+		e->data = data;
+		e->vlen = vlen;
+		return;
+	}
+
+	if (used_ + 1 > slots_.size() * KV_MAX_LOAD)
+	{
+		grow();
+		e = &slots_[probe(hash, key, klen)];
+	}
+	e->hash = hash;
+	e->data = data;
+	e->klen = klen;
+	e->vlen = vlen;
+	++used_;
+}
+
+bool kv_table::del(uint64_t hash, const char *key, size_t klen)
+{
+	size_t i = probe(hash, key, klen);
+	if (slots_[i].data == NULL)
+		return false;
+
+	arena_free(slots_[i].data);
+	--used_;
+
+	// 后面同一段连续的元素，如果理想位置不在 (i, j] 之间，就挪到空出来的 i 上
+	size_t j = i;
+	for (;;)
+	{
+		j = (j + 1) & mask_;
+		if (slots_[j].data == NULL)
+			break;
+
+		size_t home = slots_[j].hash & mask_;
+		bool stay = (i < j) ? (home > i && home <= j) : (home > i || home <= j);
+		if (stay)
+			continue;
+
+		slots_[i] = slots_[j];
+		i = j;
+	}
+	slots_[i].data = NULL;
+	return true;
+}
+
+void kv_table::grow()
+{
+	vector<kv_entry> old(slots_.size() * 2);
+	old.swap(slots_);
+	mask_ = slots_.size() - 1;
+
+	for (auto &e : old)
+	{
+		if (e.data == NULL)
+			continue;
+		size_t i = e.hash & mask_;
+		while (slots_[i].data)
+			i = (i + 1) & mask_;
+		slots_[i] = e;
+	}
+}
@@ -0,0 +1,54 @@
+/*
+ * kv_table.h
+ * 开放寻址的哈希表，线性探测，删除时把后面的元素往前挪，不留墓碑
+ * key 和 value 放在同一块 arena buffer 里，本身不加锁，多线程时由调用方按分片加锁
+ */
+
+#ifndef __kv_table_h__
+#define __kv_table_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+struct kv_entry
+{
+	uint64_t hash;
+	char *data;			// key 后面紧跟着 value，NULL 表示空位
+	uint32_t klen;
+	uint32_t vlen;
+
+	const char *value() const { return data + klen; }
+};
+
+class kv_table
+{
+public:
+	kv_table();
+	~kv_table();
+
+	/* 调用方先算好 hash，分片也用同一个 hash */
+	static uint64_t hash(const char *key, size_t len);
+
+	kv_entry *find(uint64_t hash, const char *key, size_t klen);
+
+	/* 原来的 buffer 放得下新的 value 时原地覆盖，不重新分配 */
+	void set(uint64_t hash, const char *key, size_t klen, const char *value, size_t vlen);
+
+	bool del(uint64_t hash, const char *key, size_t klen);
+
+	size_t size() const { return used_; }
+
+private:
+	kv_table(const kv_table&);
+	kv_table &operator=(const kv_table&);
+
+	size_t probe(uint64_t hash, const char *key, size_t klen) const;
+	void grow();
+
+	std::vector<kv_entry> slots_;
+	size_t mask_;
+	size_t used_;
+};
+
+#endif
@@ -5,6 +5,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 #include <ev.h>
 #include <cstring>
 #include <unistd.h>
@@ -15,171 +16,330 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <ctime>
+#include "arena.h"
+#include "server_core.h"
+#include "perf_counter.h"
+#include "trace.h"
+#include "watchdog.h"
 
 using namespace std;
 
-#define PORT "12321"	// Ӷ˿
-#define BACKLOG 10		// ȴӶдС
-#define ECHO_LEN 1024
-
-// error handling
-#define FAIL_EXIT(ret, msg)										\
-do																\
-{																\
-	if ((ret) < 0)												\
-	{															\
-		cerr << (msg) << ": " << uv_strerror(ret) << endl;		\
-		exit(EXIT_FAILURE);										\
-	}															\
-}																\
-while(0)
-
-/*  ipv4  ipv6  in_addr */
-const void *get_sin_addr(const sockaddr_storage *ss)
-{
-	if (ss->ss_family == AF_INET)
-		return &(((const sockaddr_in*)ss)->sin_addr);
-	else
-		return &(((const sockaddr_in6*)ss)->sin6_addr);
-}
+loop_heartbeat *g_heartbeat = NULL;	// û -W ʱ NULL
+loop_counters g_counters;			//  -P 
+uint64_t g_events = 0;				// ϴ prepare ˼ io ص
 
-string get_sock_addr(int sock)
+/* watcher  data ָ client */
+struct client_t
 {
-	char addr_str[INET6_ADDRSTRLEN];
-	sockaddr_storage client_addr;
-	socklen_t size = sizeof(client_addr);
-	getpeername(sock, (sockaddr*)&client_addr, &size);
-	inet_ntop(client_addr.ss_family, get_sin_addr(&client_addr), addr_str, sizeof(addr_str));
-	return addr_str;
-}
+	ev_io io;
+	string out;		// send ûĲ֣֮ǰ
+};
 
-void setnonblocking(int fd) 
+void close_client(EV_P_ client_t *client)
 {
-	int flag = fcntl(fd, F_GETFL, 0);
-	if (flag < 0) 
-	{
-		perror("fcntl F_GETFL ERROR");
-		exit(EXIT_FAILURE);
-	}
-	if (fcntl(fd, F_SETFL, flag | O_NONBLOCK) < 0) 
-	{
-		perror("fcntl F_SETFL ERROR");
-		exit(EXIT_FAILURE);
-	}
+	ev_io_stop(EV_A_ &client->io);
+	close(client->io.fd);
+	delete client;
 }
 
-int make_sock()
+/* ɵȴһ¼watcher Ҫܸͣ */
+void set_events(EV_P_ client_t *client, int events)
 {
-	struct addrinfo hints, *server_addr;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;		// ipv4 or ipv6
-	hints.ai_socktype = SOCK_STREAM;	
-	hints.ai_flags = AI_PASSIVE;		// use bind
-
-	int ret = getaddrinfo(NULL, PORT, &hints, &server_addr);
-	if (ret != 0)
-	{
-		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl; 
-		exit(EXIT_FAILURE);
-	}
+	ev_io_stop(EV_A_ &client->io);
+	ev_io_set(&client->io, client->io.fd, events);
+	ev_io_start(EV_A_ &client->io);
+}
 
-	// ѭҿõ addr
-	int server_sock;
-	struct addrinfo *p;
-	for(p = server_addr; p != NULL; p = p->ai_next)
+/*  false out  */
+bool flush_out(client_t *client)
+{
+	while (!client->out.empty())
 	{
-		server_sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (server_sock == -1)
-		{
-			perror("socket ERROR");
-			continue;
-		}
-
-		int opt = 1;
-		
-		ret = setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+		ssize_t ret = send(client->io.fd, client->out.data(), client->out.size(), MSG_NOSIGNAL);
 		if (ret == -1)
 		{
-			perror("reuseaddr ERROR");
-			exit(EXIT_FAILURE);
-		}
-
-		ret = bind(server_sock, p->ai_addr, p->ai_addrlen);
-		if (ret == -1)
-		{
-			close(server_sock);
-			perror("bind ERROR");
-			continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			perror("send ERROR");
+			return false;
 		}
-		break;
+		client->out.erase(0, ret);
 	}
+	return true;
+}
 
-	if (p == NULL)
-	{
-		cerr << "failed to make socket!" << endl;
-		exit(EXIT_FAILURE);
-	}
-
-	freeaddrinfo(server_addr);
-
-	ret = listen(server_sock, BACKLOG);
-	if (ret == -1)
+void echo_write(EV_P_ client_t *client)
+{
+	TRACE_SCOPE("echo_write");
+	if (!flush_out(client))
 	{
-		perror("listen ERROR");
-		exit(EXIT_FAILURE);
+		close_client(EV_A_ client);
+		return;
 	}
-
-	return server_sock;
+	if (client->out.empty())
+		set_events(EV_A_ client, EV_READ);
 }
 
-void echo_read(EV_P_ struct ev_io *w, int revents)
+void echo_read(EV_P_ client_t *client)
 {
-	char buf[ECHO_LEN];
-	int ret = recv(w->fd, buf, ECHO_LEN, 0);
+	TRACE_SCOPE("echo_read");
+	char *buf = (char*)arena_alloc(g_config.buffer_size);
+	int ret = recv(client->io.fd, buf, g_config.buffer_size, 0);
 	if (ret <= 0)
 	{
+		TRACE_SCOPE("log");
 		if (ret < 0)
 			perror("recv ERROR");
 		else
-			cout << "client closed " << get_sock_addr(w->fd) << endl;
+			cout << "client closed " << get_sock_addr(client->io.fd) << endl;
+
+		arena_free(buf);
+		close_client(EV_A_ client);
+		return;
+	}
 
-		close(w->fd);
-		ev_io_stop(EV_A_ w);
-		delete w;
+	// client յʱ send ֻȥһ֣ʣµĿ out ȿд
+	ssize_t sent = send(client->io.fd, buf, ret, MSG_NOSIGNAL);
+	if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		perror("send ERROR");
+		arena_free(buf);
+		close_client(EV_A_ client);
+		return;
+	}
+	if (sent < ret)
+	{
+		sent = max<ssize_t>(sent, 0);
+		client->out.assign(buf + sent, ret - sent);
+		set_events(EV_A_ client, EV_WRITE);
 	}
-	send(w->fd, buf, ret, 0);
+	arena_free(buf);
+}
+
+void on_client(EV_P_ struct ev_io *w, int revents)
+{
+	client_t *client = (client_t*)w->data;
+	++g_events;
+	if (revents & EV_WRITE)
+		echo_write(EV_A_ client);
+	else
+		echo_read(EV_A_ client);
 }
 
 void on_new_connection(EV_P_ struct ev_io *w, int revents)
 {
-	struct sockaddr_storage client_addr;
-	socklen_t addr_size = sizeof(client_addr);
-	int client_sock = accept(w->fd, (struct sockaddr *)&client_addr, &addr_size);
+	TRACE_SCOPE("on_new_connection");
+	++g_events;
+	int client_sock = accept(w->fd, NULL, NULL);
 	if (client_sock == -1)
 	{
 		perror("accept ERROR");
 		return;
 	}
 
-	cout << "client from " << get_sock_addr(client_sock) << endl;
+	{
+		TRACE_SCOPE("log");
+		cout << "client from " << get_sock_addr(client_sock) << endl;
+	}
 
 	setnonblocking(client_sock);
 
-	ev_io* ev_client = new ev_io;
-	ev_io_init(ev_client, echo_read, client_sock, EV_READ);
-	ev_io_start(loop, ev_client);
+	client_t *client = new client_t;
+	ev_io_init(&client->io, on_client, client_sock, EV_READ);
+	client->io.data = client;
+	ev_io_start(loop, &client->io);
+}
+
+struct backend_name
+{
+	const char *name;
+	unsigned int flag;
+};
+
+/* ϰ汾 libev û linuxaio  io_uring */
+const backend_name g_backends[] = {
+	{"select", EVBACKEND_SELECT},
+	{"poll", EVBACKEND_POLL},
+	{"epoll", EVBACKEND_EPOLL},
+#ifdef EVBACKEND_LINUXAIO
+	{"linuxaio", EVBACKEND_LINUXAIO},
+#endif
+#ifdef EVBACKEND_IOURING
+	{"iouring", EVBACKEND_IOURING},
+#endif
+};
+
+const char *backend_to_name(unsigned int flag)
+{
+	for (auto &b : g_backends)
+		if (b.flag == flag)
+			return b.name;
+	return "unknown";
+}
+
+unsigned int name_to_backend(const char *name)
+{
+	if (strcmp(name, "auto") == 0)
+		return EVFLAG_AUTO;
+
+	for (auto &b : g_backends)
+	{
+		if (strcmp(b.name, name) != 0)
+			continue;
+		if (!(ev_supported_backends() & b.flag))
+		{
+			cerr << "backend " << name << " is not supported here" << endl;
+			exit(EXIT_FAILURE);
+		}
+		return b.flag;
+	}
+
+	cerr << "unknown backend " << name << endl;
+	exit(EXIT_FAILURE);
+}
+
+void on_print_stats(EV_P_ struct ev_signal *w, int revents)
+{
+	arena_print_stats();
+	watchdog_print_stats();
+	g_counters.print("loop");
+}
+
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* check ռ¼֮󡢵ûص֮ǰprepare һε¼֮ǰмһִʱ */
+void on_check(EV_P_ struct ev_check *w, int revents)
+{
+	if (g_heartbeat)
+		watchdog_begin(g_heartbeat, now_ns());
+}
+
+void on_prepare(EV_P_ struct ev_prepare *w, int revents)
+{
+	if (g_heartbeat)
+		watchdog_end(g_heartbeat, now_ns());
+	g_counters.tick(g_events);
+	g_events = 0;
+}
+
+void on_trace(EV_P_ struct ev_signal *w, int revents)
+{
+	trace_toggle();
 }
 
-int main()
+void usage(const char *prog)
 {
-	struct ev_loop *loop = EV_DEFAULT;
+	cerr << "usage: " << prog << " [-H] [-b backend] [-i io_interval] [-t timeout_interval] [-T trace_file] [-W stall_ms] [-P every]" << endl;
+	cerr << "  -H  do not use hugepages for buffers" << endl;
+	cerr << "  -b  auto, select, poll, epoll";
+#ifdef EVBACKEND_LINUXAIO
+	cerr << ", linuxaio";
+#endif
+#ifdef EVBACKEND_IOURING
+	cerr << ", iouring";
+#endif
+	cerr << endl;
+	cerr << "  -i  seconds to wait collecting more io events per iteration (ev_set_io_collect_interval)" << endl;
+	cerr << "  -t  seconds to wait collecting more timeouts (ev_set_timeout_collect_interval)" << endl;
+	cerr << "  -T  kill -USR2 turns tracing on, the next USR2 writes chrome trace json to trace_file" << endl;
+	cerr << "  -W  print the phase and stack of any loop iteration that runs longer than stall_ms" << endl;
+	cerr << "  -P  read cycles, instructions, cache and branch misses around every n-th loop iteration,"
+		<< " kill -USR1 prints them per event" << endl;
+	server_usage();
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	bool hugepage = true;
+	unsigned int backend = EVFLAG_AUTO;
+	ev_tstamp io_interval = 0;
+	ev_tstamp timeout_interval = 0;
+	const char *trace_path = NULL;
+	uint64_t stall_ms = 0;
+	uint64_t counter_every = 0;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "Hb:i:t:T:W:P:", server_long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'H': hugepage = false; break;
+		case 'b': backend = name_to_backend(optarg); break;
+		case 'i': io_interval = atof(optarg); break;
+		case 't': timeout_interval = atof(optarg); break;
+		case 'T': trace_path = optarg; break;
+		case 'W': stall_ms = strtoull(optarg, NULL, 10); break;
+		case 'P': counter_every = strtoull(optarg, NULL, 10); break;
+		default:
+			if (!server_parse_option(opt, optarg))
+				usage(argv[0]);
+		}
+	}
+
+	arena_init(ARENA_DEFAULT_SIZE, hugepage);
+
+	// ָ backend ʱ LIBEV_FLAGS 
+	struct ev_loop *loop = ev_default_loop(backend == EVFLAG_AUTO ? EVFLAG_AUTO : backend | EVFLAG_NOENV);
+	if (loop == NULL)
+	{
+		cerr << "failed to create loop with backend " << backend_to_name(backend) << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// ߸ʱÿεһᣬһδ¼ٻѴ
+	ev_set_io_collect_interval(loop, io_interval);
+	ev_set_timeout_collect_interval(loop, timeout_interval);
 
-	int server_sock = make_sock();
+	cout << "backend " << backend_to_name(ev_backend(loop))
+		<< ", io collect interval " << io_interval << "s"
+		<< ", timeout collect interval " << timeout_interval << "s" << endl;
 
-	ev_io ev_server;
-	ev_io_init(&ev_server, on_new_connection, server_sock, EV_READ);
-	ev_io_start(loop, &ev_server);
+	// kill -USR1 ӡ buffer ͳ
+	ev_signal ev_stats;
+	ev_signal_init(&ev_stats, on_print_stats, SIGUSR1);
+	ev_signal_start(loop, &ev_stats);
+	ev_unref(loop);
+
+	ev_signal ev_trace;
+	if (trace_path)
+	{
+		trace_init(trace_path);
+		ev_signal_init(&ev_trace, on_trace, SIGUSR2);
+		ev_signal_start(loop, &ev_trace);
+		ev_unref(loop);
+	}
+
+	ev_check ev_begin;
+	ev_prepare ev_end;
+	watchdog_start(stall_ms);
+	g_heartbeat = watchdog_register("loop");
+	if (counter_every && !g_counters.open(counter_every))
+		perror("perf_event_open ERROR, running without counters");
+	if (g_heartbeat || g_counters.valid())
+	{
+		ev_check_init(&ev_begin, on_check);
+		ev_check_start(loop, &ev_begin);
+		ev_unref(loop);
+		ev_prepare_init(&ev_end, on_prepare);
+		ev_prepare_start(loop, &ev_end);
+		ev_unref(loop);
+	}
+
+	// tcp  unix socket һ watcheraccept ֮Ĵһ
+	vector<int> listeners = make_listeners();
+	vector<ev_io> ev_servers(listeners.size());
+	for (size_t i = 0; i < listeners.size(); ++i)
+	{
+		ev_io_init(&ev_servers[i], on_new_connection, listeners[i], EV_READ);
+		ev_io_start(loop, &ev_servers[i]);
+	}
 
 	cout << "wairting for clients..." << endl;
 	return ev_run(loop, 0);
@@ -13,11 +13,19 @@
 #include "dbg.h"
 
 // echo_client based on libev and udp
+// -f ѹģʽ socket һֱÿ socket  window ·ϣյһذһ
 //
 #define PORT 12322	// Ӷ˿ڿʼֵҿö˿
 #define ECHO_LEN 1025
 #define SERVER_PORT "12321"
 
+#define FLOOD_SOCKS 8			// Ԫָ̣߳socket һЩŷֵÿ
+#define FLOOD_SIZE 64
+#define FLOOD_WINDOW 32
+#define FLOOD_DURATION 10
+#define FLOOD_TICK 0.1			// 鶪ļ
+#define FLOOD_TIMEOUT 0.2		// ôûлذ·ϵİ㶪
+
 int make_sock(const char* addr)
 {
 	struct addrinfo hints, *client_addr, *server_addr;
@@ -123,17 +131,172 @@ error:
 	return;
 }
 
+struct flood_sock
+{
+	ev_io io;
+	int inflight;
+	ev_tstamp last_recv;
+};
+
+struct flood_stat
+{
+	unsigned long long sent;
+	unsigned long long received;
+	unsigned long long lost;
+};
+
+struct flood_sock *g_socks;
+int g_nsocks = FLOOD_SOCKS;
+int g_window = FLOOD_WINDOW;
+char g_payload[ECHO_LEN];
+int g_size = FLOOD_SIZE;
+struct flood_stat g_total, g_last;
+ev_tstamp g_start, g_last_report;
+
+void flood_fill(struct flood_sock *fs)
+{
+	while (fs->inflight < g_window)
+	{
+		int ret = send(fs->io.fd, g_payload, g_size, 0);
+		if (ret == -1)
+		{
+			// ͻ˾͵һذһμٷ
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+				perror("send ERROR");
+			return;
+		}
+		++fs->inflight;
+		++g_total.sent;
+	}
+}
+
+void flood_read(EV_P_ struct ev_io *w, int revents)
+{
+	struct flood_sock *fs = (struct flood_sock*)w;
+	char buf[ECHO_LEN];
+	for (;;)
+	{
+		int ret = recv(w->fd, buf, sizeof(buf), 0);
+		if (ret == -1)
+			break;
+		if (fs->inflight > 0)
+			--fs->inflight;
+		++g_total.received;
+	}
+	fs->last_recv = ev_now(EV_A);
+	flood_fill(fs);
+}
+
+/* udp İ˲κ֪ͨʱûذ͵·ϵĶˣ¿ʼ */
+void flood_tick(EV_P_ struct ev_timer *w, int revents)
+{
+	ev_tstamp now = ev_now(EV_A);
+	for (int i = 0; i < g_nsocks; ++i)
+	{
+		struct flood_sock *fs = &g_socks[i];
+		if (fs->inflight > 0 && now - fs->last_recv > FLOOD_TIMEOUT)
+		{
+			g_total.lost += fs->inflight;
+			fs->inflight = 0;
+			fs->last_recv = now;
+		}
+		flood_fill(fs);
+	}
+}
+
+void flood_report(EV_P_ struct ev_timer *w, int revents)
+{
+	ev_tstamp now = ev_now(EV_A);
+	double elapsed = now - g_last_report;
+	printf("[%5.0fs] sent %.0f pps, received %.0f pps, lost %llu\n", now - g_start,
+		(g_total.sent - g_last.sent) / elapsed, (g_total.received - g_last.received) / elapsed,
+		g_total.lost - g_last.lost);
+	g_last = g_total;
+	g_last_report = now;
+}
+
+void flood_stop(EV_P_ struct ev_timer *w, int revents)
+{
+	double elapsed = ev_now(EV_A) - g_start;
+	printf("%d sockets, %d bytes, window %d: sent %llu received %llu lost %llu in %.1fs, %.0f pps echoed\n",
+		g_nsocks, g_size, g_window, g_total.sent, g_total.received, g_total.lost, elapsed,
+		g_total.received / elapsed);
+	ev_break(EV_A_ EVBREAK_ALL);
+}
+
+int flood(const char *addr, int duration)
+{
+	struct ev_loop *loop = EV_DEFAULT;
+
+	//  0server  strlen 㳤
+	memset(g_payload, 'x', sizeof(g_payload));
+
+	g_socks = (struct flood_sock*)calloc(g_nsocks, sizeof(struct flood_sock));
+	check_mem(g_socks);
+	for (int i = 0; i < g_nsocks; ++i)
+	{
+		int sock = make_sock(addr);
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+		ev_io_init(&g_socks[i].io, flood_read, sock, EV_READ);
+		ev_io_start(loop, &g_socks[i].io);
+	}
+
+	g_start = g_last_report = ev_now(loop);
+
+	ev_timer tick, report, stop;
+	ev_timer_init(&tick, flood_tick, 0, FLOOD_TICK);
+	ev_timer_start(loop, &tick);
+	ev_timer_init(&report, flood_report, 1, 1);
+	ev_timer_start(loop, &report);
+	ev_timer_init(&stop, flood_stop, duration, 0);
+	ev_timer_start(loop, &stop);
+
+	ev_run(loop, 0);
+	return g_total.received > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+error:
+	return EXIT_FAILURE;
+}
+
+void usage()
+{
+	printf("usage: libev_udp_echo_client server_ip\n");
+	printf("       libev_udp_echo_client -f [-c sockets] [-s size] [-w window] [-d duration] server_ip\n");
+	printf("  -f  flood the server and report echoed packets per second\n");
+	printf("  -c  sockets, each from its own port, default %d\n", FLOOD_SOCKS);
+	printf("  -s  bytes per packet, at most %d, default %d\n", ECHO_LEN - 1, FLOOD_SIZE);
+	printf("  -w  packets in flight per socket, default %d\n", FLOOD_WINDOW);
+	printf("  -d  seconds to run, default %d\n", FLOOD_DURATION);
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char* argv[])
 {
-	if(argc != 2)
+	int is_flood = 0;
+	int duration = FLOOD_DURATION;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "fc:s:w:d:")) != -1)
 	{
-		printf("usage: libev_udp_echo_client server_ip\n");
-		return 0;
+		switch (opt)
+		{
+		case 'f': is_flood = 1; break;
+		case 'c': g_nsocks = atoi(optarg); break;
+		case 's': g_size = atoi(optarg); break;
+		case 'w': g_window = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		default: usage();
+		}
 	}
+	if (optind != argc - 1 || g_nsocks <= 0 || g_size <= 0 || g_size >= ECHO_LEN || g_window <= 0 || duration <= 0)
+		usage();
+
+	if (is_flood)
+		return flood(argv[optind], duration);
 
 	struct ev_loop *loop = EV_DEFAULT;
 
-	int client_sock = make_sock(argv[1]);
+	int client_sock = make_sock(argv[optind]);
 
 	printf(">> ");
 	fflush(stdout);
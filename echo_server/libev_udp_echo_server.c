@@ -19,6 +19,8 @@
 #define NI_MAXHOST  1025
 #define NI_MAXSERV	32
 
+int g_quiet = 0;	// -q ӡյݣѹʱӡշ
+
 int make_sock()
 {
 	struct addrinfo hints, *server_addr;
@@ -78,6 +80,13 @@ void echo_read(EV_P_ struct ev_io *w, int revents)
 	check(ret > 0, "recv error");
 	buf[ret] = '\0';
 
+	if (g_quiet)
+	{
+		ret = send(w->fd, buf, ret, 0);
+		check(ret > 0, "send");
+		return;
+	}
+
 	struct sockaddr_storage client_addr;
 	socklen_t addr_size = sizeof(client_addr);
 	getpeername(w->fd, (struct sockaddr*)&client_addr, &addr_size);
@@ -109,7 +118,8 @@ void accept_client(EV_P_ struct ev_io *w, int revents)
 		sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
 	check(ret == 0, "getnameinfo");
 
-	printf("recvfrom client [%s:%s] : %s\n", hbuf, sbuf, buf);
+	if (!g_quiet)
+		printf("recvfrom client [%s:%s] : %s\n", hbuf, sbuf, buf);
 
 	// һµsocketӵĿͻˣsocketͿרclientͨ
 	int new_sock = make_sock();
@@ -127,8 +137,20 @@ error:
 	return;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+	int opt;
+	while ((opt = getopt(argc, argv, "q")) != -1)
+	{
+		switch (opt)
+		{
+		case 'q': g_quiet = 1; break;
+		default:
+			printf("usage: libev_udp_echo_server [-q]\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	struct ev_loop *loop = EV_DEFAULT;
 
 	int server_sock = make_sock();
@@ -5,13 +5,173 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <new>
 #include <uv.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include "capture.h"
+#include "arena.h"
+#include "histogram.h"
+#include "perf_counter.h"
+#include "server_core.h"
+#include "http.h"
+#include "transform.h"
+#include "trace.h"
+#include "pool.h"
+#include "file_cache.h"
+#include "watchdog.h"
 
 using namespace std;
 
-#define PORT 12321		// 连接端口
-#define BACKLOG 10		// 等待连接队列大小
-#define ECHO_LEN 1024
+#define HIGH_WATERMARK (1 << 20)	// 写队列超过这个大小就暂停读
+#define LOW_WATERMARK (256 << 10)	// 写队列降到这个大小以下再继续读
+#define MIGRATE_INTERVAL 1000		// 多 loop 时每隔多少毫秒检查一次负载
+#define MIGRATE_MIN_UTIL 0.5		// 最忙的 loop 超过这个利用率才迁移
+#define MIGRATE_MIN_GAP 0.2			// 最忙和最闲的 loop 利用率差超过这个值才迁移
+#define OFFLOAD_COST (256 << 10)	// 数据长度乘以 rounds 超过这个值就交给线程池算
+#define FILE_CHUNK (1 << 20)		// 静态文件每次 sendfile 或者 read 最多多少字节
+#define FILE_STALL_SEC 30			// sendfile 时 client 这么久一个字节都不收就断开
+
+struct worker_t;
+struct transform_job;
+struct file_send_t;
+
+/*
+ * 连接记录从所在 loop 线程的 fixed_pool 里分配，空闲连接不挂任何 buffer，
+ * 标记放在一起减少对齐的空洞，job 队列串在 job 自己身上，空队列不分配内存
+ */
+struct client_t
+{
+	union
+	{
+		uv_handle_t base;
+		uv_tcp_t tcp;
+		uv_pipe_t pipe;		// 从 unix socket 连上来的
+	} handle;
+	bool is_pipe;
+	bool reading;
+	bool migrating;			// 已经停止读，等写队列清空后交给 target
+	bool close_after_write;	// 回复写完就关：http 不要 keep-alive，或者 client 半关闭了
+	bool busy;				// 队头的 job 在线程池里
+	bool closed;			// handle 已经关了，等线程池里的 job 回来再释放
+	bool counted;			// 算在所在 worker 的 conns 里
+	uint32_t conn_id;		// 记录流量用的连接 id
+	uint32_t digest;		// 这个连接到目前为止的 transform 结果
+	string in;				// http 模式下还不完整的请求
+	transform_job *job_head;	// 读到了还没算完的数据，按顺序算完再写回去
+	transform_job *job_tail;
+	size_t job_bytes;
+	worker_t *target;
+	file_send_t *sending;	// 正在发的大文件，发完之前不读也不处理后面的请求
+	size_t peak_queued;		// 写队列的峰值
+	uint64_t busy_ns;		// 这个统计周期里读回调花的时间
+	uint64_t last_busy_ns;	// 上个统计周期的
+};
+
+/* 从一个 loop 交给另一个 loop 的连接，fd 是 dup 出来的 */
+struct handoff_t
+{
+	int fd;
+	bool is_pipe;
+	bool migrated;			// false 表示刚 accept 的新连接
+	uint32_t conn_id;
+	size_t peak_queued;
+	uint64_t last_busy_ns;
+	string pending;			// http 模式下还没凑齐的请求跟着连接走
+	uint32_t digest;
+};
+
+/* 一次读到的数据，算完 transform 之后原样写回去 */
+struct transform_job
+{
+	uv_work_t work;
+	client_t *client;
+	transform_job *next;
+	char *buf;
+	size_t len;
+	uint32_t digest;		// 进线程池前是连接当前的结果，回来时是算完这段之后的
+};
+
+/* http 的回复先 uv_try_write，写不完的部分拷到这里排队 */
+struct http_write_t
+{
+	uv_write_t req;
+	string data;
+};
+
+/*
+ * 一个大文件的发送，小文件跟响应头一起从内存写出去，用不到这个
+ * 响应头写完才开始 sendfile，每次最多 FILE_CHUNK，发完一块再发下一块
+ */
+struct file_send_t
+{
+	uv_fs_t fs;				// 拷贝模式下读文件
+	uv_work_t work;			// 线程池里阻塞的 sendfile
+	ssize_t result;			// 线程池里这一块发了多少，出错是负的错误码
+	uv_write_t write;		// 响应头，拷贝模式下还有读出来的每一块
+	client_t *client;
+	file_entry *entry;
+	int sock;
+	bool blocking;			// sendfile 期间 socket 改成了阻塞的
+	int64_t offset;
+	int64_t left;
+	char *buf;				// 拷贝模式下读文件用的 buffer
+	string header;
+};
+
+/* 多 loop 模式下每个线程一个 loop，连接只能通过 inbox 加 uv_async 在 loop 之间转交 */
+struct worker_t
+{
+	int id;
+	uv_loop_t loop;
+	uv_async_t async;
+	uv_timer_t timer;			// 每个统计周期算一次利用率
+	uv_prepare_t prepare;
+	uv_check_t check;
+	uv_thread_t thread;
+
+	mutex lock;					// 保护 inbox 和 migrate_to
+	vector<handoff_t> inbox;
+	worker_t *migrate_to;		// 均衡的时候要求把一个热点连接迁到这里
+	atomic<bool> stopping;		// 主 loop 收到退出信号，下次 async 时停掉这个 loop
+
+	atomic<double> util;		// 上个统计周期的利用率
+	atomic<uint64_t> conns;
+	atomic<uint64_t> migrated_in;
+	atomic<uint64_t> migrated_out;
+	uint64_t last_hrtime;
+	uint64_t last_idle;
+	uint64_t prepare_hrtime;
+	uint64_t prepare_idle;
+	histogram iteration;		// 每次循环处理事件花的时间，决定了这个 loop 上连接的尾延迟
+	loop_heartbeat *heartbeat;	// 没开 -W 时是 NULL
+	loop_counters counters;		// 开了 -P 才有
+};
+
+size_t g_high_watermark = HIGH_WATERMARK;
+size_t g_low_watermark = LOW_WATERMARK;
+vector<worker_t*> g_workers;
+uint64_t g_migrate_interval = MIGRATE_INTERVAL;
+size_t g_next_worker = 0;
+bool g_http = false;
+const transform_t *g_transform = NULL;
+int g_rounds = 1;
+size_t g_offload_cost = OFFLOAD_COST;
+bool g_shared_buffer = false;		// 读 buffer 每个 loop 共用一个，写不完的部分才拷出来
+uint64_t g_counter_every = 0;		// 每多少轮采一次硬件计数器，0 不采
+loop_counters g_main_counters;
+static thread_local uint64_t t_loop_events = 0;	// 上次 prepare 以来这个 loop 调用了几次读回调
+int g_root_fd = -1;					// 静态文件的根目录，-1 表示不是静态文件模式
+bool g_copy_files = false;			// 大文件用 read 加 write 发，跟 sendfile 对比
+size_t g_file_entries = FILE_CACHE_ENTRIES;
+size_t g_small_file = FILE_CACHE_SMALL;
 
 // error handling
 #define FAIL_EXIT(ret, msg)										\
@@ -25,106 +185,1416 @@ do																\
 }																\
 while(0)
 
+string get_sock_addr(const uv_handle_t *handle)
+{
+	uv_os_fd_t fd;
+	if (uv_fileno(handle, &fd) != 0)
+		return "";
+	return get_sock_addr(fd);
+}
+
+/* 连接只在所在 loop 的线程里创建和释放，每个线程一个 pool 不用加锁 */
+static thread_local fixed_pool t_client_pool(sizeof(client_t));
 
-/* 拿 ipv4 或者 ipv6 的 in_addr */
-const void *get_sin_addr(const sockaddr_storage *ss)
+void push_job(client_t *client, transform_job *job)
 {
-	if (ss->ss_family == AF_INET)
-		return &(((const sockaddr_in*)ss)->sin_addr);
+	job->next = NULL;
+	if (client->job_tail)
+		client->job_tail->next = job;
 	else
-		return &(((const sockaddr_in6*)ss)->sin6_addr);
+		client->job_head = job;
+	client->job_tail = job;
+	client->job_bytes += job->len;
 }
 
-string get_sock_addr(const uv_tcp_t *tcp_t)
+void pop_job(client_t *client)
 {
-	char addr_str[INET6_ADDRSTRLEN];
-	sockaddr_storage client_addr;
-	int size = sizeof(client_addr);
-	uv_tcp_getsockname(tcp_t, (sockaddr*)&client_addr, &size);
-	uv_inet_ntop(client_addr.ss_family, get_sin_addr(&client_addr), addr_str, sizeof(addr_str));
-	return addr_str;
+	transform_job *job = client->job_head;
+	client->job_head = job->next;
+	if (client->job_head == NULL)
+		client->job_tail = NULL;
+	client->job_bytes -= job->len;
 }
 
-void on_close(uv_handle_t *client)
+void free_jobs(client_t *client)
 {
-	delete client;
+	while (client->job_head)
+	{
+		transform_job *job = client->job_head;
+		pop_job(client);
+		arena_free(job->buf);
+		delete job;
+	}
+}
+
+void delete_client(client_t *client)
+{
+	free_jobs(client);
+	client->~client_t();
+	t_client_pool.free(client);
+}
+
+/* 连接离开 worker 时从它的 conns 里减掉，交出去和关掉都会走到这里，只减一次 */
+void uncount_client(client_t *client)
+{
+	if (!client->counted)
+		return;
+	client->counted = false;
+	worker_t *w = (worker_t*)client->handle.base.loop->data;
+	if (w)
+		--w->conns;
+}
+
+void on_close(uv_handle_t *handle)
+{
+	client_t *client = (client_t*)handle->data;
+	uncount_client(client);
+	if (client->busy)
+	{
+		// 线程池里的 job 还引用着 client，回来时再删
+		client->closed = true;
+		return;
+	}
+	delete_client(client);
 }
 
 void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
 {
-	buf->base = new char[suggested_size];
-	buf->len = suggested_size;
+	// 读回调返回之前数据都处理完了，同一个 loop 上的连接可以轮流用一个 buffer
+	static thread_local char *shared = NULL;
+	if (g_shared_buffer)
+	{
+		if (shared == NULL)
+			shared = new char[g_config.buffer_size];
+		buf->base = shared;
+		buf->len = g_config.buffer_size;
+		return;
+	}
+
+	// 不用 libuv 建议的 64K，跟其他 server 用一样的 buffer 大小
+	buf->base = (char*)arena_alloc(g_config.buffer_size);
+	buf->len = g_config.buffer_size;
+}
+
+void release_buffer(const uv_buf_t *buf)
+{
+	if (!g_shared_buffer)
+		arena_free(buf->base);
+}
+
+void echo_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+void http_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+void file_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+void handoff(client_t *client, worker_t *target, bool migrated);
+
+void start_reading(client_t *client)
+{
+	client->reading = true;
+	uv_read_cb read_cb = g_root_fd != -1 ? file_read : g_http ? http_read : echo_read;
+	uv_read_start((uv_stream_t*)&client->handle.base, alloc_buffer, read_cb);
+}
+
+/* 记录读回调花的时间，用来找热点连接，顺便给硬件计数器数事件 */
+struct busy_timer
+{
+	busy_timer(client_t *client) : client_(client), start_(uv_hrtime()) { ++t_loop_events; }
+	~busy_timer() { client_->busy_ns += uv_hrtime() - start_; }
+
+	client_t *client_;
+	uint64_t start_;
+};
+
+/* 写队列加上还没算完的数据，都算 client 没取走的 */
+size_t queued_bytes(client_t *client)
+{
+	return uv_stream_get_write_queue_size((uv_stream_t*)&client->handle.base) + client->job_bytes;
+}
+
+/* 一个写请求完成之后，看要不要迁移、关闭或者恢复读 */
+void after_write(uv_stream_t *stream)
+{
+	client_t *client = (client_t*)stream->data;
+	if (uv_is_closing((uv_handle_t*)stream))
+		return;
+
+	// 文件发完之后再决定接下来做什么
+	if (client->sending)
+		return;
+
+	if (client->close_after_write)
+	{
+		if (queued_bytes(client) == 0)
+			uv_close((uv_handle_t*)stream, on_close);
+		return;
+	}
+
+	// 迁移要等已经读到的数据都算完写回去，否则会丢数据
+	if (client->migrating)
+	{
+		if (queued_bytes(client) == 0)
+			handoff(client, client->target, true);
+		return;
+	}
+
+	// 慢的 client 把写队列消化到低水位以下再继续读
+	if (!client->reading && queued_bytes(client) <= g_low_watermark)
+		start_reading(client);
+}
+
+/* client 只发不收时写队列会无限增长，超过高水位先停止读 */
+void check_high_watermark(client_t *client)
+{
+	uv_stream_t *stream = (uv_stream_t*)&client->handle.base;
+	size_t queued = queued_bytes(client);
+	if (queued > client->peak_queued)
+		client->peak_queued = queued;
+	if (queued > g_high_watermark)
+	{
+		client->reading = false;
+		uv_read_stop(stream);
+	}
+}
+
+void close_client(client_t *client, ssize_t nread)
+{
+	{
+		TRACE_SCOPE("log");
+		if (nread != UV_EOF)
+			cerr << "read ERROR: " << uv_strerror(nread) << endl;
+		else if (g_transform)
+			cout << "client closed " << get_sock_addr(&client->handle.base)
+				<< " (peak queued " << client->peak_queued << " bytes, "
+				<< g_transform->name << " " << hex << client->digest << dec << ")" << endl;
+		else
+			cout << "client closed " << get_sock_addr(&client->handle.base)
+				<< " (peak queued " << client->peak_queued << " bytes)" << endl;
+	}
+	capture_write(client->conn_id, CAPTURE_CLOSE, NULL, 0);
+
+	// client 只是关了写端时，已经读到的数据还要算完写回去，写完再关
+	if (nread == UV_EOF && queued_bytes(client) > 0)
+	{
+		client->close_after_write = true;
+		client->reading = false;
+		uv_read_stop((uv_stream_t*)&client->handle.base);
+		return;
+	}
+	uv_close(&client->handle.base, on_close);
 }
 
 void echo_write(uv_write_t *req, int status)
 {
+	TRACE_SCOPE("echo_write");
 	if (status)
 	{
 		cerr << "write ERROR: " << uv_strerror(status) << endl;
 	}
 
+	// 写完才能释放读到的 buffer
+	arena_free(req->data);
+	uv_stream_t *stream = req->handle;
 	delete req;
+	after_write(stream);
+}
+
+void queue_write(client_t *client, char *buf, size_t len)
+{
+	uv_write_t *req = new uv_write_t;
+	req->data = buf;
+	uv_buf_t wrbuf = uv_buf_init(buf, len);
+	uv_write(req, (uv_stream_t*)&client->handle.base, &wrbuf, 1, echo_write);
+}
+
+/* buf 的所有权交给写请求，写完在 echo_write 里释放 */
+void echo_send(client_t *client, char *buf, size_t len)
+{
+	capture_write(client->conn_id, CAPTURE_OUT, buf, len);
+	queue_write(client, buf, len);
+}
+
+/*
+ * 数据在共用的读 buffer 里，先 uv_try_write，写不完的部分拷一份排队，
+ * 前面还有没写完的请求时 uv_try_write 返回 UV_EAGAIN，顺序不会乱；连接出错关掉时返回 false
+ */
+bool echo_reply(client_t *client, const char *data, size_t len)
+{
+	uv_stream_t *stream = (uv_stream_t*)&client->handle.base;
+	uv_buf_t wrbuf = uv_buf_init((char*)data, len);
+	int ret = uv_try_write(stream, &wrbuf, 1);
+	if (ret < 0 && ret != UV_EAGAIN)
+	{
+		cerr << "write ERROR: " << uv_strerror(ret) << endl;
+		capture_write(client->conn_id, CAPTURE_CLOSE, NULL, 0);
+		uv_close(&client->handle.base, on_close);
+		return false;
+	}
+
+	capture_write(client->conn_id, CAPTURE_OUT, data, len);
+	size_t written = ret > 0 ? ret : 0;
+	if (written < len)
+	{
+		char *rest = (char*)arena_alloc(len - written);
+		memcpy(rest, data + written, len - written);
+		queue_write(client, rest, len - written);
+	}
+	return true;
+}
+
+void transform_work(uv_work_t *work);
+void after_transform(uv_work_t *work, int status);
+
+/*
+ * 按顺序处理队列里的 job，便宜的直接在 loop 里算，贵的交给线程池，
+ * 同一个连接同时只有一个 job 在线程池里，这样写回去的顺序不会乱，digest 也能接着上一段算
+ */
+void pump(client_t *client)
+{
+	while (!client->busy && client->job_head)
+	{
+		transform_job *job = client->job_head;
+		if (job->len * g_rounds >= g_offload_cost)
+		{
+			job->digest = client->digest;
+			client->busy = true;
+			uv_queue_work(client->handle.base.loop, &job->work, transform_work, after_transform);
+			return;
+		}
+
+		pop_job(client);
+		client->digest = transform_apply(g_transform, client->digest, job->buf, job->len, g_rounds);
+		echo_send(client, job->buf, job->len);
+		delete job;
+	}
 }
 
-void echo_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf)
+/* 在线程池里跑，只能碰 job 自己的数据 */
+void transform_work(uv_work_t *work)
 {
+	TRACE_SCOPE("transform");
+	transform_job *job = (transform_job*)work->data;
+	job->digest = transform_apply(g_transform, job->digest, job->buf, job->len, g_rounds);
+}
+
+void after_transform(uv_work_t *work, int status)
+{
+	TRACE_SCOPE("after_transform");
+	transform_job *job = (transform_job*)work->data;
+	client_t *client = job->client;
+	client->busy = false;
+	pop_job(client);
+
+	// 算的时候连接已经关了，结果直接丢掉
+	if (client->closed || uv_is_closing(&client->handle.base))
+	{
+		arena_free(job->buf);
+		delete job;
+		if (client->closed)
+			delete_client(client);
+		return;
+	}
+
+	client->digest = job->digest;
+	echo_send(client, job->buf, job->len);
+	delete job;
+	pump(client);
+}
+
+void echo_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+	TRACE_SCOPE("echo_read");
+	client_t *client = (client_t*)stream->data;
+	busy_timer timer(client);
 	if (nread < 0)
 	{
-		if (nread != UV_EOF)
-			cerr << "read ERROR: " << uv_strerror(nread) << endl;
+		close_client(client, nread);
+	}
+
+	else if (nread > 0)
+	{
+		capture_write(client->conn_id, CAPTURE_IN, buf->base, nread);
+
+		if (g_transform)
+		{
+			transform_job *job = new transform_job;
+			job->work.data = job;
+			job->client = client;
+			if (g_shared_buffer)
+			{
+				job->buf = (char*)arena_alloc(nread);
+				memcpy(job->buf, buf->base, nread);
+			}
+			else
+			{
+				job->buf = buf->base;
+			}
+			job->len = nread;
+			push_job(client, job);
+			pump(client);
+		}
+		else if (g_shared_buffer)
+		{
+			if (!echo_reply(client, buf->base, nread))
+				return;
+		}
 		else
-			cout << "client closed " << get_sock_addr((uv_tcp_t*)client) << endl;
-		uv_close((uv_handle_t*)client, on_close);
+		{
+			echo_send(client, buf->base, nread);
+		}
+		check_high_watermark(client);
+		return;
+	}
+
+	release_buffer(buf);
+}
+
+void http_write(uv_write_t *req, int status)
+{
+	TRACE_SCOPE("http_write");
+	if (status)
+	{
+		cerr << "write ERROR: " << uv_strerror(status) << endl;
+	}
+
+	uv_stream_t *stream = req->handle;
+	delete (http_write_t*)req;
+	after_write(stream);
+}
+
+/* 大部分时候回复很小，uv_try_write 一次写完，不用分配写请求 */
+void http_respond(client_t *client, const string &out)
+{
+	uv_stream_t *stream = (uv_stream_t*)&client->handle.base;
+	uv_buf_t wrbuf = uv_buf_init((char*)out.data(), out.size());
+	int ret = uv_try_write(stream, &wrbuf, 1);
+	if (ret < 0 && ret != UV_EAGAIN)
+	{
+		cerr << "write ERROR: " << uv_strerror(ret) << endl;
+		capture_write(client->conn_id, CAPTURE_CLOSE, NULL, 0);
+		uv_close(&client->handle.base, on_close);
+		return;
+	}
+
+	size_t written = ret > 0 ? ret : 0;
+	capture_write(client->conn_id, CAPTURE_OUT, out.data(), out.size());
+	if (written == out.size())
+	{
+		if (client->close_after_write && uv_stream_get_write_queue_size(stream) == 0)
+			uv_close(&client->handle.base, on_close);
+		return;
+	}
+
+	http_write_t *w = new http_write_t;
+	w->data.assign(out, written, string::npos);
+	wrbuf = uv_buf_init(&w->data[0], w->data.size());
+	uv_write(&w->req, stream, &wrbuf, 1, http_write);
+	check_high_watermark(client);
+}
+
+void http_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+	TRACE_SCOPE("http_read");
+	client_t *client = (client_t*)stream->data;
+	busy_timer timer(client);
+	if (nread < 0)
+	{
+		close_client(client, nread);
 	}
 
 	else if (nread > 0)
 	{
-		uv_write_t *req = new uv_write_t;
-		uv_buf_t wrbuf = uv_buf_init(buf->base, nread);
-		uv_write(req, client, &wrbuf, 1, echo_write);
+		capture_write(client->conn_id, CAPTURE_IN, buf->base, nread);
+
+		// 每个线程一个回复 buffer，反复用不用每次分配
+		static thread_local string out;
+		out.clear();
+		if (!http_feed(client->in, out, buf->base, nread))
+		{
+			client->close_after_write = true;
+			client->reading = false;
+			uv_read_stop(stream);
+		}
+		http_respond(client, out);
 	}
 
-	if (buf->base)
-		delete buf->base;
+	release_buffer(buf);
+}
+
+/* 每个 loop 线程一个文件缓存，不用加锁 */
+file_cache &files()
+{
+	static thread_local file_cache *cache = NULL;
+	if (cache == NULL)
+		cache = new file_cache(g_root_fd, g_file_entries, g_small_file);
+	return *cache;
+}
+
+void serve_files(client_t *client);
+void send_chunk(file_send_t *fs);
+
+/* 响应头和文件内容攒成整个的包再发，发完再拔掉塞子，不然小文件的正文要等响应头的 ACK */
+void set_cork(client_t *client, int sock, int on)
+{
+	if (!client->is_pipe)
+		setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/*
+ * 交给线程池的 sendfile 期间 socket 改成阻塞的，一次把一块发完，写满了由内核等 client 收，
+ * libuv 不能再给同一个 fd 注册可写事件；这期间已经停止读，写队列也是空的，libuv 不会碰这个 fd，
+ * client 一直不收时靠 SO_SNDTIMEO 超时
+ */
+void set_blocking(file_send_t *fs, bool on)
+{
+	int flags = fcntl(fs->sock, F_GETFL);
+	fcntl(fs->sock, F_SETFL, on ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+	struct timeval tv = {on ? FILE_STALL_SEC : 0, 0};
+	setsockopt(fs->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	fs->blocking = on;
+}
+
+/* 文件发完或者出错，出错直接断开，因为响应已经发了一半 */
+void finish_send(file_send_t *fs, int status)
+{
+	client_t *client = fs->client;
+	if (fs->blocking)
+		set_blocking(fs, false);
+	set_cork(client, fs->sock, 0);
+	files().release(fs->entry);
+	delete[] fs->buf;
+	delete fs;
+	client->sending = NULL;
+
+	if (status < 0)
+	{
+		cerr << "send file ERROR: " << uv_strerror(status) << endl;
+		capture_write(client->conn_id, CAPTURE_CLOSE, NULL, 0);
+		uv_close(&client->handle.base, on_close);
+		return;
+	}
+	if (client->close_after_write)
+	{
+		if (queued_bytes(client) == 0)
+			uv_close(&client->handle.base, on_close);
+		return;
+	}
+
+	// 接着处理发文件期间排在后面的请求
+	start_reading(client);
+	serve_files(client);
+}
+
+/*
+ * 直接调 sendfile(2)，不用 uv_fs_sendfile：libuv 1.52 在 Linux 上先试 copy_file_range，
+ * 目标是 socket 时返回 EINVAL，然后就退回 8K 一次的 read 加 write，内容全要过一遍用户态
+ */
+void sendfile_work(uv_work_t *req)
+{
+	file_send_t *fs = (file_send_t*)req->data;
+	off_t offset = fs->offset;
+	size_t len = fs->left < FILE_CHUNK ? fs->left : FILE_CHUNK;
+	ssize_t done = 0;
+	while ((size_t)done < len)
+	{
+		ssize_t n = sendfile(fs->sock, fs->entry->fd, &offset, len - done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+		{
+			// 发了一部分再出错先把发了的报回去，下一块再报错
+			if (done == 0)
+				done = -errno;
+			break;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	fs->result = done;
+}
+
+void after_sendfile_work(uv_work_t *req, int status)
+{
+	TRACE_SCOPE("sendfile");
+	file_send_t *fs = (file_send_t*)req->data;
+	ssize_t n = status < 0 ? status : fs->result;
+
+	// 阻塞的 socket 返回 EAGAIN 说明 SO_SNDTIMEO 到了
+	if (n == UV_EAGAIN)
+	{
+		finish_send(fs, UV_ETIMEDOUT);
+		return;
+	}
+	if (n <= 0)
+	{
+		// 文件变短了也当出错，Content-Length 已经发出去了
+		finish_send(fs, n < 0 ? n : UV_EOF);
+		return;
+	}
+
+	fs->offset += n;
+	fs->left -= n;
+	send_chunk(fs);
+}
+
+void on_copy_write(uv_write_t *req, int status)
+{
+	TRACE_SCOPE("file_write");
+	file_send_t *fs = (file_send_t*)req->data;
+	if (status < 0)
+		finish_send(fs, status);
+	else
+		send_chunk(fs);
+}
+
+/* 拷贝模式：线程池里 read 一块，再在 loop 里 uv_write 出去，写完读下一块 */
+void on_file_read(uv_fs_t *req)
+{
+	TRACE_SCOPE("file_read");
+	file_send_t *fs = (file_send_t*)req->data;
+	ssize_t n = req->result;
+	uv_fs_req_cleanup(req);
+	if (n <= 0)
+	{
+		finish_send(fs, n < 0 ? n : UV_EOF);
+		return;
+	}
+
+	fs->offset += n;
+	fs->left -= n;
+	uv_buf_t wrbuf = uv_buf_init(fs->buf, n);
+	fs->write.data = fs;
+	uv_write(&fs->write, (uv_stream_t*)&fs->client->handle.base, &wrbuf, 1, on_copy_write);
+}
+
+/*
+ * 先在 loop 里 sendfile 一块，socket 是非阻塞的，socket buffer 有多少空间就发多少，
+ * 每次线程池往返都省掉；写满了再把一块交给线程池，发完回来再在 loop 里试下一块。
+ * 文件不在 page cache 里时这里的 sendfile 会卡住 loop 等磁盘
+ */
+bool sendfile_inline(file_send_t *fs)
+{
+	TRACE_SCOPE("sendfile");
+	if (fs->blocking)
+		set_blocking(fs, false);
+
+	int64_t budget = FILE_CHUNK;
+	while (fs->left > 0 && budget > 0)
+	{
+		off_t offset = fs->offset;
+		size_t len = fs->left < budget ? fs->left : budget;
+		ssize_t n = sendfile(fs->sock, fs->entry->fd, &offset, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+		{
+			finish_send(fs, n < 0 ? -errno : UV_EOF);
+			return false;
+		}
+		fs->offset += n;
+		fs->left -= n;
+		budget -= n;
+	}
+	return true;
+}
+
+void send_chunk(file_send_t *fs)
+{
+	if (!g_copy_files && fs->left > 0 && !sendfile_inline(fs))
+		return;
+	if (fs->left == 0)
+	{
+		finish_send(fs, 0);
+		return;
+	}
+
+	uv_loop_t *loop = fs->client->handle.base.loop;
+	size_t len = fs->left < FILE_CHUNK ? fs->left : FILE_CHUNK;
+	fs->fs.data = fs;
+	if (g_copy_files)
+	{
+		uv_buf_t rdbuf = uv_buf_init(fs->buf, len);
+		uv_fs_read(loop, &fs->fs, fs->entry->fd, &rdbuf, 1, fs->offset, on_file_read);
+	}
+	else
+	{
+		set_blocking(fs, true);
+		fs->work.data = fs;
+		uv_queue_work(loop, &fs->work, sendfile_work, after_sendfile_work);
+	}
+}
+
+void on_header_write(uv_write_t *req, int status)
+{
+	file_send_t *fs = (file_send_t*)req->data;
+	if (status < 0)
+		finish_send(fs, status);
+	else
+		send_chunk(fs);
+}
+
+/*
+ * 停止读，先把 out 里的响应（前面的小文件和这个文件的头）写出去，
+ * 写队列空了才能开始 sendfile，不然数据会插到前面还没写完的响应中间；
+ * 文件的内容不一定经过用户态，流量记录里只有响应头
+ */
+void start_send(client_t *client, file_entry *entry, const string &out)
+{
+	file_send_t *fs = new file_send_t;
+	fs->client = client;
+	fs->entry = entry;
+	fs->offset = 0;
+	fs->left = entry->size;
+	fs->buf = g_copy_files ? new char[FILE_CHUNK] : NULL;
+	fs->blocking = false;
+	client->sending = fs;
+	client->reading = false;
+
+	uv_stream_t *stream = (uv_stream_t*)&client->handle.base;
+	uv_read_stop(stream);
+	uv_os_fd_t sock;
+	uv_fileno(&client->handle.base, &sock);
+	fs->sock = sock;
+	set_cork(client, sock, 1);
+
+	capture_write(client->conn_id, CAPTURE_OUT, out.data(), out.size());
+	uv_buf_t wrbuf = uv_buf_init((char*)out.data(), out.size());
+	int ret = uv_try_write(stream, &wrbuf, 1);
+	if (ret < 0 && ret != UV_EAGAIN)
+	{
+		finish_send(fs, ret);
+		return;
+	}
+
+	size_t written = ret > 0 ? ret : 0;
+	if (written == out.size())
+	{
+		send_chunk(fs);
+		return;
+	}
+	fs->header.assign(out, written, string::npos);
+	wrbuf = uv_buf_init(&fs->header[0], fs->header.size());
+	fs->write.data = fs;
+	uv_write(&fs->write, stream, &wrbuf, 1, on_header_write);
+}
+
+/* 按顺序回复 in 里的请求，小文件直接拼到 out 里，碰到大文件先把 out 发掉再开始发文件 */
+void serve_files(client_t *client)
+{
+	static thread_local string out;
+	out.clear();
+
+	string target;
+	bool keep_alive = true;
+	while (keep_alive)
+	{
+		int ret = http_take_request(client->in, target, keep_alive);
+		if (ret == 0)
+			break;
+		if (ret < 0)
+		{
+			http_append_header(out, 400, 0, false);
+			keep_alive = false;
+			break;
+		}
+
+		int status;
+		file_entry *entry = files().acquire(target, status);
+		if (entry == NULL)
+		{
+			http_append_header(out, status, 0, keep_alive);
+			continue;
+		}
+
+		http_append_header(out, 200, entry->size, keep_alive);
+		if (entry->in_memory)
+		{
+			out.append(entry->data);
+			files().release(entry);
+			continue;
+		}
+
+		if (!keep_alive)
+			client->close_after_write = true;
+		start_send(client, entry, out);
+		return;
+	}
+
+	if (!keep_alive)
+	{
+		client->close_after_write = true;
+		client->reading = false;
+		uv_read_stop((uv_stream_t*)&client->handle.base);
+	}
+	if (!out.empty())
+		http_respond(client, out);
+}
+
+void file_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+	TRACE_SCOPE("file_read");
+	client_t *client = (client_t*)stream->data;
+	busy_timer timer(client);
+	if (nread < 0)
+	{
+		close_client(client, nread);
+	}
+
+	else if (nread > 0)
+	{
+		capture_write(client->conn_id, CAPTURE_IN, buf->base, nread);
+		client->in.append(buf->base, nread);
+		serve_files(client);
+	}
+
+	release_buffer(buf);
+}
+
+/* pool 要不到新的 slab 时返回 NULL */
+client_t *new_client(uv_loop_t *loop, bool is_pipe)
+{
+	void *mem = t_client_pool.alloc();
+	if (mem == NULL)
+		return NULL;
+	client_t *client = new (mem) client_t;
+	if (is_pipe)
+		uv_pipe_init(loop, &client->handle.pipe, 0);
+	else
+		uv_tcp_init(loop, &client->handle.tcp);
+	client->handle.base.data = client;
+	client->is_pipe = is_pipe;
+	client->conn_id = 0;
+	client->reading = false;
+	client->migrating = false;
+	client->close_after_write = false;
+	client->job_head = NULL;
+	client->job_tail = NULL;
+	client->job_bytes = 0;
+	client->busy = false;
+	client->closed = false;
+	client->counted = false;
+	client->digest = 0;
+	client->target = NULL;
+	client->sending = NULL;
+	client->peak_queued = 0;
+	client->busy_ns = 0;
+	client->last_busy_ns = 0;
+	return client;
+}
+
+/*
+ * 把连接交给 target：dup 一份 fd 再关掉原来的 handle，
+ * 调用前必须已经停止读并且写队列为空，没读的数据还在内核里，不会丢
+ */
+void handoff(client_t *client, worker_t *target, bool migrated)
+{
+	uv_os_fd_t fd;
+	int ret = uv_fileno(&client->handle.base, &fd);
+	FAIL_EXIT(ret, "uv_fileno ERROR");
+
+	handoff_t h;
+	h.fd = dup(fd);
+	h.is_pipe = client->is_pipe;
+	h.migrated = migrated;
+	h.conn_id = client->conn_id;
+	h.peak_queued = client->peak_queued;
+	h.last_busy_ns = client->last_busy_ns;
+	h.pending.swap(client->in);
+	h.digest = client->digest;
+	if (h.fd == -1)
+	{
+		perror("dup ERROR");
+		uv_close(&client->handle.base, on_close);
+		return;
+	}
+
+	worker_t *from = (worker_t*)client->handle.base.loop->data;
+	if (from)
+		++from->migrated_out;
+	uncount_client(client);
+	uv_close(&client->handle.base, on_close);
+
+	{
+		lock_guard<mutex> lock(target->lock);
+		target->inbox.push_back(h);
+	}
+	uv_async_send(&target->async);
+}
+
+/* 在 w 的线程里接手别的 loop 交过来的连接 */
+void adopt(worker_t *w, const handoff_t &h)
+{
+	client_t *client = new_client(&w->loop, h.is_pipe);
+	if (client == NULL)
+	{
+		cerr << "alloc client ERROR: out of memory, dropping handed off connection" << endl;
+		close(h.fd);
+		return;
+	}
+	int ret;
+	if (h.is_pipe)
+		ret = uv_pipe_open(&client->handle.pipe, h.fd);
+	else
+		ret = uv_tcp_open(&client->handle.tcp, h.fd);
+	if (ret < 0)
+	{
+		cerr << "open handoff fd ERROR: " << uv_strerror(ret) << endl;
+		close(h.fd);
+		uv_close(&client->handle.base, on_close);
+		return;
+	}
+
+	client->conn_id = h.conn_id;
+	client->peak_queued = h.peak_queued;
+	client->last_busy_ns = h.last_busy_ns;
+	client->in = h.pending;
+	client->digest = h.digest;
+	++w->conns;
+	client->counted = true;
+	if (h.migrated)
+		++w->migrated_in;
+
+	start_reading(client);
+}
+
+struct hottest_arg
+{
+	client_t *client;
+	uint64_t limit;			// 迁过去之后不能让目标 loop 变成新的热点
+};
+
+void find_hottest(uv_handle_t *handle, void *arg)
+{
+	hottest_arg *hot = (hottest_arg*)arg;
+	if ((handle->type != UV_TCP && handle->type != UV_NAMED_PIPE) || uv_is_closing(handle) || handle->data == NULL)
+		return;
+
+	client_t *client = (client_t*)handle->data;
+	if (client->migrating || client->sending || client->last_busy_ns > hot->limit)
+		return;
+	if (hot->client == NULL || client->last_busy_ns > hot->client->last_busy_ns)
+		hot->client = client;
+}
+
+/* 挑一个热点连接迁到 target，迁走的负载不超过两个 loop 利用率的差 */
+void migrate_hottest(worker_t *w, worker_t *target)
+{
+	double gap = w->util.load() - target->util.load();
+	if (gap <= 0)
+		return;
+
+	hottest_arg hot;
+	hot.client = NULL;
+	hot.limit = gap * g_migrate_interval * 1000000;
+	uv_walk(&w->loop, find_hottest, &hot);
+	if (hot.client == NULL || hot.client->last_busy_ns == 0)
+		return;
+
+	client_t *client = hot.client;
+	cout << "migrate client " << get_sock_addr(&client->handle.base) << " from loop " << w->id
+		<< " to loop " << target->id << " (" << client->last_busy_ns / 1000 << "us busy)" << endl;
+
+	client->migrating = true;
+	client->target = target;
+	client->reading = false;
+	uv_read_stop((uv_stream_t*)&client->handle.base);
+	if (queued_bytes(client) == 0)
+		handoff(client, target, true);
+}
+
+void on_worker_async(uv_async_t *async)
+{
+	worker_t *w = (worker_t*)async->data;
+	if (w->stopping)
+	{
+		uv_stop(&w->loop);
+		return;
+	}
+
+	vector<handoff_t> inbox;
+	worker_t *target;
+	{
+		lock_guard<mutex> lock(w->lock);
+		inbox.swap(w->inbox);
+		target = w->migrate_to;
+		w->migrate_to = NULL;
+	}
+
+	for (auto &h : inbox)
+		adopt(w, h);
+	if (target)
+		migrate_hottest(w, target);
+}
+
+void roll_busy(uv_handle_t *handle, void *arg)
+{
+	if ((handle->type != UV_TCP && handle->type != UV_NAMED_PIPE) || handle->data == NULL)
+		return;
+	client_t *client = (client_t*)handle->data;
+	client->last_busy_ns = client->busy_ns;
+	client->busy_ns = 0;
+}
+
+/* 用 libuv 记录的 idle 时间算这个周期的利用率 */
+void on_worker_timer(uv_timer_t *timer)
+{
+	worker_t *w = (worker_t*)timer->data;
+	uint64_t now = uv_hrtime();
+	uint64_t idle = uv_metrics_idle_time(&w->loop);
+	if (now > w->last_hrtime)
+		w->util = max(0.0, 1.0 - (double)(idle - w->last_idle) / (now - w->last_hrtime));
+	w->last_hrtime = now;
+	w->last_idle = idle;
+	uv_walk(&w->loop, roll_busy, NULL);
+}
+
+/* 给 watchdog 用，libuv 保证可以在别的线程调用 */
+uint64_t loop_idle_ns(void *loop)
+{
+	return uv_metrics_idle_time((uv_loop_t*)loop);
+}
+
+/*
+ * I/O 回调在 uv_run 里紧跟着 epoll_wait，只能在 prepare 里结束上一轮开始下一轮，等事件的时间由 watchdog 减掉；
+ * 硬件计数器也在这里采，一轮包括 epoll_wait，跟 epoll server 一样
+ */
+void next_iteration(loop_heartbeat *heartbeat, loop_counters &counters, uint64_t now)
+{
+	watchdog_end(heartbeat, now);
+	watchdog_begin(heartbeat, now);
+	counters.tick(t_loop_events);
+	t_loop_events = 0;
+}
+
+void on_main_prepare(uv_prepare_t *prepare)
+{
+	next_iteration((loop_heartbeat*)prepare->data, g_main_counters, uv_hrtime());
+}
+
+/* 计数器只统计打开它的线程，要在 loop 线程里打开 */
+void open_counters(loop_counters &counters)
+{
+	if (g_counter_every && !counters.open(g_counter_every))
+		perror("perf_event_open ERROR, running without counters");
+}
+
+void on_worker_prepare(uv_prepare_t *prepare)
+{
+	worker_t *w = (worker_t*)prepare->data;
+	w->prepare_hrtime = uv_hrtime();
+	w->prepare_idle = uv_metrics_idle_time(&w->loop);
+	next_iteration(w->heartbeat, w->counters, w->prepare_hrtime);
+}
+
+/* prepare 到 check 之间去掉 epoll_wait 等待的时间，就是这一轮处理 I/O 回调的时间 */
+void on_worker_check(uv_check_t *check)
+{
+	worker_t *w = (worker_t*)check->data;
+	uint64_t elapsed = uv_hrtime() - w->prepare_hrtime;
+	uint64_t idle = uv_metrics_idle_time(&w->loop) - w->prepare_idle;
+	if (elapsed > idle)
+		w->iteration.record(elapsed - idle);
+}
+
+void worker_run(void *arg)
+{
+	worker_t *w = (worker_t*)arg;
+	w->heartbeat = watchdog_register("loop " + to_string(w->id), loop_idle_ns, &w->loop);
+	open_counters(w->counters);
+	uv_run(&w->loop, UV_RUN_DEFAULT);
+}
+
+void start_workers(int num)
+{
+	for (int i = 0; i < num; ++i)
+	{
+		worker_t *w = new worker_t;
+		w->id = i;
+		w->migrate_to = NULL;
+		w->stopping = false;
+		w->util = 0;
+		w->conns = 0;
+		w->migrated_in = 0;
+		w->migrated_out = 0;
+		w->heartbeat = NULL;
+
+		uv_loop_init(&w->loop);
+		uv_loop_configure(&w->loop, UV_METRICS_IDLE_TIME);
+		w->loop.data = w;
+		w->last_hrtime = uv_hrtime();
+		w->last_idle = 0;
+
+		uv_async_init(&w->loop, &w->async, on_worker_async);
+		w->async.data = w;
+
+		uv_timer_init(&w->loop, &w->timer);
+		w->timer.data = w;
+		uv_timer_start(&w->timer, on_worker_timer, g_migrate_interval, g_migrate_interval);
+		uv_unref((uv_handle_t*)&w->timer);
+
+		uv_prepare_init(&w->loop, &w->prepare);
+		w->prepare.data = w;
+		uv_prepare_start(&w->prepare, on_worker_prepare);
+		uv_check_init(&w->loop, &w->check);
+		w->check.data = w;
+		uv_check_start(&w->check, on_worker_check);
+
+		g_workers.push_back(w);
+	}
+
+	for (auto w : g_workers)
+		uv_thread_create(&w->thread, worker_run, w);
+}
+
+/* 在主 loop 上跑，每次最多让最忙的 loop 迁一个连接给最闲的 loop */
+void on_balance(uv_timer_t *timer)
+{
+	worker_t *hot = g_workers[0], *cold = g_workers[0];
+	for (auto w : g_workers)
+	{
+		if (w->util > hot->util)
+			hot = w;
+		if (w->util < cold->util)
+			cold = w;
+	}
+
+	if (hot->util < MIGRATE_MIN_UTIL || hot->util - cold->util < MIGRATE_MIN_GAP)
+		return;
+
+	{
+		lock_guard<mutex> lock(hot->lock);
+		hot->migrate_to = cold;
+	}
+	uv_async_send(&hot->async);
+}
+
+void on_reject_close(uv_handle_t *handle)
+{
+	delete (uv_any_handle*)handle;
+}
+
+/*
+ * 没有内存放连接记录时也要把连接 accept 出来关掉：libuv 已经 accept 好的 fd 等着 uv_accept 取走，
+ * 取走之前监听 socket 不会再读，后面的连接都会卡住；用一个单独的小 handle 接住再关
+ */
+void reject_connection(uv_stream_t *server)
+{
+	uv_any_handle *handle = new (nothrow) uv_any_handle;
+	if (handle == NULL)
+	{
+		cerr << "alloc client ERROR: out of memory" << endl;
+		exit(EXIT_FAILURE);
+	}
+	if (server->type == UV_NAMED_PIPE)
+		uv_pipe_init(server->loop, &handle->pipe, 0);
+	else
+		uv_tcp_init(server->loop, &handle->tcp);
+	uv_accept(server, &handle->stream);
+	uv_close(&handle->handle, on_reject_close);
 }
 
 void on_new_connection(uv_stream_t *server, int status)
 {
+	TRACE_SCOPE("on_new_connection");
 	FAIL_EXIT(status, "on_new_connection ERROR");
 
-	uv_tcp_t *client = new uv_tcp_t;
-	uv_tcp_init(uv_default_loop(), client);
+	client_t *client = new_client(server->loop, server->type == UV_NAMED_PIPE);
+	if (client == NULL)
+	{
+		cerr << "alloc client ERROR: out of memory, closing new connection" << endl;
+		reject_connection(server);
+		return;
+	}
 
-	if (uv_accept(server, (uv_stream_t*)client) == 0) 
+	if (uv_accept(server, (uv_stream_t*)&client->handle.base) == 0) 
 	{
-		cout << "client from " << get_sock_addr(client) << endl;
+		{
+			TRACE_SCOPE("log");
+			cout << "client from " << get_sock_addr(&client->handle.base) << endl;
+		}
 
-		uv_read_start((uv_stream_t*)client, alloc_buffer, echo_read);
+		client->conn_id = capture_new_conn();
+		capture_write(client->conn_id, CAPTURE_OPEN, NULL, 0);
+
+		// 多 loop 时按轮询分给各个 loop
+		if (!g_workers.empty())
+		{
+			handoff(client, g_workers[g_next_worker++ % g_workers.size()], false);
+			return;
+		}
+
+		start_reading(client);
 	}
 	else
 	{
-		uv_close((uv_handle_t*)client, on_close);
+		uv_close(&client->handle.base, on_close);
+	}
+}
+
+void on_date_timer(uv_timer_t *timer)
+{
+	http_update_date();
+}
+
+/*
+ * 只让各个 loop 停下来，记录文件等 main 里所有 loop 线程都退出之后再关，
+ * 不然别的 loop 还在 capture_write，映射一拿掉就是 SIGSEGV
+ */
+void on_signal(uv_signal_t *handle, int signum)
+{
+	for (auto w : g_workers)
+	{
+		w->stopping = true;
+		uv_async_send(&w->async);
+	}
+	uv_stop(handle->loop);
+}
+
+void join_workers()
+{
+	for (auto w : g_workers)
+		uv_thread_join(&w->thread);
+}
+
+void on_print_stats(uv_signal_t *handle, int signum)
+{
+	arena_print_stats();
+	if (g_root_fd != -1)
+		file_cache_print_stats();
+	watchdog_print_stats();
+	g_main_counters.print("main loop");
+
+	for (auto w : g_workers)
+	{
+		cout << "loop " << w->id << ": utilization " << w->util * 100 << "%"
+			<< " conns " << w->conns
+			<< " migrated in " << w->migrated_in
+			<< " out " << w->migrated_out << endl;
+		string name = "loop " + to_string(w->id);
+		w->counters.print(name.c_str());
+		name += " iteration";
+		w->iteration.print(name.c_str());
 	}
 }
 
-int main()
+void on_trace(uv_signal_t *handle, int signum)
+{
+	trace_toggle();
+}
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-c capture_file] [-d] [-H] [-h] [-w high_watermark] [-l low_watermark] [-n loops] [-m interval]"
+		<< " [-x transform] [-r rounds] [-o offload_cost] [-T trace_file] [-W stall_ms] [-P every] [-I]"
+		<< " [-f root [-R] [-F entries] [-S small_size]]" << endl;
+	cerr << "  -c  record traffic to capture_file" << endl;
+	cerr << "  -d  record payload as well, not only length" << endl;
+	cerr << "  -H  do not use hugepages for buffers" << endl;
+	cerr << "  -h  answer every HTTP/1.1 request with a static response instead of echo" << endl;
+	cerr << "  -w  stop reading a client when its write queue exceeds this many bytes" << endl;
+	cerr << "  -l  resume reading when the write queue drains below this many bytes" << endl;
+	cerr << "  -n  run this many loop threads, connections are assigned round robin" << endl;
+	cerr << "  -m  with -n, check loop load every interval ms and migrate hot connections, 0 disables" << endl;
+	cerr << "  -x  run a transform over every message before echoing it: " << transform_names() << endl;
+	cerr << "  -r  with -x, run the transform this many times per message, default 1" << endl;
+	cerr << "  -o  with -x, messages whose length * rounds reaches this go to the thread pool,"
+		<< " default " << OFFLOAD_COST << ", 0 offloads all; pool size is UV_THREADPOOL_SIZE" << endl;
+	cerr << "  -T  kill -USR2 turns tracing on, the next USR2 writes chrome trace json to trace_file" << endl;
+	cerr << "  -W  print the phase and stack of any loop iteration that runs longer than stall_ms" << endl;
+	cerr << "  -P  read cycles, instructions, cache and branch misses around every n-th loop iteration,"
+		<< " kill -USR1 prints them per read callback" << endl;
+	cerr << "  -I  for many idle connections: read into one buffer per loop, only keep what could not be written at once" << endl;
+	cerr << "  -f  serve files under root over HTTP/1.1, large files with sendfile" << endl;
+	cerr << "  -R  with -f, send large files with read and write instead of sendfile, for comparison" << endl;
+	cerr << "  -F  with -f, cache open fds and stat results of this many files per loop, default " << FILE_CACHE_ENTRIES << endl;
+	cerr << "  -S  with -f, keep files up to this many bytes in memory, default " << FILE_CACHE_SMALL << ", 0 disables" << endl;
+	cerr << "      sendfile and read run in the thread pool, raise UV_THREADPOOL_SIZE for many concurrent large files" << endl;
+	server_usage();
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
 {
 	uv_loop_t *loop = uv_default_loop();
 
-	uv_tcp_t server;
-    uv_tcp_init(loop, &server);
+	const char *capture_path = NULL;
+	bool with_payload = false;
+	bool hugepage = true;
+	int loops = 0;
+	const char *trace_path = NULL;
+	const char *root = NULL;
+	uint64_t stall_ms = 0;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c:dHhw:l:n:m:x:r:o:T:W:P:If:RF:S:", server_long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'c': capture_path = optarg; break;
+		case 'd': with_payload = true; break;
+		case 'H': hugepage = false; break;
+		case 'h': g_http = true; break;
+		case 'w': g_high_watermark = strtoul(optarg, NULL, 10); break;
+		case 'l': g_low_watermark = strtoul(optarg, NULL, 10); break;
+		case 'n': loops = atoi(optarg); break;
+		case 'm': g_migrate_interval = strtoul(optarg, NULL, 10); break;
+		case 'x':
+			g_transform = transform_find(optarg);
+			if (g_transform == NULL)
+				usage(argv[0]);
+			break;
+		case 'r': g_rounds = atoi(optarg); break;
+		case 'o': g_offload_cost = strtoull(optarg, NULL, 10); break;
+		case 'T': trace_path = optarg; break;
+		case 'W': stall_ms = strtoull(optarg, NULL, 10); break;
+		case 'P': g_counter_every = strtoull(optarg, NULL, 10); break;
+		case 'I': g_shared_buffer = true; break;
+		case 'f': root = optarg; break;
+		case 'R': g_copy_files = true; break;
+		case 'F': g_file_entries = strtoul(optarg, NULL, 10); break;
+		case 'S': g_small_file = strtoul(optarg, NULL, 10); break;
+		default:
+			if (!server_parse_option(opt, optarg))
+				usage(argv[0]);
+		}
+	}
+	if (g_low_watermark > g_high_watermark || g_rounds < 1)
+		usage(argv[0]);
+	if (g_transform && (g_http || root))
+	{
+		cerr << "-x does not apply to -h or -f" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// 静态文件也走 http，Date 头由同一个定时器刷新
+	if (root)
+	{
+		g_root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (g_root_fd == -1)
+		{
+			perror("open root ERROR");
+			exit(EXIT_FAILURE);
+		}
+		g_http = true;
+		cout << "serving files under " << root << " with " << (g_copy_files ? "read+write" : "sendfile")
+			<< ", " << g_file_entries << " cached files per loop, in memory up to " << g_small_file << " bytes" << endl;
+	}
+
+	arena_init(ARENA_DEFAULT_SIZE, hugepage);
+
+	// uv_write 用的是 write，client 先关了连接时不忽略会被 SIGPIPE 杀掉，错误从写回调里报
+	signal(SIGPIPE, SIG_IGN);
+
+	// kill -USR1 打印 buffer 统计
+	uv_signal_t sigusr1;
+	uv_signal_init(loop, &sigusr1);
+	uv_signal_start(&sigusr1, on_print_stats, SIGUSR1);
+	uv_unref((uv_handle_t*)&sigusr1);
+
+	// 各个 loop 线程和线程池都记到自己的缓冲里，主 loop 负责开关和导出
+	uv_signal_t sigusr2;
+	if (trace_path)
+	{
+		trace_init(trace_path);
+		uv_signal_init(loop, &sigusr2);
+		uv_signal_start(&sigusr2, on_trace, SIGUSR2);
+		uv_unref((uv_handle_t*)&sigusr2);
+	}
+
+	// 主 loop 负责 accept，多 loop 时各个 loop 在自己的线程里注册和打开计数器
+	uv_prepare_t main_prepare;
+	watchdog_start(stall_ms);
+	loop_heartbeat *heartbeat = watchdog_register("main loop", loop_idle_ns, loop);
+	open_counters(g_main_counters);
+	if (heartbeat || g_main_counters.valid())
+	{
+		if (heartbeat)
+			uv_loop_configure(loop, UV_METRICS_IDLE_TIME);
+		uv_prepare_init(loop, &main_prepare);
+		main_prepare.data = heartbeat;
+		uv_prepare_start(&main_prepare, on_main_prepare);
+		uv_unref((uv_handle_t*)&main_prepare);
+	}
+
+	// 所有 loop 共用一份响应，主 loop 每秒刷新一次 Date
+	uv_timer_t date_timer;
+	if (g_http)
+	{
+		http_init();
+		uv_timer_init(loop, &date_timer);
+		uv_timer_start(&date_timer, on_date_timer, 1000, 1000);
+		uv_unref((uv_handle_t*)&date_timer);
+	}
 
-	struct sockaddr_storage server_addr;
+	uv_signal_t sigint, sigterm;
+	if (capture_path)
+	{
+		if (!capture_open(capture_path, with_payload))
+			exit(EXIT_FAILURE);
 
-	int ret = uv_ip4_addr("0.0.0.0", PORT, (struct sockaddr_in*)&server_addr);
-	FAIL_EXIT(ret, "uv_ip4_addr ERROR");
+		// 退出前要把记录文件截到实际大小
+		uv_signal_init(loop, &sigint);
+		uv_signal_start(&sigint, on_signal, SIGINT);
+		uv_signal_init(loop, &sigterm);
+		uv_signal_start(&sigterm, on_signal, SIGTERM);
+	}
 
-	ret = uv_tcp_bind(&server, (const struct sockaddr*)&server_addr, 0);
-	FAIL_EXIT(ret, "uv_tcp_bind ERROR");
+	// 监听 socket 用公共的 make_listeners 创建，socket 参数跟其他 server 一致，
+	// unix socket 用 uv_pipe_t 打开，连上来的 client 也是 uv_pipe_t
+	vector<int> listeners = make_listeners();
+	for (int server_sock : listeners)
+	{
+		sockaddr_storage addr;
+		socklen_t size = sizeof(addr);
+		getsockname(server_sock, (sockaddr*)&addr, &size);
 
-	ret = uv_listen((uv_stream_t*)&server, BACKLOG, on_new_connection);
-	FAIL_EXIT(ret, "uv_tcp_listen ERROR");
+		int ret;
+		uv_stream_t *server;
+		if (addr.ss_family == AF_UNIX)
+		{
+			uv_pipe_t *pipe = new uv_pipe_t;
+			uv_pipe_init(loop, pipe, 0);
+			ret = uv_pipe_open(pipe, server_sock);
+			server = (uv_stream_t*)pipe;
+		}
+		else
+		{
+			uv_tcp_t *tcp = new uv_tcp_t;
+			uv_tcp_init(loop, tcp);
+			ret = uv_tcp_open(tcp, server_sock);
+			server = (uv_stream_t*)tcp;
+		}
+		FAIL_EXIT(ret, "open listener ERROR");
+		server->data = NULL;
+
+		ret = uv_listen(server, g_config.backlog, on_new_connection);
+		FAIL_EXIT(ret, "uv_listen ERROR");
+	}
+
+	// 利用率一直要算，-m 0 时只是不迁移，方便对比
+	uv_timer_t balancer;
+	if (loops > 0)
+	{
+		bool balance = g_migrate_interval > 0;
+		if (!balance)
+			g_migrate_interval = MIGRATE_INTERVAL;
+		start_workers(loops);
+
+		if (balance)
+		{
+			uv_timer_init(loop, &balancer);
+			uv_timer_start(&balancer, on_balance, g_migrate_interval, g_migrate_interval);
+			uv_unref((uv_handle_t*)&balancer);
+		}
+		cout << loops << " loops, migration " << (balance ? "on" : "off") << endl;
+	}
 
 	cout << "wairting for clients..." << endl;
-	return uv_run(loop, UV_RUN_DEFAULT);
+	uv_run(loop, UV_RUN_DEFAULT);
+
+	// 只有记录流量时收到信号才会走到这里
+	join_workers();
+	capture_close();
+	return EXIT_SUCCESS;
 }
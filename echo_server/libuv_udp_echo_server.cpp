@@ -0,0 +1,336 @@
+/*
+ * libuv_udp_echo_server.cpp
+ * 一个基于 libuv 的 udp echo server，收到的数据报原样发回给发送方
+ *
+ * 每个线程一个 loop 和一个 SO_REUSEPORT 的 socket，内核按四元组把 client 分到各个 socket 上，线程之间没有共享的东西；
+ * 读用 UV_UDP_RECVMMSG，一次系统调用收一批，收数据的是每个线程预先分配好的一大块内存，libuv 按数据报的最大长度切成槽；
+ * 回包不拷贝，直接指向收到的槽，一批处理完再一次发出去
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstring>
+#include <uv.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "server_core.h"
+
+using namespace std;
+
+#define UDP_SLOTS 20				// 一次 recvmmsg 最多收多少个数据报，libuv 最多也只用 20 个
+#define UDP_SLOT_SIZE (64 << 10)	// libuv 按 64K 一个数据报切 buffer，小于两个槽就不用 recvmmsg
+#define REPORT_INTERVAL 1			// 每隔多少秒报告一次
+
+/* 等着发回去的数据报，buf 指向收数据的槽 */
+struct reply_t
+{
+	uv_buf_t buf;
+	sockaddr_storage addr;
+};
+
+struct udp_worker_t
+{
+	int id;
+	int sock;
+	uv_loop_t loop;
+	uv_udp_t udp;
+	uv_check_t check;
+	uv_thread_t thread;
+
+	char *pool;						// UDP_SLOTS 个槽，每次都整块交给 libuv
+	reply_t replies[UDP_SLOTS];
+	int nreplies;
+
+	atomic<uint64_t> packets;		// 只有本线程写
+	atomic<uint64_t> bytes;
+	atomic<uint64_t> batches;		// 一共发了几批
+	atomic<uint64_t> dropped;		// 发送缓冲满了没发出去的
+	uint64_t last_packets;			// 下面几个只有主线程用
+	uint64_t last_batches;
+	uint64_t last_idle;
+};
+
+vector<udp_worker_t*> g_workers;
+uint64_t g_start_ns = 0;
+uint64_t g_last_report_ns = 0;
+
+// error handling
+#define FAIL_EXIT(ret, msg)										\
+do																\
+{																\
+	if ((ret) < 0)												\
+	{															\
+		cerr << (msg) << ": " << uv_strerror(ret) << endl;		\
+		exit(EXIT_FAILURE);										\
+	}															\
+}																\
+while(0)
+
+inline void add_relaxed(atomic<uint64_t> &counter, uint64_t n)
+{
+	counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/* 槽里的数据发出去之后这块内存才能交给下一次 recvmmsg */
+void flush_replies(udp_worker_t *w)
+{
+	int n = w->nreplies;
+	if (n == 0)
+		return;
+	w->nreplies = 0;
+
+	int sent = 0;
+#if UV_VERSION_HEX >= 0x013200
+	// 1.50 以后有 uv_udp_try_send2，一次 sendmmsg 发完一批
+	uv_buf_t *bufs[UDP_SLOTS];
+	unsigned int nbufs[UDP_SLOTS];
+	sockaddr *addrs[UDP_SLOTS];
+	for (int i = 0; i < n; ++i)
+	{
+		bufs[i] = &w->replies[i].buf;
+		nbufs[i] = 1;
+		addrs[i] = (sockaddr*)&w->replies[i].addr;
+	}
+	int ret = uv_udp_try_send2(&w->udp, n, bufs, nbufs, addrs, 0);
+	if (ret > 0)
+		sent = ret;
+	else if (ret < 0 && ret != UV_EAGAIN)
+		cerr << "send ERROR: " << uv_strerror(ret) << endl;
+#else
+	for (; sent < n; ++sent)
+	{
+		int ret = uv_udp_try_send(&w->udp, &w->replies[sent].buf, 1, (sockaddr*)&w->replies[sent].addr);
+		if (ret < 0)
+		{
+			if (ret != UV_EAGAIN)
+				cerr << "send ERROR: " << uv_strerror(ret) << endl;
+			break;
+		}
+	}
+#endif
+
+	// udp 发不出去就丢掉，跟网络上丢包一样，client 自己重发
+	if (sent < n)
+		add_relaxed(w->dropped, n - sent);
+	add_relaxed(w->batches, 1);
+}
+
+/* libuv 每次读之前都会要 buffer，上一批还没发的先发掉，槽才能重用 */
+void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+	udp_worker_t *w = (udp_worker_t*)handle->data;
+	flush_replies(w);
+	*buf = uv_buf_init(w->pool, UDP_SLOTS * UDP_SLOT_SIZE);
+}
+
+void on_recv(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const sockaddr *addr, unsigned flags)
+{
+	udp_worker_t *w = (udp_worker_t*)handle->data;
+	if (nread < 0)
+	{
+		cerr << "recv ERROR: " << uv_strerror(nread) << endl;
+		return;
+	}
+
+	// 一批收完时 libuv 会用 UV_UDP_MMSG_FREE 再调一次，addr 是 NULL；没读到数据时 addr 也是 NULL
+	if (addr == NULL)
+	{
+		flush_replies(w);
+		return;
+	}
+
+	reply_t &r = w->replies[w->nreplies++];
+	r.buf = uv_buf_init(buf->base, nread);
+	memcpy(&r.addr, addr, addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in));
+	add_relaxed(w->packets, 1);
+	add_relaxed(w->bytes, nread);
+
+	// 不是 recvmmsg 收到的，buffer 马上就要拿去读下一个
+	if (!(flags & UV_UDP_MMSG_CHUNK) || w->nreplies == UDP_SLOTS)
+		flush_replies(w);
+}
+
+/* 老版本的 libuv 一批收完不会回调，每轮循环结束时把剩下的发掉 */
+void on_check(uv_check_t *check)
+{
+	flush_replies((udp_worker_t*)check->data);
+}
+
+void worker_run(void *arg)
+{
+	udp_worker_t *w = (udp_worker_t*)arg;
+	uv_run(&w->loop, UV_RUN_DEFAULT);
+}
+
+void start_workers(int num)
+{
+	for (int i = 0; i < num; ++i)
+	{
+		udp_worker_t *w = new udp_worker_t;
+		w->id = i;
+		w->sock = make_udp_socket();
+		w->nreplies = 0;
+		w->packets = 0;
+		w->bytes = 0;
+		w->batches = 0;
+		w->dropped = 0;
+		w->last_packets = 0;
+		w->last_batches = 0;
+		w->last_idle = 0;
+
+		// 整块用 mmap，尽量用透明大页，槽之间连续
+		size_t pool_size = UDP_SLOTS * UDP_SLOT_SIZE;
+		void *p = mmap(NULL, pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			perror("mmap ERROR");
+			exit(EXIT_FAILURE);
+		}
+		madvise(p, pool_size, MADV_HUGEPAGE);
+		w->pool = (char*)p;
+
+		uv_loop_init(&w->loop);
+		uv_loop_configure(&w->loop, UV_METRICS_IDLE_TIME);
+
+		int ret = uv_udp_init_ex(&w->loop, &w->udp, AF_UNSPEC | UV_UDP_RECVMMSG);
+		FAIL_EXIT(ret, "uv_udp_init_ex ERROR");
+		ret = uv_udp_open(&w->udp, w->sock);
+		FAIL_EXIT(ret, "uv_udp_open ERROR");
+		w->udp.data = w;
+		ret = uv_udp_recv_start(&w->udp, alloc_buffer, on_recv);
+		FAIL_EXIT(ret, "uv_udp_recv_start ERROR");
+
+		uv_check_init(&w->loop, &w->check);
+		w->check.data = w;
+		uv_check_start(&w->check, on_check);
+
+		g_workers.push_back(w);
+	}
+
+	for (auto w : g_workers)
+		uv_thread_create(&w->thread, worker_run, w);
+}
+
+/*
+ * 每个线程的包数，利用率是 loop 不在 epoll_wait 里等的时间比例，
+ * 包数除以利用率就是这个线程占满一个核时每秒能处理多少包
+ */
+void on_report(uv_timer_t *timer)
+{
+	uint64_t now = uv_hrtime();
+	double elapsed = (now - g_last_report_ns) / 1e9;
+	g_last_report_ns = now;
+
+	uint64_t total = 0;
+	double busy = 0;
+	for (auto w : g_workers)
+		total += w->packets.load(memory_order_relaxed) - w->last_packets;
+	if (total == 0)
+	{
+		for (auto w : g_workers)
+			w->last_idle = uv_metrics_idle_time(&w->loop);
+		return;
+	}
+
+	cout << fixed << setprecision(0);
+	for (auto w : g_workers)
+	{
+		uint64_t packets = w->packets.load(memory_order_relaxed);
+		uint64_t batches = w->batches.load(memory_order_relaxed);
+		uint64_t idle = uv_metrics_idle_time(&w->loop);
+		double util = 1 - (idle - w->last_idle) / 1e9 / elapsed;
+		if (util < 0)
+			util = 0;
+		double pps = (packets - w->last_packets) / elapsed;
+		busy += util;
+
+		cout << "thread " << w->id << ": " << pps << " pps"
+			<< ", utilization " << util * 100 << "%"
+			<< ", " << (util > 0 ? pps / util : 0) << " pps per core"
+			<< ", " << setprecision(1) << (batches > w->last_batches ?
+				(double)(packets - w->last_packets) / (batches - w->last_batches) : 0) << " per batch"
+			<< setprecision(0) << ", dropped " << w->dropped.load(memory_order_relaxed) << endl;
+
+		w->last_packets = packets;
+		w->last_batches = batches;
+		w->last_idle = idle;
+	}
+	cout << "total: " << total / elapsed << " pps, " << (busy > 0 ? total / elapsed / busy : 0) << " pps per busy core" << endl;
+	cout << setprecision(6);
+	cout.unsetf(ios::floatfield);
+}
+
+void on_signal(uv_signal_t *handle, int signum)
+{
+	uint64_t packets = 0, bytes = 0, dropped = 0;
+	for (auto w : g_workers)
+	{
+		packets += w->packets.load(memory_order_relaxed);
+		bytes += w->bytes.load(memory_order_relaxed);
+		dropped += w->dropped.load(memory_order_relaxed);
+	}
+	cout << "echoed " << packets << " packets, " << bytes << " bytes in " << (uv_hrtime() - g_start_ns) / 1e9
+		<< "s, dropped " << dropped << endl;
+	exit(EXIT_SUCCESS);
+}
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-n threads]" << endl;
+	cerr << "  -n  threads, each with its own loop and SO_REUSEPORT socket, default 1" << endl;
+	cerr << "  packet rates are reported every " << REPORT_INTERVAL << "s while there is traffic" << endl;
+	server_usage();
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	uv_loop_t *loop = uv_default_loop();
+	int threads = 1;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "n:", server_long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': threads = atoi(optarg); break;
+		default:
+			if (!server_parse_option(opt, optarg))
+				usage(argv[0]);
+		}
+	}
+	if (threads < 1)
+		usage(argv[0]);
+
+	// 每个线程绑同一个端口，不开 SO_REUSEPORT 第二个 bind 会失败
+	if (threads > 1)
+		g_config.reuseport = true;
+
+	start_workers(threads);
+
+	udp_worker_t *w = g_workers[0];
+	int rcvbuf = 0;
+	socklen_t size = sizeof(rcvbuf);
+	getsockopt(w->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &size);
+	cout << "udp on port " << g_config.port << ", " << threads << " threads"
+		<< ", recvmmsg " << (uv_udp_using_recvmmsg(&w->udp) ? "on" : "off")
+		<< ", rcvbuf " << rcvbuf << endl;
+
+	g_start_ns = g_last_report_ns = uv_hrtime();
+	uv_timer_t report;
+	uv_timer_init(loop, &report);
+	uv_timer_start(&report, on_report, REPORT_INTERVAL * 1000, REPORT_INTERVAL * 1000);
+
+	uv_signal_t sigint, sigterm;
+	uv_signal_init(loop, &sigint);
+	uv_signal_start(&sigint, on_signal, SIGINT);
+	uv_signal_init(loop, &sigterm);
+	uv_signal_start(&sigterm, on_signal, SIGTERM);
+
+	cout << "wairting for clients..." << endl;
+	return uv_run(loop, UV_RUN_DEFAULT);
+}
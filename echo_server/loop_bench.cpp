@@ -0,0 +1,653 @@
+/*
+ * loop_bench.cpp
+ * 不走 tcp，用 socketpair 在进程内跑各个 backend 的 echo 循环，client 是另一个线程，
+ * 只比较 select/epoll/libev/libuv 分发事件本身的开销：
+ *   ns/event     server 线程每处理一次可读事件花的 cpu 时间
+ *   wakeups/msg  每条消息 loop 被唤醒几次，越小说明一次唤醒处理的事件越多
+ *   allocs/msg   server 线程每条消息 malloc 几次，包括 calloc/realloc 和 fixed_pool 用的
+ *                aligned_alloc/posix_memalign；arena 的大块直接 mmap，不算在里面
+ *
+ * 有硬件计数器时再加上 server 线程每条消息的 cycles、指令、cache miss、branch miss 和 IPC，
+ * 从 loop 开始到结束整段统计，包括等事件的系统调用，比较各个 backend 的数据结构和批量处理
+ *
+ * 各个 loop 跟对应 server 的 echo 逻辑一样，只是监听 socket 换成了现成的 socketpair；
+ * 这些 loop 是照着 server 另写的一份，没有链接 server 里真正的回调，server 改了处理逻辑
+ * （比如 buffer 的分配方式、读写的批量）这里要跟着改，不然测的就不是 server 实际的开销
+ *
+ * -T 把 socketpair 换成回环地址上的 tcp 连接，两次结果的差就是 unix socket 省下来的协议栈开销
+ *
+ * -i 再挂上一批从不发数据的空闲连接，看每个 backend 的开销怎么随连接总数增长：
+ * select/poll 每次唤醒都要把所有 fd 交给内核扫一遍，epoll 只跟就绪的 fd 数有关
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <thread>
+#include <ctime>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <ev.h>
+#include <uv.h>
+#include "arena.h"
+#include "server_core.h"
+#include "perf_counter.h"
+
+using namespace std;
+
+#define BENCH_CONNS 64
+#define BENCH_MESSAGES 10000	// 每个连接发多少条
+#define BENCH_MSG_LEN 64
+
+extern "C"
+{
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+// 只统计 server 线程的分配，client 线程不算
+static __thread bool t_count_allocs = false;
+static uint64_t g_allocs = 0;
+
+extern "C" void *malloc(size_t size)
+{
+	if (t_count_allocs)
+		++g_allocs;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+	if (t_count_allocs)
+		++g_allocs;
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+	if (t_count_allocs)
+		++g_allocs;
+	return __libc_realloc(p, size);
+}
+
+extern "C" int posix_memalign(void **p, size_t alignment, size_t size)
+{
+	if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	if (t_count_allocs)
+		++g_allocs;
+	void *mem = __libc_memalign(alignment, size);
+	if (mem == NULL)
+		return ENOMEM;
+	*p = mem;
+	return 0;
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+	if (t_count_allocs)
+		++g_allocs;
+	return __libc_memalign(alignment, size);
+}
+
+struct bench_ctx
+{
+	vector<int> fds;		// server 这一端，前面是活跃连接，后面 idle 个是空闲连接
+	int idle;
+	uint64_t events;		// 读到数据的次数
+	uint64_t wakeups;		// loop 从等待里返回的次数
+	int open;				// 还没关闭的连接数
+};
+
+struct bench_result
+{
+	const char *name;
+	uint64_t messages;
+	uint64_t events;
+	uint64_t wakeups;
+	uint64_t allocs;
+	uint64_t cpu_ns;
+	uint64_t wall_ns;
+	bool counted;			// 硬件计数器打开了
+	perf_sample counters;
+};
+
+static bool g_with_counters = false;	// 启动时试过能打开硬件计数器
+
+static uint64_t now_ns(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 每一轮先给所有连接各发一条，再把回包都收回来，最后关掉 */
+void client_run(vector<int> fds, int messages, size_t msg_len)
+{
+	vector<char> out(msg_len, 'x');
+	vector<char> in(msg_len);
+	for (int i = 0; i < messages; ++i)
+	{
+		for (int fd : fds)
+		{
+			if (send(fd, out.data(), msg_len, 0) != (ssize_t)msg_len)
+			{
+				perror("client send ERROR");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (int fd : fds)
+		{
+			size_t got = 0;
+			while (got < msg_len)
+			{
+				ssize_t ret = recv(fd, in.data() + got, msg_len - got, 0);
+				if (ret <= 0)
+				{
+					perror("client recv ERROR");
+					exit(EXIT_FAILURE);
+				}
+				got += ret;
+			}
+		}
+	}
+	for (int fd : fds)
+		close(fd);
+}
+
+/* 跟 server 一样直接 send，socket 的缓冲区远大于消息，不会只发一部分 */
+bool echo_fd(bench_ctx &ctx, int fd, char *buf)
+{
+	ssize_t ret = recv(fd, buf, g_config.buffer_size, 0);
+	if (ret <= 0)
+	{
+		close(fd);
+		--ctx.open;
+		return false;
+	}
+	++ctx.events;
+	send(fd, buf, ret, 0);
+	return true;
+}
+
+/* 活跃连接都关掉之后，空闲连接由各个 backend 自己关 */
+void close_idle(bench_ctx &ctx)
+{
+	for (size_t i = ctx.fds.size() - ctx.idle; i < ctx.fds.size(); ++i)
+		close(ctx.fds[i]);
+}
+
+void run_select(bench_ctx &ctx)
+{
+	fd_set all_sock;
+	FD_ZERO(&all_sock);
+	int fd_max = 0;
+	for (int fd : ctx.fds)
+	{
+		FD_SET(fd, &all_sock);
+		fd_max = max(fd_max, fd);
+	}
+
+	vector<char> buf(g_config.buffer_size);
+	while (ctx.open > 0)
+	{
+		fd_set read_sock = all_sock;
+		if (select(fd_max + 1, &read_sock, NULL, NULL, NULL) == -1)
+		{
+			perror("select ERROR");
+			exit(EXIT_FAILURE);
+		}
+		++ctx.wakeups;
+
+		for (int fd : ctx.fds)
+		{
+			if (FD_ISSET(fd, &all_sock) && FD_ISSET(fd, &read_sock) && !echo_fd(ctx, fd, buf.data()))
+				FD_CLR(fd, &all_sock);
+		}
+	}
+	close_idle(ctx);
+}
+
+/* 跟 poll_echo_server 一样，关掉的连接用最后一个元素填上 */
+void run_poll(bench_ctx &ctx)
+{
+	vector<pollfd> fds;
+	for (int fd : ctx.fds)
+		fds.push_back({fd, POLLIN, 0});
+
+	vector<char> buf(g_config.buffer_size);
+	while (ctx.open > 0)
+	{
+		int ret = poll(fds.data(), fds.size(), -1);
+		if (ret == -1)
+		{
+			perror("poll ERROR");
+			exit(EXIT_FAILURE);
+		}
+		++ctx.wakeups;
+
+		for (size_t i = 0; i < fds.size() && ret > 0;)
+		{
+			if (fds[i].revents == 0)
+			{
+				++i;
+				continue;
+			}
+			--ret;
+			if (echo_fd(ctx, fds[i].fd, buf.data()))
+			{
+				++i;
+				continue;
+			}
+			fds[i] = fds.back();
+			fds.pop_back();
+		}
+	}
+	close_idle(ctx);
+}
+
+void run_epoll(bench_ctx &ctx)
+{
+	int epollfd = epoll_create1(0);
+	for (int fd : ctx.fds)
+	{
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	vector<epoll_event> events(ctx.fds.size());
+	char *buf = (char*)arena_alloc(g_config.buffer_size);
+	while (ctx.open > 0)
+	{
+		int nfds = epoll_wait(epollfd, events.data(), events.size(), -1);
+		if (nfds == -1)
+		{
+			perror("epoll_wait ERROR");
+			exit(EXIT_FAILURE);
+		}
+		++ctx.wakeups;
+
+		// close 会把 fd 从 epoll 里去掉
+		for (int n = 0; n < nfds; ++n)
+			echo_fd(ctx, events[n].data.fd, buf);
+	}
+	arena_free(buf);
+	close(epollfd);
+	close_idle(ctx);
+}
+
+void ev_echo_read(EV_P_ struct ev_io *w, int revents)
+{
+	bench_ctx &ctx = *(bench_ctx*)w->data;
+	char *buf = (char*)arena_alloc(g_config.buffer_size);
+	int fd = w->fd;
+	if (!echo_fd(ctx, fd, buf))
+	{
+		ev_io_stop(EV_A_ w);
+		delete w;
+		// 还有空闲连接的 watcher，loop 不会自己退出
+		if (ctx.open == 0)
+			ev_break(EV_A_ EVBREAK_ALL);
+	}
+	arena_free(buf);
+}
+
+void run_libev(bench_ctx &ctx)
+{
+	struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+	vector<ev_io*> idle_watchers;
+	for (size_t i = 0; i < ctx.fds.size(); ++i)
+	{
+		ev_io *w = new ev_io;
+		ev_io_init(w, ev_echo_read, ctx.fds[i], EV_READ);
+		w->data = &ctx;
+		ev_io_start(loop, w);
+		if (i >= ctx.fds.size() - ctx.idle)
+			idle_watchers.push_back(w);
+	}
+
+	ev_run(loop, 0);
+	// 每次迭代都等一次 backend
+	ctx.wakeups = ev_iteration(loop);
+	// 空闲连接的 watcher 还挂在 loop 上，直接跟 loop 一起扔掉
+	ev_loop_destroy(loop);
+	for (auto w : idle_watchers)
+		delete w;
+	close_idle(ctx);
+}
+
+void uv_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+	buf->base = (char*)arena_alloc(g_config.buffer_size);
+	buf->len = g_config.buffer_size;
+}
+
+void uv_on_close(uv_handle_t *handle)
+{
+	delete (uv_pipe_t*)handle;
+}
+
+void uv_echo_write(uv_write_t *req, int status)
+{
+	arena_free(req->data);
+	delete req;
+}
+
+void uv_echo_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+	bench_ctx &ctx = *(bench_ctx*)stream->data;
+	if (nread < 0)
+	{
+		// 还有空闲连接的 handle，loop 不会自己退出
+		if (--ctx.open == 0)
+			uv_stop(stream->loop);
+		uv_close((uv_handle_t*)stream, uv_on_close);
+	}
+	else if (nread > 0)
+	{
+		++ctx.events;
+		uv_write_t *req = new uv_write_t;
+		req->data = buf->base;
+		uv_buf_t wrbuf = uv_buf_init(buf->base, nread);
+		uv_write(req, stream, &wrbuf, 1, uv_echo_write);
+		return;
+	}
+	arena_free(buf->base);
+}
+
+void uv_count_wakeup(uv_prepare_t *prepare)
+{
+	++((bench_ctx*)prepare->data)->wakeups;
+}
+
+void uv_close_idle(uv_handle_t *handle, void *arg)
+{
+	if (handle->type == UV_NAMED_PIPE && !uv_is_closing(handle))
+		uv_close(handle, uv_on_close);
+}
+
+void run_libuv(bench_ctx &ctx)
+{
+	uv_loop_t loop;
+	uv_loop_init(&loop);
+
+	// prepare 在每次进入 poll 之前调用
+	uv_prepare_t prepare;
+	uv_prepare_init(&loop, &prepare);
+	prepare.data = &ctx;
+	uv_prepare_start(&prepare, uv_count_wakeup);
+	uv_unref((uv_handle_t*)&prepare);
+
+	for (int fd : ctx.fds)
+	{
+		uv_pipe_t *pipe = new uv_pipe_t;
+		uv_pipe_init(&loop, pipe, 0);
+		uv_pipe_open(pipe, fd);
+		pipe->data = &ctx;
+		uv_read_start((uv_stream_t*)pipe, uv_alloc_buffer, uv_echo_read);
+	}
+
+	uv_run(&loop, UV_RUN_DEFAULT);
+	// 关掉 handle 会一起关掉空闲连接的 fd
+	uv_walk(&loop, uv_close_idle, NULL);
+	uv_close((uv_handle_t*)&prepare, NULL);
+	uv_run(&loop, UV_RUN_DEFAULT);
+	uv_loop_close(&loop);
+}
+
+/* 在 127.0.0.1 上连一条 tcp 连接，两端都关掉 nagle，跟 socketpair 一样一条消息一个包 */
+void tcp_pair(int sv[2])
+{
+	static int listener = -1;
+	static sockaddr_in addr;
+	if (listener == -1)
+	{
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t size = sizeof(addr);
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		if (listener == -1 || bind(listener, (sockaddr*)&addr, sizeof(addr)) == -1
+			|| listen(listener, SOMAXCONN) == -1 || getsockname(listener, (sockaddr*)&addr, &size) == -1)
+		{
+			perror("tcp listener ERROR");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sv[1] = socket(AF_INET, SOCK_STREAM, 0);
+	if (sv[1] == -1 || connect(sv[1], (sockaddr*)&addr, sizeof(addr)) == -1)
+	{
+		perror("connect ERROR");
+		exit(EXIT_FAILURE);
+	}
+	sv[0] = accept(listener, NULL, NULL);
+	if (sv[0] == -1)
+	{
+		perror("accept ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	int on = 1;
+	setsockopt(sv[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	setsockopt(sv[1], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+bench_result run_backend(const char *name, void (*loop)(bench_ctx&), int conns, int idle, int messages, size_t msg_len, bool tcp)
+{
+	bench_ctx ctx;
+	ctx.idle = idle;
+	ctx.events = 0;
+	ctx.wakeups = 0;
+	ctx.open = conns;
+
+	vector<int> client_fds, idle_fds;
+	for (int i = 0; i < conns + idle; ++i)
+	{
+		int sv[2];
+		if (tcp)
+			tcp_pair(sv);
+		else if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		{
+			perror("socketpair ERROR");
+			exit(EXIT_FAILURE);
+		}
+		setnonblocking(sv[0]);
+		ctx.fds.push_back(sv[0]);
+		if (i < conns)
+			client_fds.push_back(sv[1]);
+		else
+			idle_fds.push_back(sv[1]);
+	}
+
+	thread client(client_run, client_fds, messages, msg_len);
+
+	// 只统计 server 线程，client 线程已经起来了，不会被算进去
+	perf_group group;
+	perf_sample before, after;
+	bool counted = g_with_counters && group.open() && group.read(before);
+
+	g_allocs = 0;
+	uint64_t wall = now_ns(CLOCK_MONOTONIC);
+	uint64_t cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	t_count_allocs = true;
+	loop(ctx);
+	t_count_allocs = false;
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	wall = now_ns(CLOCK_MONOTONIC) - wall;
+	counted = counted && group.read(after);
+
+	client.join();
+	for (int fd : idle_fds)
+		close(fd);
+
+	bench_result r;
+	r.name = name;
+	r.messages = (uint64_t)conns * messages;
+	r.events = ctx.events;
+	r.wakeups = ctx.wakeups;
+	r.allocs = g_allocs;
+	r.cpu_ns = cpu;
+	r.wall_ns = wall;
+	r.counted = counted;
+	for (int i = 0; i < PERF_GROUP_EVENTS; ++i)
+		r.counters.value[i] = counted ? after.value[i] - before.value[i] : 0;
+	return r;
+}
+
+void print_result(const bench_result &r)
+{
+	cout << left << setw(8) << r.name << right << fixed << setprecision(2)
+		<< setw(10) << r.messages
+		<< setw(10) << r.events
+		<< setw(12) << (double)r.cpu_ns / r.events
+		<< setw(14) << (double)r.wakeups / r.messages
+		<< setw(12) << (double)r.allocs / r.messages
+		<< setw(10) << r.wall_ns / 1e6
+		<< setw(12) << (uint64_t)(r.messages * 1e9 / r.wall_ns);
+	if (r.counted)
+	{
+		const uint64_t *v = r.counters.value;
+		double msgs = r.messages;
+		cout << setprecision(0)
+			<< setw(10) << v[PERF_GROUP_CYCLES] / msgs
+			<< setw(10) << v[PERF_GROUP_INSTRUCTIONS] / msgs
+			<< setprecision(2)
+			<< setw(7) << (v[PERF_GROUP_CYCLES] ? (double)v[PERF_GROUP_INSTRUCTIONS] / v[PERF_GROUP_CYCLES] : 0)
+			<< setprecision(3)
+			<< setw(12) << v[PERF_GROUP_CACHE_MISSES] / msgs
+			<< setw(12) << v[PERF_GROUP_BRANCH_MISSES] / msgs;
+	}
+	cout << endl;
+}
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-c conns] [-i idle] [-n messages] [-s msg_len] [-T] [backend ...]" << endl;
+	cerr << "  -i  also register this many connections that never send" << endl;
+	cerr << "  -T  use loopback tcp connections instead of unix socketpairs" << endl;
+	cerr << "  backends: select poll epoll libev libuv, default all" << endl;
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int conns = BENCH_CONNS;
+	int idle = 0;
+	int messages = BENCH_MESSAGES;
+	size_t msg_len = BENCH_MSG_LEN;
+	bool tcp = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:i:n:s:T")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c': conns = atoi(optarg); break;
+		case 'i': idle = atoi(optarg); break;
+		case 'n': messages = atoi(optarg); break;
+		case 's': msg_len = strtoul(optarg, NULL, 10); break;
+		case 'T': tcp = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (conns <= 0 || idle < 0 || messages <= 0 || msg_len == 0)
+		usage(argv[0]);
+
+	// 两端都在这个进程里，每个连接两个 fd，tcp 还多一个监听 socket
+	rlim_t nofile = raise_nofile_limit();
+	if ((rlim_t)(conns + idle) * 2 + 16 > nofile)
+	{
+		cerr << "need " << (conns + idle) * 2 + 16 << " fds, limit is " << nofile << endl;
+		exit(EXIT_FAILURE);
+	}
+	// select 最多只能用 FD_SETSIZE 个 fd
+	bool select_fits = (conns + idle) * 2 + 16 <= FD_SETSIZE;
+
+	struct backend
+	{
+		const char *name;
+		void (*loop)(bench_ctx&);
+	};
+	const backend backends[] = {
+		{"select", run_select},
+		{"poll", run_poll},
+		{"epoll", run_epoll},
+		{"libev", run_libev},
+		{"libuv", run_libuv},
+	};
+
+	vector<const backend*> selected;
+	for (int i = optind; i < argc; ++i)
+	{
+		const backend *b = NULL;
+		for (auto &it : backends)
+			if (strcmp(it.name, argv[i]) == 0)
+				b = &it;
+		if (b == NULL)
+			usage(argv[0]);
+		selected.push_back(b);
+	}
+	if (selected.empty())
+		for (auto &it : backends)
+			selected.push_back(&it);
+
+	// 先把 arena 初始化掉，不算到分配次数里
+	arena_init();
+
+	cout << conns << (tcp ? " loopback tcp connections, " : " socketpairs, ") << idle << " idle, "
+		<< messages << " messages each, " << msg_len << " bytes, buffer " << g_config.buffer_size << endl;
+
+	// 虚拟机里经常没有硬件计数器，没有就少打几列
+	{
+		perf_group probe;
+		g_with_counters = probe.open();
+		if (g_with_counters)
+			cout << "hardware counters per message, " << (probe.with_kernel() ? "user+kernel" : "user only") << endl;
+		else
+			cout << "hardware counters unavailable: " << strerror(errno) << endl;
+	}
+
+	cout << left << setw(8) << "backend" << right
+		<< setw(10) << "msgs"
+		<< setw(10) << "events"
+		<< setw(12) << "ns/event"
+		<< setw(14) << "wakeups/msg"
+		<< setw(12) << "allocs/msg"
+		<< setw(10) << "wall ms"
+		<< setw(12) << "msgs/s";
+	if (g_with_counters)
+	{
+		cout << setw(10) << "cycles"
+			<< setw(10) << "instrs"
+			<< setw(7) << "IPC"
+			<< setw(12) << "cache miss"
+			<< setw(12) << "branch miss";
+	}
+	cout << endl;
+
+	for (auto b : selected)
+	{
+		if (b->loop == run_select && !select_fits)
+		{
+			cout << left << setw(8) << b->name << right << "  skipped, fds exceed FD_SETSIZE " << FD_SETSIZE << endl;
+			continue;
+		}
+		print_result(run_backend(b->name, b->loop, conns, idle, messages, msg_len, tcp));
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*
+ * perf_counter.cpp
+ */
+
+#include "perf_counter.h"
+
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+using namespace std;
+
+static const uint64_t g_group_config[PERF_GROUP_EVENTS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static const char *g_group_names[PERF_GROUP_EVENTS] = {
+	"cycles",
+	"instructions",
+	"cache misses",
+	"branch misses",
+};
+
+perf_counter::~perf_counter()
+{
+	close();
+}
+
+bool perf_counter::open(uint32_t type, uint64_t config, bool inherit)
+{
+	close();
+
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = inherit ? 1 : 0;
+
+	// 统计当前进程，不限 cpu
+	fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd_ == -1)
+		return false;
+
+	ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+	return true;
+}
+
+void perf_counter::close()
+{
+	if (fd_ != -1)
+	{
+		::close(fd_);
+		fd_ = -1;
+	}
+}
+
+uint64_t perf_counter::read() const
+{
+	uint64_t value = 0;
+	if (fd_ == -1 || ::read(fd_, &value, sizeof(value)) != sizeof(value))
+		return 0;
+	return value;
+}
+
+perf_group::perf_group()
+	: with_kernel_(false)
+{
+	for (int i = 0; i < PERF_GROUP_EVENTS; ++i)
+		fds_[i] = -1;
+}
+
+/* 第一个是 leader，先关着，整组建好再一起清零打开 */
+bool perf_group::open_events(bool with_kernel)
+{
+	for (int i = 0; i < PERF_GROUP_EVENTS; ++i)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = g_group_config[i];
+		attr.disabled = i == 0 ? 1 : 0;
+		attr.exclude_kernel = with_kernel ? 0 : 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+
+		fds_[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds_[0], 0);
+		if (fds_[i] == -1)
+		{
+			int saved = errno;
+			close();
+			errno = saved;
+			return false;
+		}
+	}
+
+	with_kernel_ = with_kernel;
+	ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return true;
+}
+
+bool perf_group::open()
+{
+	close();
+	if (open_events(true))
+		return true;
+	// perf_event_paranoid 是 2 时普通用户只能统计用户态
+	if (errno != EACCES && errno != EPERM)
+		return false;
+	return open_events(false);
+}
+
+void perf_group::close()
+{
+	// 先关成员再关 leader
+	for (int i = PERF_GROUP_EVENTS - 1; i >= 0; --i)
+	{
+		if (fds_[i] != -1)
+		{
+			::close(fds_[i]);
+			fds_[i] = -1;
+		}
+	}
+}
+
+bool perf_group::read(perf_sample &sample) const
+{
+	// PERF_FORMAT_GROUP：先是个数，后面按打开的顺序排
+	uint64_t buf[1 + PERF_GROUP_EVENTS];
+	if (!valid() || ::read(fds_[0], buf, sizeof(buf)) != sizeof(buf) || buf[0] != PERF_GROUP_EVENTS)
+		return false;
+	memcpy(sample.value, buf + 1, sizeof(sample.value));
+	return true;
+}
+
+const char *perf_group::name(int event)
+{
+	return g_group_names[event];
+}
+
+loop_counters::loop_counters()
+	: every_(0), ticks_(0), sampling_(false), events_(0), samples_(0)
+{
+	for (int i = 0; i < PERF_GROUP_EVENTS; ++i)
+		total_[i] = 0;
+}
+
+bool loop_counters::open(uint64_t every)
+{
+	every_ = every;
+	return every_ > 0 && group_.open();
+}
+
+/* every 是 1 时这次的终点就是下一轮的起点，每轮只读一次 */
+void loop_counters::tick(uint64_t events)
+{
+	if (!group_.valid())
+		return;
+
+	uint64_t tick = ticks_++;
+	if (sampling_)
+	{
+		perf_sample now;
+		sampling_ = false;
+		if (group_.read(now))
+		{
+			for (int i = 0; i < PERF_GROUP_EVENTS; ++i)
+				total_[i].store(total_[i].load(memory_order_relaxed) + now.value[i] - start_.value[i], memory_order_relaxed);
+			events_.store(events_.load(memory_order_relaxed) + events, memory_order_relaxed);
+			samples_.store(samples_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+			if (every_ == 1)
+			{
+				start_ = now;
+				sampling_ = true;
+				return;
+			}
+		}
+	}
+	if (tick % every_ == 0)
+		sampling_ = group_.read(start_);
+}
+
+void loop_counters::print(const char *name) const
+{
+	uint64_t events = events_.load(memory_order_relaxed);
+	if (!group_.valid() || events == 0)
+		return;
+
+	double v[PERF_GROUP_EVENTS];
+	for (int i = 0; i < PERF_GROUP_EVENTS; ++i)
+		v[i] = total_[i].load(memory_order_relaxed);
+
+	cout << name << " counters (" << (group_.with_kernel() ? "user+kernel" : "user only")
+		<< ", " << samples_.load(memory_order_relaxed) << " sampled iterations, " << events << " events): "
+		<< fixed << setprecision(1)
+		<< "cycles/event " << v[PERF_GROUP_CYCLES] / events
+		<< " instructions/event " << v[PERF_GROUP_INSTRUCTIONS] / events
+		<< setprecision(2)
+		<< " IPC " << (v[PERF_GROUP_CYCLES] ? v[PERF_GROUP_INSTRUCTIONS] / v[PERF_GROUP_CYCLES] : 0)
+		<< setprecision(3)
+		<< " cache misses/event " << v[PERF_GROUP_CACHE_MISSES] / events
+		<< " branch misses/event " << v[PERF_GROUP_BRANCH_MISSES] / events << endl;
+	cout.unsetf(ios::floatfield);
+	cout << setprecision(6);
+}
@@ -0,0 +1,119 @@
+/*
+ * perf_counter.h
+ * perf_event_open 的简单封装
+ *
+ * perf_counter 是单个计数器，只统计用户态；
+ * perf_group 把 cycles、instructions、cache misses、branch misses 放在一组里，同时开关、一次 read 读出来，
+ * 算出来的比例是同一段时间的，只统计打开它的线程，权限够时连内核态一起算，event loop 的大部分时间在系统调用里；
+ * loop_counters 在 loop 线程里每 N 轮采一轮，报告每个事件花的 cycles、指令、IPC 和 miss
+ *
+ * 虚拟机里经常没有硬件计数器，打开失败时这些都不工作，调用的地方照常跑
+ */
+
+#ifndef __perf_counter_h__
+#define __perf_counter_h__
+
+#include <stdint.h>
+#include <atomic>
+#include <linux/perf_event.h>
+
+#define PERF_DTLB_LOAD_MISSES (PERF_COUNT_HW_CACHE_DTLB | \
+	(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+class perf_counter
+{
+public:
+	perf_counter() : fd_(-1) {}
+	~perf_counter();
+
+	/* inherit 为 true 时之后创建的线程也一起统计，没权限或者不支持时返回 false */
+	bool open(uint32_t type, uint64_t config, bool inherit = false);
+	void close();
+
+	bool valid() const { return fd_ != -1; }
+	uint64_t read() const;
+
+private:
+	perf_counter(const perf_counter&);
+	perf_counter &operator=(const perf_counter&);
+
+	int fd_;
+};
+
+enum perf_group_event
+{
+	PERF_GROUP_CYCLES,
+	PERF_GROUP_INSTRUCTIONS,
+	PERF_GROUP_CACHE_MISSES,
+	PERF_GROUP_BRANCH_MISSES,
+	PERF_GROUP_EVENTS
+};
+
+struct perf_sample
+{
+	uint64_t value[PERF_GROUP_EVENTS];
+};
+
+class perf_group
+{
+public:
+	perf_group();
+	~perf_group() { close(); }
+
+	/* 统计调用的线程，不允许统计内核态时退回只统计用户态，一个都打不开返回 false，errno 是原因 */
+	bool open();
+	void close();
+
+	bool valid() const { return fds_[0] != -1; }
+	bool with_kernel() const { return with_kernel_; }
+
+	/* 打开以来的累计值，一次系统调用 */
+	bool read(perf_sample &sample) const;
+
+	static const char *name(int event);
+
+private:
+	perf_group(const perf_group&);
+	perf_group &operator=(const perf_group&);
+
+	bool open_events(bool with_kernel);
+
+	int fds_[PERF_GROUP_EVENTS];
+	bool with_kernel_;
+};
+
+/*
+ * 每轮在固定的位置调用 tick，比如处理完事件、回去等之前，两次 tick 之间就是完整的一轮，
+ * 包括等事件的系统调用；每 every 轮采一轮，每次采样多两次 read 系统调用
+ * 只有 loop 线程写，统计可以在别的线程打印
+ */
+class loop_counters
+{
+public:
+	loop_counters();
+
+	/* 要在 loop 线程里调用，every 是 0 或者打不开计数器时返回 false，之后 tick 什么也不做 */
+	bool open(uint64_t every);
+	bool valid() const { return group_.valid(); }
+
+	/* events 是上次 tick 以来处理的事件数 */
+	void tick(uint64_t events);
+
+	/* 每个事件平均的 cycles、instructions、IPC 和 miss，没采到东西时不打印 */
+	void print(const char *name) const;
+
+private:
+	loop_counters(const loop_counters&);
+	loop_counters &operator=(const loop_counters&);
+
+	perf_group group_;
+	uint64_t every_;
+	uint64_t ticks_;
+	bool sampling_;					// 上次 tick 读了起点，这次 tick 是终点
+	perf_sample start_;
+	std::atomic<uint64_t> total_[PERF_GROUP_EVENTS];
+	std::atomic<uint64_t> events_;	// 采到的那些轮里的事件数
+	std::atomic<uint64_t> samples_;
+};
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * pipeline_client.cpp
+ * 每个连接同时只有一个 uv_write，写的时候新请求接着往 out 里攒，写完了再把 out 整个换出去写，
+ * 所以请求越密，一次写里合进去的请求越多
+ */
+
+#include "pipeline_client.h"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+pipeline_client::pipeline_client(uv_loop_t *loop, const client_options &options)
+	: loop_(loop), options_(options), read_buf_(CLIENT_READ_SIZE), next_(0), live_(0), inflight_(0), closing_(false)
+{
+	if (options_.connections <= 0)
+		options_.connections = 1;
+	if (options_.depth <= 0)
+		options_.depth = 1;
+	memset(&stats_, 0, sizeof(stats_));
+	uv_prepare_init(loop_, &prepare_);
+	prepare_.data = this;
+}
+
+pipeline_client::~pipeline_client()
+{
+}
+
+int pipeline_client::connect(const char *host, const char *port)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	// 不传回调就是同步解析，只在开始时调用一次
+	uv_getaddrinfo_t resolver;
+	int ret = uv_getaddrinfo(loop_, &resolver, NULL, host, port, &hints);
+	if (ret < 0)
+		return ret;
+
+	for (int i = 0; i < options_.connections; ++i)
+	{
+		conn_t *c = new conn_t;
+		c->owner = this;
+		c->connected = false;
+		c->closed = false;
+		c->writing = false;
+		c->dirty = false;
+		uv_tcp_init(loop_, &c->handle);
+		c->handle.data = c;
+		c->connect_req.data = c;
+		c->write_req.data = c;
+		conns_.push_back(c);
+		++live_;
+
+		ret = uv_tcp_connect(&c->connect_req, &c->handle, resolver.addrinfo->ai_addr, on_connect);
+		if (ret < 0)
+			fail(c, ret);
+	}
+	uv_freeaddrinfo(resolver.addrinfo);
+	return 0;
+}
+
+void pipeline_client::send(const char *data, size_t len, reply_cb cb, void *arg)
+{
+	request_t req;
+	req.len = len;
+	req.cb = cb;
+	req.arg = arg;
+
+	if (closing_ || live_ == 0)
+	{
+		++stats_.requests;
+		++stats_.failed;
+		cb(arg, closing_ ? UV_ECANCELED : UV_ENOTCONN, NULL, 0);
+		return;
+	}
+	// echo 的空请求不会有回复
+	if (len == 0 && options_.reply_size == NULL)
+	{
+		++stats_.requests;
+		cb(arg, 0, data, 0);
+		return;
+	}
+
+	// 前面还有排队的就跟在后面，保持发出的顺序
+	conn_t *c = queue_.empty() ? pick() : NULL;
+	if (c == NULL)
+	{
+		req.data.assign(data, len);
+		queue_.push_back(move(req));
+		++stats_.queued;
+		return;
+	}
+	c->out.append(data, len);
+	if (options_.reply_size)
+		req.data.assign(data, len);
+	dispatch(c, move(req));
+}
+
+void pipeline_client::close()
+{
+	if (closing_)
+		return;
+	closing_ = true;
+	for (conn_t *c : conns_)
+		fail(c, UV_ECANCELED);
+	fail_queue(UV_ECANCELED);
+	uv_close((uv_handle_t*)&prepare_, NULL);
+}
+
+size_t pipeline_client::pending() const
+{
+	return inflight_ + queue_.size();
+}
+
+void pipeline_client::on_connect(uv_connect_t *req, int status)
+{
+	conn_t *c = (conn_t*)req->data;
+	pipeline_client *self = c->owner;
+	if (c->closed)
+		return;
+	if (status < 0)
+	{
+		self->fail(c, status);
+		return;
+	}
+
+	c->connected = true;
+	uv_tcp_nodelay(&c->handle, 1);
+	uv_read_start((uv_stream_t*)&c->handle, on_alloc, on_read);
+	self->drain_queue();
+}
+
+void pipeline_client::on_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+	conn_t *c = (conn_t*)handle->data;
+	vector<char> &read_buf = c->owner->read_buf_;
+	*buf = uv_buf_init(read_buf.data(), read_buf.size());
+}
+
+/*
+ * 之前没有剩下半个回复时直接在 read_buf_ 里拆，只把最后凑不齐的部分拷到 in；
+ * 回调里可能 send 甚至 close，所以每个回调之后都要看一下连接还在不在
+ */
+void pipeline_client::on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+	conn_t *c = (conn_t*)stream->data;
+	pipeline_client *self = c->owner;
+	if (nread < 0)
+	{
+		self->fail(c, nread);
+		return;
+	}
+	if (nread == 0)
+		return;
+
+	if (c->in.empty())
+	{
+		size_t used = self->take_replies(c, buf->base, nread);
+		if (!c->closed && used < (size_t)nread)
+			c->in.assign(buf->base + used, nread - used);
+	}
+	else
+	{
+		c->in.append(buf->base, nread);
+		size_t used = self->take_replies(c, c->in.data(), c->in.size());
+		if (!c->closed)
+			c->in.erase(0, used);
+	}
+	if (!c->closed)
+		self->drain_queue();
+}
+
+void pipeline_client::on_write(uv_write_t *req, int status)
+{
+	conn_t *c = (conn_t*)req->data;
+	pipeline_client *self = c->owner;
+	c->writing = false;
+	c->writing_buf.clear();
+	if (c->closed)
+		return;
+	if (status < 0)
+	{
+		self->fail(c, status);
+		return;
+	}
+	// 写的这段时间攒下来的一起写出去
+	if (!c->out.empty())
+		self->flush(c);
+}
+
+void pipeline_client::on_prepare(uv_prepare_t *prepare)
+{
+	pipeline_client *self = (pipeline_client*)prepare->data;
+	// 写失败时的回调里可能又 send，弄脏新的连接，一直写到没有为止
+	vector<conn_t*> dirty;
+	while (!self->dirty_.empty())
+	{
+		dirty.clear();
+		dirty.swap(self->dirty_);
+		for (conn_t *c : dirty)
+			c->dirty = false;
+		for (conn_t *c : dirty)
+		{
+			if (!c->closed && !c->writing && !c->out.empty())
+				self->flush(c);
+		}
+	}
+	uv_prepare_stop(prepare);
+}
+
+void pipeline_client::on_close(uv_handle_t *handle)
+{
+	conn_t *c = (conn_t*)handle->data;
+	pipeline_client *self = c->owner;
+	self->conns_.erase(find(self->conns_.begin(), self->conns_.end(), c));
+	if (c->dirty)
+		self->dirty_.erase(find(self->dirty_.begin(), self->dirty_.end(), c));
+	delete c;
+}
+
+/* 在路上的请求最少、还没到 depth 的连接，一样多时从 next_ 开始轮流 */
+pipeline_client::conn_t *pipeline_client::pick()
+{
+	conn_t *best = NULL;
+	size_t n = conns_.size();
+	for (size_t i = 0; i < n; ++i)
+	{
+		conn_t *c = conns_[(next_ + i) % n];
+		if (!c->connected || c->closed || c->inflight.size() >= (size_t)options_.depth)
+			continue;
+		if (best == NULL || c->inflight.size() < best->inflight.size())
+			best = c;
+	}
+	if (best)
+		++next_;
+	return best;
+}
+
+/* 请求已经拷进 c->out，记下来等回复；攒够了马上写，不然等 prepare */
+void pipeline_client::dispatch(conn_t *c, request_t &&req)
+{
+	c->inflight.push_back(move(req));
+	++inflight_;
+
+	if (c->writing)
+		return;
+	if (c->out.size() >= options_.batch_bytes)
+	{
+		flush(c);
+		return;
+	}
+	if (!c->dirty)
+	{
+		c->dirty = true;
+		dirty_.push_back(c);
+		uv_prepare_start(&prepare_, on_prepare);
+	}
+}
+
+void pipeline_client::drain_queue()
+{
+	while (!queue_.empty())
+	{
+		conn_t *c = pick();
+		if (c == NULL)
+			return;
+		request_t req = move(queue_.front());
+		queue_.pop_front();
+		c->out.append(req.data);
+		if (options_.reply_size == NULL)
+			string().swap(req.data);
+		dispatch(c, move(req));
+	}
+}
+
+void pipeline_client::flush(conn_t *c)
+{
+	c->writing_buf.swap(c->out);
+	c->writing = true;
+	++stats_.writes;
+
+	uv_buf_t buf = uv_buf_init(&c->writing_buf[0], c->writing_buf.size());
+	int ret = uv_write(&c->write_req, (uv_stream_t*)&c->handle, &buf, 1, on_write);
+	if (ret < 0)
+	{
+		c->writing = false;
+		fail(c, ret);
+	}
+}
+
+/* 按顺序交出收齐的回复，返回用掉的字节数 */
+size_t pipeline_client::take_replies(conn_t *c, const char *data, size_t len)
+{
+	size_t used = 0;
+	while (used < len)
+	{
+		if (c->inflight.empty())
+		{
+			// 没有请求却收到了数据，对不上了
+			fail(c, UV_EPROTO);
+			return used;
+		}
+
+		request_t &head = c->inflight.front();
+		size_t size;
+		if (options_.reply_size)
+			size = options_.reply_size(head.data, data + used, len - used);
+		else
+			size = len - used >= head.len ? head.len : 0;
+		if (size == 0 || size > len - used)
+			break;
+
+		request_t req = move(head);
+		c->inflight.pop_front();
+		--inflight_;
+		complete(req, 0, data + used, size);
+		used += size;
+		if (c->closed)
+			return used;
+	}
+	return used;
+}
+
+/* 连接不能用了，上面的请求都失败；最后一个连接也断了时排队的请求一起失败 */
+void pipeline_client::fail(conn_t *c, int status)
+{
+	if (c->closed)
+		return;
+	c->closed = true;
+	if (c->connected)
+		uv_read_stop((uv_stream_t*)&c->handle);
+	uv_close((uv_handle_t*)&c->handle, on_close);
+	--live_;
+
+	deque<request_t> inflight;
+	inflight.swap(c->inflight);
+	inflight_ -= inflight.size();
+	c->out.clear();
+	c->in.clear();
+	for (request_t &req : inflight)
+		complete(req, status, NULL, 0);
+
+	if (live_ == 0)
+		fail_queue(status);
+	else
+		drain_queue();
+}
+
+void pipeline_client::fail_queue(int status)
+{
+	deque<request_t> queue;
+	queue.swap(queue_);
+	for (request_t &req : queue)
+		complete(req, status, NULL, 0);
+}
+
+void pipeline_client::complete(request_t &req, int status, const char *data, size_t len)
+{
+	++stats_.requests;
+	if (status < 0)
+		++stats_.failed;
+	req.cb(req.arg, status, data, len);
+}
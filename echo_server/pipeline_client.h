@@ -0,0 +1,142 @@
+/*
+ * pipeline_client.h
+ * 基于 libuv 的异步客户端，发一条消息，回复收齐了调用回调，不用每个服务自己写阻塞的 socket
+ *
+ * 几个长连接组成连接池，请求分给在路上的请求最少的连接，每个连接最多 depth 个请求在路上（pipelining），
+ * 都满了就在客户端排队，有回复回来再补发；同一轮 loop 里发的小请求先攒在连接的 out 里，
+ * 在 prepare 里一次 uv_write 写出去，上一次写没完成时接着攒，攒够 batch_bytes 就不等了
+ *
+ * 回复按请求的顺序回来，默认是 echo：回复跟请求一样长；
+ * 别的协议传 reply_size，告诉客户端 in 开头的一个回复有多长
+ *
+ * 不加锁，只能在 loop 的线程里用；断开的连接不重连，上面在路上的请求回调 status < 0，
+ * 所有连接都断了，排队的请求也一起失败：
+ *   pipeline_client client(loop, options);
+ *   client.connect("127.0.0.1", "12321");
+ *   client.send(data, len, on_reply, arg);
+ */
+
+#ifndef __pipeline_client_h__
+#define __pipeline_client_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <uv.h>
+
+#define CLIENT_CONNS 4
+#define CLIENT_DEPTH 16
+#define CLIENT_BATCH_BYTES (64 << 10)
+#define CLIENT_READ_SIZE (64 << 10)
+
+/* status 是 0 或者 libuv 的错误码，出错时 data 是 NULL */
+typedef void (*reply_cb)(void *arg, int status, const char *data, size_t len);
+
+/*
+ * request 是这个回复对应的请求，data 是还没交给回调的数据；
+ * 回复收齐了返回它的长度，还没收齐返回 0
+ */
+typedef size_t (*reply_size_fn)(const std::string &request, const char *data, size_t len);
+
+struct client_options
+{
+	int connections;		// 连接池里的长连接数
+	int depth;				// 每个连接最多几个请求在路上，1 就是不 pipeline
+	size_t batch_bytes;		// out 攒到这么多就马上写，不等 prepare
+	reply_size_fn reply_size;	// NULL 表示 echo
+
+	client_options()
+		: connections(CLIENT_CONNS), depth(CLIENT_DEPTH), batch_bytes(CLIENT_BATCH_BYTES), reply_size(NULL)
+	{
+	}
+};
+
+struct client_stats
+{
+	uint64_t requests;		// 回调过的请求，包括失败的
+	uint64_t failed;
+	uint64_t writes;		// uv_write 的次数，跟 requests 比就是平均几个请求合成一次写
+	uint64_t queued;		// 连接都满了先排队的请求
+};
+
+class pipeline_client
+{
+public:
+	pipeline_client(uv_loop_t *loop, const client_options &options = client_options());
+	~pipeline_client();
+
+	/* 解析地址并发起所有连接，连上之前 send 的请求先排队；解析失败返回 libuv 的错误码 */
+	int connect(const char *host, const char *port);
+
+	/* data 会拷走，回调可能在 send 返回之前就被调用（已经没有能用的连接时） */
+	void send(const char *data, size_t len, reply_cb cb, void *arg);
+
+	/* 关掉所有连接，还没回复的请求回调 UV_ECANCELED；handle 关完才能析构，要再跑一下 loop */
+	void close();
+
+	/* 已经发出去或者在排队，还没回调的请求数 */
+	size_t pending() const;
+	int live_connections() const { return live_; }
+	const client_stats &stats() const { return stats_; }
+
+private:
+	pipeline_client(const pipeline_client&);
+	pipeline_client &operator=(const pipeline_client&);
+
+	struct request_t
+	{
+		size_t len;
+		std::string data;	// 排队时和自定义协议算回复长度时才留着，echo 发出去之后只用长度
+		reply_cb cb;
+		void *arg;
+	};
+
+	struct conn_t
+	{
+		uv_tcp_t handle;
+		uv_connect_t connect_req;
+		uv_write_t write_req;
+		pipeline_client *owner;
+		bool connected;
+		bool closed;
+		bool writing;				// write_req 在用，新的请求攒在 out 里
+		bool dirty;					// 在 dirty_ 里，等 prepare 写出去
+		std::deque<request_t> inflight;	// 发出去还没收齐回复的，按顺序
+		std::string out;			// 还没写的请求
+		std::string writing_buf;	// 正在写的那一批
+		std::string in;				// 还没凑成完整回复的数据
+	};
+
+	static void on_connect(uv_connect_t *req, int status);
+	static void on_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+	static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+	static void on_write(uv_write_t *req, int status);
+	static void on_prepare(uv_prepare_t *prepare);
+	static void on_close(uv_handle_t *handle);
+
+	conn_t *pick();
+	void dispatch(conn_t *c, request_t &&req);
+	void drain_queue();
+	void flush(conn_t *c);
+	size_t take_replies(conn_t *c, const char *data, size_t len);
+	void fail(conn_t *c, int status);
+	void fail_queue(int status);
+	void complete(request_t &req, int status, const char *data, size_t len);
+
+	uv_loop_t *loop_;
+	client_options options_;
+	uv_prepare_t prepare_;			// 每轮等事件之前把攒下来的请求写出去
+	std::vector<conn_t*> conns_;
+	std::deque<request_t> queue_;	// 连接都满了或者还没连上
+	std::vector<conn_t*> dirty_;	// out 里有东西、要在 prepare 里写的连接
+	std::vector<char> read_buf_;	// 所有连接共用，凑不成完整回复的部分才拷到连接的 in 里
+	size_t next_;					// 负载一样时从这里开始挑，轮流用各个连接
+	int live_;						// 连上了或者正在连，还没断的连接
+	size_t inflight_;
+	client_stats stats_;
+	bool closing_;
+};
+
+#endif
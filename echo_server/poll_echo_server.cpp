@@ -0,0 +1,129 @@
+/*
+ * poll_echo_server.cpp
+ * 一个基于 poll 的 echo server，客户端可以 telnet 上来，服务器返回跟客户端输入同样的内容给客户端
+ *
+ * 跟 select 比没有 FD_SETSIZE 的限制，pollfd 数组是紧凑的：关掉的连接用最后一个元素填上，
+ * 每次 poll 传进内核的只有还开着的 fd，不会像 select 那样随最大的 fd 增长
+ */
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <vector>
+#include "server_core.h"
+
+using namespace std;
+
+/* 阻塞 socket 上 send 也可能只发出一部分；对端已经 RST 时用 MSG_NOSIGNAL 拿 EPIPE，不然 SIGPIPE 会杀掉整个服务器 */
+static bool send_all(int sock, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t ret = send(sock, data, len, MSG_NOSIGNAL);
+		if (ret == -1)
+		{
+			perror("send ERROR");
+			return false;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+void main_loop(const vector<int> &listeners)
+{
+	// 监听 socket 固定放在最前面，不会被换走；
+	// 每个连接只占一个 pollfd，地址要打日志时再从 fd 取
+	vector<pollfd> fds;
+	for (int server_sock : listeners)
+		fds.push_back({server_sock, POLLIN, 0});
+	size_t nlisteners = listeners.size();
+
+	vector<char> buf(g_config.buffer_size);
+
+	for(;;)
+	{
+		int ret = poll(fds.data(), fds.size(), -1);
+		if (ret == -1)
+		{
+			perror("poll ERROR");
+			exit(EXIT_FAILURE);
+		}
+
+		// 本轮 accept 进来的 fd 追加到末尾，revents 是 0，不会被当成就绪
+		for (size_t i = 0; i < fds.size() && ret > 0;)
+		{
+			if (fds[i].revents == 0)
+			{
+				++i;
+				continue;
+			}
+			--ret;
+
+			// server accept
+			if (i < nlisteners)
+			{
+				int client_sock = accept(fds[i].fd, NULL, NULL);
+				if (client_sock == -1)
+				{
+					perror("accept ERROR");
+					++i;
+					continue;
+				}
+
+				cout << "client from " << get_sock_addr(client_sock) << endl;
+
+				fds.push_back({client_sock, POLLIN, 0});
+				++i;
+				continue;
+			}
+
+			// recv from client，POLLHUP/POLLERR 也走 recv，拿到 0 或者错误再关
+			int sock = fds[i].fd;
+			ssize_t n = recv(sock, buf.data(), buf.size(), 0);
+			if (n <= 0 || !send_all(sock, buf.data(), n))
+			{
+				if (n < 0)
+					perror("recv ERROR");
+				else
+					cout << "client closed " << get_sock_addr(sock) << endl;
+
+				// 最后一个换到 i 上，它的 revents 也是这次 poll 的结果，下一轮接着处理 i
+				close(sock);
+				fds[i] = fds.back();
+				fds.pop_back();
+				continue;
+			}
+			++i;
+		}
+	}
+}
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [options]" << endl;
+	server_usage();
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", server_long_options, NULL)) != -1)
+	{
+		if (!server_parse_option(opt, optarg))
+			usage(argv[0]);
+	}
+
+	vector<int> listeners = make_listeners();
+	cout << "wairting for clients..." << endl;
+	main_loop(listeners);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,87 @@
+/*
+ * pool.cpp
+ * 对象释放后只回到 freelist，slab 要等整个 pool 析构才还给系统
+ */
+
+#include "pool.h"
+
+#include <cstdlib>
+
+using namespace std;
+
+// 跟 arena 一样，ASan 看不到 freelist 里的对象被重复使用，用 ASan 编译时直接用 malloc
+#if defined(__SANITIZE_ADDRESS__)
+#define POOL_USE_MALLOC 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define POOL_USE_MALLOC 1
+#endif
+#endif
+
+#define POOL_ALIGN 16
+
+fixed_pool::fixed_pool(size_t object_size, size_t slab_size)
+	: free_list_(NULL), in_use_(0)
+{
+	if (object_size < sizeof(free_node))
+		object_size = sizeof(free_node);
+	object_size_ = (object_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	slab_size_ = slab_size < object_size_ ? object_size_ : slab_size;
+}
+
+fixed_pool::~fixed_pool()
+{
+	for (char *slab : slabs_)
+		::free(slab);
+}
+
+/* 新的 slab 整块切开挂到 freelist 上，从低地址开始用 */
+void fixed_pool::refill()
+{
+	char *slab = (char*)aligned_alloc(POOL_ALIGN, slab_size_);
+	if (slab == NULL)
+		return;
+	slabs_.push_back(slab);
+
+	size_t count = slab_size_ / object_size_;
+	for (size_t i = count; i > 0; --i)
+	{
+		free_node *node = (free_node*)(slab + (i - 1) * object_size_);
+		node->next = free_list_;
+		free_list_ = node;
+	}
+}
+
+void *fixed_pool::alloc()
+{
+#ifdef POOL_USE_MALLOC
+	void *p = malloc(object_size_);
+	if (p)
+		++in_use_;
+	return p;
+#else
+	if (free_list_ == NULL)
+		refill();
+	if (free_list_ == NULL)
+		return NULL;
+
+	free_node *node = free_list_;
+	free_list_ = node->next;
+	++in_use_;
+	return node;
+#endif
+}
+
+void fixed_pool::free(void *p)
+{
+	if (p == NULL)
+		return;
+	--in_use_;
+#ifdef POOL_USE_MALLOC
+	::free(p);
+#else
+	free_node *node = (free_node*)p;
+	node->next = free_list_;
+	free_list_ = node;
+#endif
+}
@@ -0,0 +1,53 @@
+/*
+ * pool.h
+ * 定长对象的内存池，给连接记录这种数量多、大小固定的对象用：
+ * 按 64K 一块向系统要内存，切成同样大小的格子串在 freelist 上，
+ * 每个对象不带 malloc 的头，几十万个连接的记录也是挨在一起的
+ *
+ * 不加锁，一个 pool 只能在一个线程里用，多个 loop 时每个线程一个：
+ *   static thread_local fixed_pool t_pool(sizeof(client_t));
+ *   client_t *c = new (t_pool.alloc()) client_t;
+ *   c->~client_t();
+ *   t_pool.free(c);
+ */
+
+#ifndef __pool_h__
+#define __pool_h__
+
+#include <stddef.h>
+#include <vector>
+
+#define POOL_SLAB_SIZE (64 << 10)	// 每次向系统要的大小
+
+class fixed_pool
+{
+public:
+	explicit fixed_pool(size_t object_size, size_t slab_size = POOL_SLAB_SIZE);
+	~fixed_pool();
+
+	void *alloc();
+	void free(void *p);
+
+	size_t object_size() const { return object_size_; }
+	size_t in_use() const { return in_use_; }
+	size_t reserved() const { return slabs_.size() * slab_size_; }
+
+private:
+	fixed_pool(const fixed_pool&);
+	fixed_pool &operator=(const fixed_pool&);
+
+	struct free_node
+	{
+		free_node *next;
+	};
+
+	void refill();
+
+	size_t object_size_;
+	size_t slab_size_;
+	free_node *free_list_;
+	size_t in_use_;
+	std::vector<char*> slabs_;
+};
+
+#endif
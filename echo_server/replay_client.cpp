@@ -0,0 +1,539 @@
+/*
+ * replay_client.cpp
+ * 读取 echo server 用 -c 记录下来的流量文件，按原来的连接和时间间隔重放给服务器，
+ * 可以按倍速加速，最后按阶段（建立连接、收发、关闭）统计延迟
+ */
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+#include <ctime>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include "capture.h"
+
+using namespace std;
+
+#define PORT "12321"	// 连接端口
+#define ECHO_LEN 1024
+
+struct replay_event
+{
+	uint64_t ts_ns;
+	uint32_t conn_id;
+	uint8_t dir;
+	uint32_t len;
+	const char *payload;	// 没记录 payload 时为 NULL，用填充字节代替
+	uint64_t expect;		// CAPTURE_IN 之后服务器应该回多少字节
+};
+
+struct pending_reply
+{
+	uint64_t remain;
+	uint64_t start_ns;
+};
+
+struct replay_conn
+{
+	int fd = -1;
+	bool connected = false;
+	bool closing = false;
+	uint64_t connect_ns = 0;
+	uint64_t close_ns = 0;
+	string outbuf;					// 还没发出去的数据
+	deque<pending_reply> replies;	// 等待服务器回包的请求
+};
+
+struct phase_stat
+{
+	const char *name;
+	vector<uint64_t> samples;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 读取记录文件，返回按时间排好的事件 */
+vector<replay_event> load_capture(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		perror("open capture ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	if ((size_t)st.st_size < sizeof(capture_header))
+	{
+		cerr << "capture file too small" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// 映射一直保留到进程退出，payload 直接指向映射区
+	char *base = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+	{
+		perror("mmap capture ERROR");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	const capture_header *header = (const capture_header*)base;
+	if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION)
+	{
+		cerr << "bad capture file " << path << endl;
+		exit(EXIT_FAILURE);
+	}
+	if (header->dropped)
+		cerr << "warning: " << header->dropped << " records dropped while capturing" << endl;
+
+	// 没正常关闭的文件 data_size 是 0，扫整个文件，靠 CAPTURE_COMMITTED 找到结尾
+	uint64_t data_size = st.st_size - sizeof(capture_header);
+	if (header->data_size)
+		data_size = min<uint64_t>(header->data_size, data_size);
+	else if (data_size)
+		cerr << "warning: capture was not closed, reading up to the first uncommitted record" << endl;
+	const char *p = base + sizeof(capture_header);
+	const char *end = p + data_size;
+
+	vector<replay_event> events;
+	while (p + sizeof(capture_record) <= end)
+	{
+		const capture_record *rec = (const capture_record*)p;
+		// 多线程记录时后面可能还有写完的记录，但中间缺了一条，连续的部分到这里为止
+		if (!(rec->flags & CAPTURE_COMMITTED))
+		{
+			if (header->data_size)
+				cerr << "warning: uncommitted capture record, ignoring " << end - p << " bytes after " << events.size() << " records" << endl;
+			break;
+		}
+		// 服务器写到一半被杀掉时最后一条记录不完整，后面的都不能信
+		if (rec->payload_len > (size_t)(end - (p + sizeof(capture_record))))
+		{
+			cerr << "warning: truncated capture, ignoring " << end - p << " bytes after " << events.size() << " records" << endl;
+			break;
+		}
+		// 发送时按 len 取 payload，两个长度对不上说明记录坏了
+		if (rec->payload_len && rec->payload_len != rec->len)
+		{
+			cerr << "warning: corrupt capture record " << events.size() << ": len " << rec->len
+				<< " payload_len " << rec->payload_len << ", ignoring the rest" << endl;
+			break;
+		}
+
+		replay_event ev;
+		ev.ts_ns = rec->ts_ns;
+		ev.conn_id = rec->conn_id;
+		ev.dir = rec->dir;
+		ev.len = rec->len;
+		ev.payload = rec->payload_len ? (const char*)(rec + 1) : NULL;
+		ev.expect = 0;
+		events.push_back(ev);
+		p += (sizeof(capture_record) + rec->payload_len + 7) & ~7ULL;
+	}
+
+	stable_sort(events.begin(), events.end(),
+		[](const replay_event &a, const replay_event &b) { return a.ts_ns < b.ts_ns; });
+
+	// 把服务器的回包归到它前面最近的一次 client 发送上
+	unordered_map<uint32_t, replay_event*> last_in;
+	for (auto &ev : events)
+	{
+		if (ev.dir == CAPTURE_IN)
+			last_in[ev.conn_id] = &ev;
+		else if (ev.dir == CAPTURE_OUT && last_in.count(ev.conn_id))
+			last_in[ev.conn_id]->expect += ev.len;
+	}
+
+	return events;
+}
+
+int connect_server(const char *host, const char *port)
+{
+	struct addrinfo hints, *server_addr;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(host, port, &hints, &server_addr);
+	if (ret != 0)
+	{
+		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int sock = -1;
+	for (struct addrinfo *p = server_addr; p != NULL; p = p->ai_next)
+	{
+		sock = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+		if (sock == -1)
+			continue;
+
+		ret = connect(sock, p->ai_addr, p->ai_addrlen);
+		if (ret == 0 || errno == EINPROGRESS)
+			break;
+
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(server_addr);
+
+	if (sock == -1)
+		perror("connect ERROR");
+	return sock;
+}
+
+/* unix socket 的 connect 不会 EINPROGRESS，backlog 满了返回 EAGAIN，当成失败 */
+int connect_unix(const char *path)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock == -1)
+	{
+		perror("socket ERROR");
+		return -1;
+	}
+	if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == -1)
+	{
+		perror("connect ERROR");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+void print_stat(phase_stat &stat)
+{
+	vector<uint64_t> &v = stat.samples;
+	if (v.empty())
+	{
+		cout << stat.name << ": no samples" << endl;
+		return;
+	}
+
+	sort(v.begin(), v.end());
+	uint64_t sum = 0;
+	for (auto x : v)
+		sum += x;
+
+	auto pct = [&v](double p) { return v[min(v.size() - 1, (size_t)(v.size() * p))] / 1000.0; };
+	cout << stat.name << ": count " << v.size()
+		<< " avg " << sum / v.size() / 1000.0 << "us"
+		<< " p50 " << pct(0.5) << "us"
+		<< " p90 " << pct(0.9) << "us"
+		<< " p99 " << pct(0.99) << "us"
+		<< " max " << v.back() / 1000.0 << "us" << endl;
+}
+
+class replayer
+{
+public:
+	replayer(const char *host, const char *port, const char *unix_path, double speed)
+		: host_(host), port_(port), unix_path_(unix_path), speed_(speed)
+	{
+		epollfd_ = epoll_create1(0);
+		if (epollfd_ == -1)
+		{
+			perror("epoll_create ERROR");
+			exit(EXIT_FAILURE);
+		}
+		memset(filler_, 'x', sizeof(filler_));
+	}
+
+	void run(const vector<replay_event> &events)
+	{
+		uint64_t start = now_ns();
+		size_t next = 0;
+		vector<epoll_event> evs(256);
+
+		while (next < events.size() || !conns_.empty())
+		{
+			uint64_t now = now_ns();
+			while (next < events.size())
+			{
+				uint64_t due = start + (uint64_t)(events[next].ts_ns / speed_);
+				if (due > now)
+					break;
+				lag_.samples.push_back(now - due);
+				dispatch(events[next++], now);
+			}
+
+			// 最后一个事件之后，等剩下的连接都收完回包
+			int timeout = -1;
+			if (next < events.size())
+			{
+				uint64_t due = start + (uint64_t)(events[next].ts_ns / speed_);
+				timeout = due > now ? (due - now) / 1000000 : 0;
+			}
+			else
+			{
+				timeout = 5000;
+				for (auto &it : conns_)
+					if (!it.second.closing)
+						start_close(it.second, now);
+			}
+
+			int nfds = epoll_wait(epollfd_, evs.data(), evs.size(), timeout);
+			if (nfds == -1)
+			{
+				if (errno == EINTR)
+					continue;
+				perror("epoll_wait ERROR");
+				exit(EXIT_FAILURE);
+			}
+			if (nfds == 0 && next == events.size())
+			{
+				cerr << conns_.size() << " connections did not finish" << endl;
+				break;
+			}
+
+			for (int n = 0; n < nfds; ++n)
+				on_event(evs[n].data.u32, evs[n].events);
+		}
+
+		double elapsed = (now_ns() - start) / 1e9;
+		double expected = events.empty() ? 0 : events.back().ts_ns / speed_ / 1e9;
+		cout << "replayed " << events.size() << " events in " << elapsed << "s"
+			<< " (schedule " << expected << "s, speed x" << speed_ << ")" << endl;
+		cout << "sent " << sent_ << " bytes, received " << received_ << " bytes" << endl;
+		print_stat(connect_);
+		print_stat(echo_);
+		print_stat(close_);
+		print_stat(lag_);
+	}
+
+private:
+	void dispatch(const replay_event &ev, uint64_t now)
+	{
+		auto it = conns_.find(ev.conn_id);
+		if (ev.dir == CAPTURE_OPEN || (it == conns_.end() && ev.dir == CAPTURE_IN))
+		{
+			if (it != conns_.end())
+				return;
+			open_conn(ev.conn_id, now);
+			it = conns_.find(ev.conn_id);
+			if (it == conns_.end())
+				return;
+		}
+		if (it == conns_.end())
+			return;
+
+		replay_conn &c = it->second;
+		if (ev.dir == CAPTURE_IN)
+		{
+			if (ev.payload)
+				c.outbuf.append(ev.payload, ev.len);
+			else
+				for (uint32_t left = ev.len; left > 0; left -= min<uint32_t>(left, sizeof(filler_)))
+					c.outbuf.append(filler_, min<uint32_t>(left, sizeof(filler_)));
+			if (ev.expect)
+				c.replies.push_back({ev.expect, now});
+			flush(c);
+		}
+		else if (ev.dir == CAPTURE_CLOSE)
+		{
+			start_close(c, now);
+		}
+	}
+
+	void open_conn(uint32_t conn_id, uint64_t now)
+	{
+		int sock = unix_path_ ? connect_unix(unix_path_) : connect_server(host_, port_);
+		if (sock == -1)
+			return;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.u32 = conn_id;
+		if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, sock, &ev) == -1)
+		{
+			perror("epoll_ctl ERROR");
+			exit(EXIT_FAILURE);
+		}
+
+		replay_conn &c = conns_[conn_id];
+		c.fd = sock;
+		c.connect_ns = now;
+	}
+
+	/* 数据都发完了才关写端，等服务器把连接关掉 */
+	void start_close(replay_conn &c, uint64_t now)
+	{
+		if (c.closing)
+			return;
+		c.closing = true;
+		c.close_ns = now;
+		flush(c);
+	}
+
+	void flush(replay_conn &c)
+	{
+		if (!c.connected)
+			return;
+
+		while (!c.outbuf.empty())
+		{
+			ssize_t ret = send(c.fd, c.outbuf.data(), c.outbuf.size(), MSG_NOSIGNAL);
+			if (ret == -1)
+			{
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					perror("send ERROR");
+				return;
+			}
+			sent_ += ret;
+			c.outbuf.erase(0, ret);
+		}
+
+		if (c.closing)
+			shutdown(c.fd, SHUT_WR);
+	}
+
+	void on_event(uint32_t conn_id, uint32_t events)
+	{
+		auto it = conns_.find(conn_id);
+		if (it == conns_.end())
+			return;
+		replay_conn &c = it->second;
+
+		if (!c.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+		{
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err)
+			{
+				cerr << "connect ERROR: " << strerror(err) << endl;
+				finish(it);
+				return;
+			}
+			c.connected = true;
+			connect_.samples.push_back(now_ns() - c.connect_ns);
+		}
+
+		if (events & EPOLLOUT)
+			flush(c);
+
+		if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		{
+			char buf[ECHO_LEN * 16];
+			for (;;)
+			{
+				ssize_t ret = recv(c.fd, buf, sizeof(buf), 0);
+				if (ret > 0)
+				{
+					received_ += ret;
+					consume(c, ret);
+					continue;
+				}
+				if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					break;
+				if (ret == -1)
+					perror("recv ERROR");
+				else if (c.closing)
+					close_.samples.push_back(now_ns() - c.close_ns);
+				finish(it);
+				return;
+			}
+		}
+	}
+
+	void consume(replay_conn &c, uint64_t n)
+	{
+		uint64_t now = now_ns();
+		while (n > 0 && !c.replies.empty())
+		{
+			pending_reply &r = c.replies.front();
+			uint64_t used = min(n, r.remain);
+			r.remain -= used;
+			n -= used;
+			if (r.remain == 0)
+			{
+				echo_.samples.push_back(now - r.start_ns);
+				c.replies.pop_front();
+			}
+		}
+	}
+
+	void finish(unordered_map<uint32_t, replay_conn>::iterator it)
+	{
+		close(it->second.fd);
+		conns_.erase(it);
+	}
+
+	const char *host_;
+	const char *port_;
+	const char *unix_path_;		// 不为 NULL 时连 unix socket，不用 host 和 port
+	double speed_;
+	int epollfd_;
+	char filler_[ECHO_LEN];
+	unordered_map<uint32_t, replay_conn> conns_;
+	uint64_t sent_ = 0;
+	uint64_t received_ = 0;
+
+	phase_stat connect_ = {"connect", {}};
+	phase_stat echo_ = {"echo", {}};
+	phase_stat close_ = {"close", {}};
+	phase_stat lag_ = {"schedule lag", {}};
+};
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-h host] [-p port] [-u unix_path] [-s speed] capture_file" << endl;
+	cerr << "  -u  connect to the server's --unix socket instead of tcp" << endl;
+	cerr << "  -s  replay speed, 1 replays with original timing, 10 is 10x faster" << endl;
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *host = "127.0.0.1";
+	const char *port = PORT;
+	const char *unix_path = NULL;
+	double speed = 1.0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:u:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'u': unix_path = optarg; break;
+		case 's': speed = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc || speed <= 0)
+		usage(argv[0]);
+
+	vector<replay_event> events = load_capture(argv[optind]);
+	cout << "loaded " << events.size() << " events from " << argv[optind] << endl;
+
+	replayer r(host, port, unix_path, speed);
+	r.run(events);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,379 @@
+/*
+ * resp.cpp
+ */
+
+#include "resp.h"
+#include "kv_table.h"
+
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <strings.h>
+#include <sys/types.h>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+#define RESP_MAX_INLINE (64 << 10)		// inline 命令一行最长多少
+#define RESP_MAX_ARGS (1 << 20)
+#define RESP_MAX_BULK (512 << 20)		// 跟 redis 一样，单个参数最大 512M
+
+/* 指向收到的数据里的一个参数，执行完命令之前数据不会动 */
+struct resp_arg
+{
+	const char *p;
+	size_t len;
+};
+
+struct kv_shard
+{
+	mutex lock;
+	kv_table table;
+};
+
+static vector<kv_shard*> g_shards;
+static bool g_locking = false;
+
+void kv_init(int shards)
+{
+	if (shards < 1)
+		shards = 1;
+	for (int i = 0; i < shards; ++i)
+		g_shards.push_back(new kv_shard);
+	g_locking = shards > 1;
+}
+
+/* 哈希表用低位，分片用高位，两边不相关 */
+static kv_shard *shard_of(uint64_t hash)
+{
+	return g_shards[(hash >> 32) % g_shards.size()];
+}
+
+struct shard_lock
+{
+	shard_lock(kv_shard *shard) : shard_(shard) { if (g_locking) shard_->lock.lock(); }
+	~shard_lock() { if (g_locking) shard_->lock.unlock(); }
+
+	kv_shard *shard_;
+};
+
+static void reply_status(string &out, const char *status)
+{
+	out += '+';
+	out += status;
+	out += "\r\n";
+}
+
+static void reply_error(string &out, const char *msg)
+{
+	out += "-ERR ";
+	out += msg;
+	out += "\r\n";
+}
+
+static void reply_int(string &out, long long value)
+{
+	char num[32];
+	int n = snprintf(num, sizeof(num), ":%lld\r\n", value);
+	out.append(num, n);
+}
+
+static void reply_bulk(string &out, const char *p, size_t len)
+{
+	char head[32];
+	int n = snprintf(head, sizeof(head), "$%zu\r\n", len);
+	out.append(head, n);
+	out.append(p, len);
+	out += "\r\n";
+}
+
+static void reply_nil(string &out)
+{
+	out += "$-1\r\n";
+}
+
+static void reply_wrong_args(string &out, const resp_arg &cmd)
+{
+	out += "-ERR wrong number of arguments for '";
+	out.append(cmd.p, cmd.len);
+	out += "' command\r\n";
+}
+
+/* 不允许空格和正号，溢出算错误 */
+static bool parse_ll(const char *p, size_t len, long long &value)
+{
+	if (len == 0 || len > 20)
+		return false;
+
+	bool neg = p[0] == '-';
+	size_t i = neg ? 1 : 0;
+	if (i == len)
+		return false;
+
+	unsigned long long v = 0;
+	for (; i < len; ++i)
+	{
+		if (p[i] < '0' || p[i] > '9')
+			return false;
+		unsigned d = p[i] - '0';
+		if (v > (ULLONG_MAX - d) / 10)
+			return false;
+		v = v * 10 + d;
+	}
+
+	if (neg)
+	{
+		if (v > (unsigned long long)LLONG_MAX + 1)
+			return false;
+		value = (long long)(0 - v);
+	}
+	else
+	{
+		if (v > (unsigned long long)LLONG_MAX)
+			return false;
+		value = v;
+	}
+	return true;
+}
+
+/* 解析 \r\n 结尾的整数，成功时 p 移到 \r\n 后面；数据不够返回 0，格式错误返回 -1 */
+static int parse_int_line(const char *&p, const char *end, long long &value)
+{
+	const char *cr = (const char*)memchr(p, '\r', end - p);
+	if (cr == NULL)
+		return end - p > 32 ? -1 : 0;
+	if (cr + 1 == end)
+		return 0;
+	if (cr[1] != '\n' || !parse_ll(p, cr - p, value))
+		return -1;
+	p = cr + 2;
+	return 1;
+}
+
+/* telnet 或者 redis-benchmark 的 PING_INLINE 发的是空格分开的一行 */
+static ssize_t parse_inline(const char *p, size_t len, vector<resp_arg> &args)
+{
+	const char *nl = (const char*)memchr(p, '\n', len);
+	if (nl == NULL)
+		return len > RESP_MAX_INLINE ? -1 : 0;
+
+	const char *end = nl;
+	if (end > p && end[-1] == '\r')
+		--end;
+
+	const char *q = p;
+	while (q < end)
+	{
+		while (q < end && (*q == ' ' || *q == '\t'))
+			++q;
+		const char *word = q;
+		while (q < end && *q != ' ' && *q != '\t')
+			++q;
+		if (q > word)
+			args.push_back({word, (size_t)(q - word)});
+	}
+	return nl + 1 - p;
+}
+
+/*
+ * 从 p 开始解析一个命令，返回用掉的字节数，不够一个完整命令返回 0，格式错误返回 -1
+ * 空行或者 *0 也会用掉数据，这时 args 为空
+ */
+static ssize_t parse_command(const char *p, size_t len, vector<resp_arg> &args)
+{
+	args.clear();
+	if (*p != '*')
+		return parse_inline(p, len, args);
+
+	const char *start = p, *end = p + len;
+	++p;
+	long long count;
+	int ret = parse_int_line(p, end, count);
+	if (ret <= 0)
+		return ret;
+	if (count > RESP_MAX_ARGS)
+		return -1;
+
+	for (long long i = 0; i < count; ++i)
+	{
+		if (p == end)
+			return 0;
+		if (*p != '$')
+			return -1;
+		++p;
+
+		long long bulk;
+		ret = parse_int_line(p, end, bulk);
+		if (ret <= 0)
+			return ret;
+		if (bulk < 0 || bulk > RESP_MAX_BULK)
+			return -1;
+		if (end - p < bulk + 2)
+			return 0;
+		if (p[bulk] != '\r' || p[bulk + 1] != '\n')
+			return -1;
+
+		args.push_back({p, (size_t)bulk});
+		p += bulk + 2;
+	}
+	return p - start;
+}
+
+static bool is_cmd(const resp_arg &arg, const char *name)
+{
+	size_t len = strlen(name);
+	return arg.len == len && strncasecmp(arg.p, name, len) == 0;
+}
+
+static void cmd_get(const vector<resp_arg> &args, string &out)
+{
+	const resp_arg &key = args[1];
+	uint64_t h = kv_table::hash(key.p, key.len);
+	kv_shard *shard = shard_of(h);
+
+	shard_lock lock(shard);
+	kv_entry *e = shard->table.find(h, key.p, key.len);
+	if (e)
+		reply_bulk(out, e->value(), e->vlen);
+	else
+		reply_nil(out);
+}
+
+static void cmd_set(const vector<resp_arg> &args, string &out)
+{
+	const resp_arg &key = args[1], &value = args[2];
+	uint64_t h = kv_table::hash(key.p, key.len);
+	kv_shard *shard = shard_of(h);
+
+	shard_lock lock(shard);
+	shard->table.set(h, key.p, key.len, value.p, value.len);
+	reply_status(out, "OK");
+}
+
+static void cmd_del(const vector<resp_arg> &args, string &out)
+{
+	long long deleted = 0;
+	for (size_t i = 1; i < args.size(); ++i)
+	{
+		const resp_arg &key = args[i];
+		uint64_t h = kv_table::hash(key.p, key.len);
+		kv_shard *shard = shard_of(h);
+
+		shard_lock lock(shard);
+		if (shard->table.del(h, key.p, key.len))
+			++deleted;
+	}
+	reply_int(out, deleted);
+}
+
+static void cmd_incr(const vector<resp_arg> &args, string &out)
+{
+	const resp_arg &key = args[1];
+	uint64_t h = kv_table::hash(key.p, key.len);
+	kv_shard *shard = shard_of(h);
+
+	shard_lock lock(shard);
+	long long value = 0;
+	kv_entry *e = shard->table.find(h, key.p, key.len);
+	if (e && !parse_ll(e->value(), e->vlen, value))
+	{
+		reply_error(out, "value is not an integer or out of range");
+		return;
+	}
+	if (value == LLONG_MAX)
+	{
+		reply_error(out, "increment or decrement would overflow");
+		return;
+	}
+
+	char num[32];
+	int n = snprintf(num, sizeof(num), "%lld", ++value);
+	shard->table.set(h, key.p, key.len, num, n);
+	reply_int(out, value);
+}
+
+static void execute(const vector<resp_arg> &args, string &out)
+{
+	const resp_arg &cmd = args[0];
+	if (is_cmd(cmd, "GET"))
+	{
+		if (args.size() != 2)
+			return reply_wrong_args(out, cmd);
+		cmd_get(args, out);
+	}
+	else if (is_cmd(cmd, "SET"))
+	{
+		// 不支持 EX/NX 这些选项
+		if (args.size() < 3)
+			return reply_wrong_args(out, cmd);
+		if (args.size() > 3)
+			return reply_error(out, "syntax error");
+		cmd_set(args, out);
+	}
+	else if (is_cmd(cmd, "DEL"))
+	{
+		if (args.size() < 2)
+			return reply_wrong_args(out, cmd);
+		cmd_del(args, out);
+	}
+	else if (is_cmd(cmd, "INCR"))
+	{
+		if (args.size() != 2)
+			return reply_wrong_args(out, cmd);
+		cmd_incr(args, out);
+	}
+	else if (is_cmd(cmd, "PING"))
+	{
+		if (args.size() > 2)
+			return reply_wrong_args(out, cmd);
+		if (args.size() == 2)
+			reply_bulk(out, args[1].p, args[1].len);
+		else
+			reply_status(out, "PONG");
+	}
+	else
+	{
+		// redis-benchmark 启动时会发 CONFIG GET，回错误它只是打个警告
+		out += "-ERR unknown command '";
+		for (size_t i = 0; i < cmd.len && i < 64; ++i)
+			out += (cmd.p[i] == '\r' || cmd.p[i] == '\n') ? ' ' : cmd.p[i];
+		out += "'\r\n";
+	}
+}
+
+bool kv_feed(string &in, string &out, const char *data, size_t len)
+{
+	// 大部分时候上次没有剩下半个命令，直接在收到的 buffer 上解析，不用拷贝
+	bool buffered = !in.empty();
+	if (buffered)
+	{
+		in.append(data, len);
+		data = in.data();
+		len = in.size();
+	}
+
+	static thread_local vector<resp_arg> args;
+	size_t used = 0;
+	while (used < len)
+	{
+		ssize_t n = parse_command(data + used, len - used, args);
+		if (n < 0)
+		{
+			reply_error(out, "Protocol error");
+			return false;
+		}
+		if (n == 0)
+			break;
+
+		used += n;
+		if (!args.empty())
+			execute(args, out);
+	}
+
+	if (buffered)
+		in.erase(0, used);
+	else
+		in.assign(data + used, len - used);
+	return true;
+}
@@ -0,0 +1,25 @@
+/*
+ * resp.h
+ * 兼容 redis 协议 (RESP) 的内存 kv，支持 GET/SET/DEL/INCR/PING 和 pipeline，
+ * 可以直接用 redis-benchmark、memtier 之类的工具压 epoll server
+ *
+ * 请求可以是 multibulk 也可以是 inline 命令，收到半个命令时先留在连接的 in 里，
+ * 等后面的数据到了再接着解析
+ */
+
+#ifndef __resp_h__
+#define __resp_h__
+
+#include <stddef.h>
+#include <string>
+
+/* 数据按 key 分成 shards 片，各自一把锁，只有一片时不加锁 */
+void kv_init(int shards);
+
+/*
+ * 把收到的数据里完整的命令都执行掉，回复追加到 out，剩下的半个命令留在 in 里
+ * 协议错误时返回 false，要关掉连接
+ */
+bool kv_feed(std::string &in, std::string &out, const char *data, size_t len);
+
+#endif
@@ -13,101 +13,50 @@
 #include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <netdb.h>
-#include <unordered_map>
+#include <vector>
+#include "server_core.h"
 
 using namespace std;
 
-#define PORT "12321"	// 连接端口
-#define BACKLOG 10		// 等待连接队列大小
-#define ECHO_LEN 1024
-
-/* 拿 ipv4 或者 ipv6 的 in_addr */
-const void *get_sin_addr(const sockaddr_storage *ss)
-{
-	if (ss->ss_family == AF_INET)
-		return &(((const struct sockaddr_in*)ss)->sin_addr);
-	else
-		return &(((const struct sockaddr_in6*)ss)->sin6_addr);
-}
-
-int make_sock()
+/* 阻塞 socket 上 send 也可能只发出一部分；对端已经 RST 时用 MSG_NOSIGNAL 拿 EPIPE，不然 SIGPIPE 会杀掉整个服务器 */
+static bool send_all(int sock, const char *data, size_t len)
 {
-	struct addrinfo hints, *server_addr;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;		// ipv4 or ipv6
-	hints.ai_socktype = SOCK_STREAM;	
-	hints.ai_flags = AI_PASSIVE;		// use bind
-
-	int ret = getaddrinfo(NULL, PORT, &hints, &server_addr);
-	if (ret != 0)
+	while (len > 0)
 	{
-		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl; 
-		exit(EXIT_FAILURE);
-	}
-
-	// 循环找可用的 addr
-	int server_sock;
-	struct addrinfo *p;
-	for(p = server_addr; p != NULL; p = p->ai_next)
-	{
-		server_sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (server_sock == -1)
-		{
-			perror("socket ERROR");
-			continue;
-		}
-
-		int opt = 1;
-		
-		ret = setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-		if (ret == -1)
-		{
-			perror("reuseaddr ERROR");
-			exit(EXIT_FAILURE);
-		}
-
-		ret = bind(server_sock, p->ai_addr, p->ai_addrlen);
+		ssize_t ret = send(sock, data, len, MSG_NOSIGNAL);
 		if (ret == -1)
 		{
-			close(server_sock);
-			perror("bind ERROR");
-			continue;
+			perror("send ERROR");
+			return false;
 		}
-		break;
-	}
-
-	if (p == NULL)
-	{
-		cerr << "failed to make socket!" << endl;
-		exit(EXIT_FAILURE);
-	}
-
-	freeaddrinfo(server_addr);
-
-	ret = listen(server_sock, BACKLOG);
-	if (ret == -1)
-	{
-		perror("listen ERROR");
-		exit(EXIT_FAILURE);
+		data += ret;
+		len -= ret;
 	}
+	return true;
+}
 
-	return server_sock;
+bool is_listener(const vector<int> &listeners, int sock)
+{
+	for (int fd : listeners)
+		if (fd == sock)
+			return true;
+	return false;
 }
 
-void main_loop(int server_sock)
+void main_loop(const vector<int> &listeners)
 {
 	fd_set all_sock;
 	fd_set read_sock;
-	unordered_map<int, string> sock_map;
-
-	FD_SET(server_sock, &all_sock);
-	sock_map.emplace(server_sock, "");
+	FD_ZERO(&all_sock);
 
-	int fd_max = server_sock;
+	int fd_max = 0;
+	for (int server_sock : listeners)
+	{
+		FD_SET(server_sock, &all_sock);
+		fd_max = max(fd_max, server_sock);
+	}
 
-	char buf[ECHO_LEN];
-	char addr_str[INET6_ADDRSTRLEN];
+	vector<char> buf(g_config.buffer_size);
 
 	for(;;)
 	{
@@ -119,64 +68,79 @@ void main_loop(int server_sock)
 			exit(EXIT_FAILURE);
 		}
 
-		for (auto it = sock_map.begin(); it != sock_map.end();)
+		// 按 fd 从小到大扫，就绪的 ret 个都处理完就停，本轮 accept 进来的 fd 不在 read_sock 里
+		for (int sock = 0; sock <= fd_max && ret > 0; ++sock)
 		{
-			int sock = it->first;
 			if (!FD_ISSET(sock, &read_sock))
-			{
-				++it;
 				continue;
-			}
+			--ret;
 
 			// server accept
-			if (sock == server_sock)
+			if (is_listener(listeners, sock))
 			{
-				struct sockaddr_storage client_addr;
-				socklen_t addr_size = sizeof(client_addr);
-
-				int client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_size);
+				int client_sock = accept(sock, NULL, NULL);
 				if (client_sock == -1)
 				{
 					perror("accept ERROR");
-					++it;
 					continue;
 				}
 
-				inet_ntop(client_addr.ss_family, get_sin_addr(&client_addr), addr_str, sizeof(addr_str));
-				cout << "client from " << addr_str << endl;
+				// 超过 FD_SETSIZE 的 fd 放不进 fd_set，只能拒绝
+				if (client_sock >= FD_SETSIZE)
+				{
+					cerr << "too many clients, fd " << client_sock << " >= FD_SETSIZE " << FD_SETSIZE << endl;
+					close(client_sock);
+					continue;
+				}
+
+				cout << "client from " << get_sock_addr(client_sock) << endl;
 
 				FD_SET(client_sock, &all_sock);
-				sock_map.emplace(client_sock, addr_str);
-				fd_max = client_sock;
+				fd_max = max(fd_max, client_sock);
 			}
 			// recv from client
 			else
 			{
-				ret = recv(sock, buf, ECHO_LEN, 0);
-				if (ret <= 0)
+				ssize_t n = recv(sock, buf.data(), buf.size(), 0);
+				if (n <= 0 || !send_all(sock, buf.data(), n))
 				{
-					if (ret < 0)
+					if (n < 0)
 						perror("recv ERROR");
 					else
-						cout << "client closed " << it->second << endl;
+						cout << "client closed " << get_sock_addr(sock) << endl;
 
 					close(sock);
 					FD_CLR(sock, &all_sock);
-					it = sock_map.erase(it);
+
+					// 关掉的是最大的 fd 时往下找新的最大值，不然 select 一直扫到旧的 fd_max
+					while (fd_max > 0 && !FD_ISSET(fd_max, &all_sock))
+						--fd_max;
 					continue;
 				}
-				send(sock, buf, ret, 0);
 			}
-			++it;
 		}
 	}
 }
 
-int main()
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [options]" << endl;
+	server_usage();
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
 {
-	int server_sock = make_sock();
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", server_long_options, NULL)) != -1)
+	{
+		if (!server_parse_option(opt, optarg))
+			usage(argv[0]);
+	}
+
+	vector<int> listeners = make_listeners();
 	cout << "wairting for clients..." << endl;
-	main_loop(server_sock);
+	main_loop(listeners);
 	return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,385 @@
+/*
+ * server_core.cpp
+ */
+
+#include "server_core.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+server_config g_config = {
+	NULL,					// host
+	DEFAULT_PORT,			// port
+	DEFAULT_BACKLOG,		// backlog
+	false,					// reuseport
+	false,					// dual_stack
+	0,						// defer_accept
+	0,						// fastopen
+	0,						// rcvbuf
+	0,						// sndbuf
+	DEFAULT_BUFFER_SIZE,	// buffer_size
+	NULL,					// unix_path
+	false,					// no_tcp
+};
+
+// 从 256 开始，不跟各个 server 的短选项冲突
+enum
+{
+	OPT_HOST = 256,
+	OPT_PORT,
+	OPT_BACKLOG,
+	OPT_REUSEPORT,
+	OPT_DUAL_STACK,
+	OPT_DEFER_ACCEPT,
+	OPT_FASTOPEN,
+	OPT_RCVBUF,
+	OPT_SNDBUF,
+	OPT_BUFFER_SIZE,
+	OPT_UNIX,
+	OPT_NO_TCP,
+};
+
+const struct option server_long_options[] = {
+	{"host", required_argument, NULL, OPT_HOST},
+	{"port", required_argument, NULL, OPT_PORT},
+	{"backlog", required_argument, NULL, OPT_BACKLOG},
+	{"reuseport", no_argument, NULL, OPT_REUSEPORT},
+	{"dual-stack", no_argument, NULL, OPT_DUAL_STACK},
+	{"defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT},
+	{"fastopen", required_argument, NULL, OPT_FASTOPEN},
+	{"rcvbuf", required_argument, NULL, OPT_RCVBUF},
+	{"sndbuf", required_argument, NULL, OPT_SNDBUF},
+	{"buffer-size", required_argument, NULL, OPT_BUFFER_SIZE},
+	{"unix", required_argument, NULL, OPT_UNIX},
+	{"no-tcp", no_argument, NULL, OPT_NO_TCP},
+	{NULL, 0, NULL, 0},
+};
+
+bool server_parse_option(int opt, const char *arg)
+{
+	switch (opt)
+	{
+	case OPT_HOST: g_config.host = arg; break;
+	case OPT_PORT: g_config.port = arg; break;
+	case OPT_BACKLOG: g_config.backlog = atoi(arg); break;
+	case OPT_REUSEPORT: g_config.reuseport = true; break;
+	case OPT_DUAL_STACK: g_config.dual_stack = true; break;
+	case OPT_DEFER_ACCEPT: g_config.defer_accept = atoi(arg); break;
+	case OPT_FASTOPEN: g_config.fastopen = atoi(arg); break;
+	case OPT_RCVBUF: g_config.rcvbuf = atoi(arg); break;
+	case OPT_SNDBUF: g_config.sndbuf = atoi(arg); break;
+	case OPT_BUFFER_SIZE:
+		g_config.buffer_size = strtoul(arg, NULL, 10);
+		if (g_config.buffer_size == 0)
+			return false;
+		break;
+	case OPT_UNIX:
+		if (strlen(arg) >= sizeof(((sockaddr_un*)0)->sun_path))
+			return false;
+		g_config.unix_path = arg;
+		break;
+	case OPT_NO_TCP: g_config.no_tcp = true; break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+void server_usage()
+{
+	cerr << "listener options:" << endl;
+	cerr << "  --host ADDR         bind address, default all addresses" << endl;
+	cerr << "  --port PORT         listen port, default " << DEFAULT_PORT << endl;
+	cerr << "  --backlog N         listen backlog, default " << DEFAULT_BACKLOG << endl;
+	cerr << "  --reuseport         set SO_REUSEPORT" << endl;
+	cerr << "  --dual-stack        listen on :: for both ipv4 and ipv6" << endl;
+	cerr << "  --defer-accept SEC  set TCP_DEFER_ACCEPT" << endl;
+	cerr << "  --fastopen QLEN     set TCP_FASTOPEN" << endl;
+	cerr << "  --rcvbuf BYTES      set SO_RCVBUF on the listener, inherited by clients" << endl;
+	cerr << "  --sndbuf BYTES      set SO_SNDBUF on the listener, inherited by clients" << endl;
+	cerr << "  --buffer-size BYTES size of each recv, default " << DEFAULT_BUFFER_SIZE << endl;
+	cerr << "  --unix PATH         also listen on a unix domain socket" << endl;
+	cerr << "  --no-tcp            with --unix, do not listen on tcp" << endl;
+}
+
+static void set_int_opt(int sock, int level, int name, int value, const char *msg)
+{
+	if (setsockopt(sock, level, name, &value, sizeof(value)) == -1)
+	{
+		perror(msg);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* 在 bind 之前设置，rcvbuf 要在 listen 之前设置才能影响窗口大小 */
+static void set_listener_opts(int sock, int family, int socktype)
+{
+	set_int_opt(sock, SOL_SOCKET, SO_REUSEADDR, 1, "reuseaddr ERROR");
+
+	if (g_config.reuseport)
+		set_int_opt(sock, SOL_SOCKET, SO_REUSEPORT, 1, "reuseport ERROR");
+	if (family == AF_INET6 && g_config.dual_stack)
+		set_int_opt(sock, IPPROTO_IPV6, IPV6_V6ONLY, 0, "ipv6 only ERROR");
+	if (g_config.rcvbuf > 0)
+		set_int_opt(sock, SOL_SOCKET, SO_RCVBUF, g_config.rcvbuf, "rcvbuf ERROR");
+	if (g_config.sndbuf > 0)
+		set_int_opt(sock, SOL_SOCKET, SO_SNDBUF, g_config.sndbuf, "sndbuf ERROR");
+	if (socktype != SOCK_STREAM)
+		return;
+	if (g_config.defer_accept > 0)
+		set_int_opt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, g_config.defer_accept, "defer accept ERROR");
+	if (g_config.fastopen > 0)
+		set_int_opt(sock, IPPROTO_TCP, TCP_FASTOPEN, g_config.fastopen, "fastopen ERROR");
+}
+
+static int bind_socket(int socktype)
+{
+	struct addrinfo hints, *server_addr;
+
+	memset(&hints, 0, sizeof(hints));
+	// 双栈时只要 ipv6 的地址，关掉 IPV6_V6ONLY 之后 ipv4 也能连上来
+	hints.ai_family = (g_config.dual_stack && g_config.host == NULL) ? AF_INET6 : AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	hints.ai_flags = AI_PASSIVE;		// use bind
+
+	int ret = getaddrinfo(g_config.host, g_config.port, &hints, &server_addr);
+	if (ret != 0)
+	{
+		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// 循环找可用的 addr
+	int server_sock;
+	struct addrinfo *p;
+	for(p = server_addr; p != NULL; p = p->ai_next)
+	{
+		server_sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (server_sock == -1)
+		{
+			perror("socket ERROR");
+			continue;
+		}
+
+		set_listener_opts(server_sock, p->ai_family, socktype);
+
+		ret = bind(server_sock, p->ai_addr, p->ai_addrlen);
+		if (ret == -1)
+		{
+			close(server_sock);
+			perror("bind ERROR");
+			continue;
+		}
+		break;
+	}
+
+	if (p == NULL)
+	{
+		cerr << "failed to make socket!" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	freeaddrinfo(server_addr);
+	return server_sock;
+}
+
+int make_listener()
+{
+	int server_sock = bind_socket(SOCK_STREAM);
+	if (listen(server_sock, g_config.backlog) == -1)
+	{
+		perror("listen ERROR");
+		exit(EXIT_FAILURE);
+	}
+	return server_sock;
+}
+
+int make_udp_socket()
+{
+	return bind_socket(SOCK_DGRAM);
+}
+
+int make_unix_listener()
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, g_config.unix_path, sizeof(addr.sun_path) - 1);
+
+	// 上次没退干净留下的 socket 文件会让 bind 失败，别的文件不动
+	struct stat st;
+	if (stat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(addr.sun_path);
+
+	int server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server_sock == -1)
+	{
+		perror("socket ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	// 没有 tcp 的那些选项，只有 buffer 大小有意义
+	if (g_config.rcvbuf > 0)
+		set_int_opt(server_sock, SOL_SOCKET, SO_RCVBUF, g_config.rcvbuf, "rcvbuf ERROR");
+	if (g_config.sndbuf > 0)
+		set_int_opt(server_sock, SOL_SOCKET, SO_SNDBUF, g_config.sndbuf, "sndbuf ERROR");
+
+	if (bind(server_sock, (sockaddr*)&addr, sizeof(addr)) == -1)
+	{
+		perror("bind ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	if (listen(server_sock, g_config.backlog) == -1)
+	{
+		perror("listen ERROR");
+		exit(EXIT_FAILURE);
+	}
+
+	return server_sock;
+}
+
+vector<int> make_listeners()
+{
+	if (g_config.no_tcp && g_config.unix_path == NULL)
+	{
+		cerr << "--no-tcp needs --unix" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	raise_nofile_limit();
+
+	// 没开 server 的位，TCP_FASTOPEN 照样能设上，只是 SYN 里的数据会被丢掉，退回正常握手
+	int tfo = tcp_fastopen_sysctl();
+	if (g_config.fastopen > 0 && tfo >= 0 && !(tfo & TFO_SERVER))
+		cerr << "warning: net.ipv4.tcp_fastopen is " << tfo << ", needs bit " << TFO_SERVER << " to accept fast open" << endl;
+
+	vector<int> listeners;
+	if (!g_config.no_tcp)
+		listeners.push_back(make_listener());
+	if (g_config.unix_path)
+		listeners.push_back(make_unix_listener());
+
+	for (int sock : listeners)
+		print_config(sock);
+	return listeners;
+}
+
+void print_config(int server_sock)
+{
+	char addr_str[INET6_ADDRSTRLEN];
+	sockaddr_storage addr;
+	socklen_t size = sizeof(addr);
+	getsockname(server_sock, (sockaddr*)&addr, &size);
+	if (addr.ss_family == AF_UNIX)
+	{
+		cout << "listen on unix:" << ((sockaddr_un*)&addr)->sun_path
+			<< " backlog " << g_config.backlog
+			<< " buffer_size " << g_config.buffer_size << endl;
+		return;
+	}
+
+	inet_ntop(addr.ss_family, get_sin_addr(&addr), addr_str, sizeof(addr_str));
+	int port = ntohs(addr.ss_family == AF_INET ?
+		((sockaddr_in*)&addr)->sin_port : ((sockaddr_in6*)&addr)->sin6_port);
+
+	// 内核会把设置的 buffer 大小翻倍，打印实际值
+	int rcvbuf = 0, sndbuf = 0;
+	size = sizeof(int);
+	getsockopt(server_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &size);
+	size = sizeof(int);
+	getsockopt(server_sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &size);
+
+	cout << "listen on " << addr_str << ":" << port
+		<< " backlog " << g_config.backlog
+		<< " reuseport " << g_config.reuseport
+		<< " defer_accept " << g_config.defer_accept
+		<< " fastopen " << g_config.fastopen
+		<< " rcvbuf " << rcvbuf
+		<< " sndbuf " << sndbuf
+		<< " buffer_size " << g_config.buffer_size << endl;
+}
+
+const void *get_sin_addr(const sockaddr_storage *ss)
+{
+	if (ss->ss_family == AF_INET)
+		return &(((const sockaddr_in*)ss)->sin_addr);
+	else
+		return &(((const sockaddr_in6*)ss)->sin6_addr);
+}
+
+string get_sock_addr(int sock)
+{
+	char addr_str[INET6_ADDRSTRLEN];
+	sockaddr_storage client_addr;
+	socklen_t size = sizeof(client_addr);
+	if (getpeername(sock, (sockaddr*)&client_addr, &size) == -1)
+		return "";
+	if (client_addr.ss_family == AF_UNIX)
+	{
+		struct ucred cred;
+		size = sizeof(cred);
+		if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &size) == -1)
+			return "unix";
+		return "unix pid " + to_string(cred.pid);
+	}
+	inet_ntop(client_addr.ss_family, get_sin_addr(&client_addr), addr_str, sizeof(addr_str));
+	return addr_str;
+}
+
+void setnonblocking(int fd)
+{
+	int flag = fcntl(fd, F_GETFL, 0);
+	if (flag < 0)
+	{
+		perror("fcntl F_GETFL ERROR");
+		exit(EXIT_FAILURE);
+	}
+	if (fcntl(fd, F_SETFL, flag | O_NONBLOCK) < 0)
+	{
+		perror("fcntl F_SETFL ERROR");
+		exit(EXIT_FAILURE);
+	}
+}
+
+rlim_t raise_nofile_limit()
+{
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+	{
+		perror("getrlimit ERROR");
+		exit(EXIT_FAILURE);
+	}
+	if (rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			perror("setrlimit ERROR");
+	}
+	return rl.rlim_cur;
+}
+
+int tcp_fastopen_sysctl()
+{
+	FILE *fp = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+	if (fp == NULL)
+		return -1;
+	int value = -1;
+	if (fscanf(fp, "%d", &value) != 1)
+		value = -1;
+	fclose(fp);
+	return value;
+}
@@ -0,0 +1,83 @@
+/*
+ * server_core.h
+ * 各个 echo server 共用的监听 socket 和配置，保证不同的 backend 在同样的参数下比较
+ *
+ * 配置都是长选项，各个 server 自己的选项用短选项：
+ *   getopt_long(argc, argv, "c:d", server_long_options, NULL)
+ * 不认识的选项交给 server_parse_option 处理
+ */
+
+#ifndef __server_core_h__
+#define __server_core_h__
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#define DEFAULT_PORT "12321"	// 连接端口
+#define DEFAULT_BACKLOG 10		// 等待连接队列大小
+#define DEFAULT_BUFFER_SIZE 1024
+
+struct server_config
+{
+	const char *host;		// 绑定的地址，NULL 表示所有地址
+	const char *port;
+	int backlog;
+	bool reuseport;			// SO_REUSEPORT，可以多个进程/线程各自监听同一个端口
+	bool dual_stack;		// 监听 :: 并关掉 IPV6_V6ONLY，同时接受 ipv4 和 ipv6
+	int defer_accept;		// TCP_DEFER_ACCEPT 的秒数，有数据到了才唤醒 accept，0 不开
+	int fastopen;			// TCP_FASTOPEN 的队列长度，0 不开
+	int rcvbuf;				// SO_RCVBUF，0 用系统默认
+	int sndbuf;				// SO_SNDBUF，0 用系统默认
+	size_t buffer_size;		// 每次 recv 用的 buffer 大小
+	const char *unix_path;	// 同时监听这个 unix socket 路径，NULL 不监听
+	bool no_tcp;			// 只监听 unix socket
+};
+
+extern server_config g_config;
+
+/* 以 0 结尾，可以直接传给 getopt_long */
+extern const struct option server_long_options[];
+
+/* getopt_long 返回的是核心选项时处理掉并返回 true */
+bool server_parse_option(int opt, const char *arg);
+
+/* 打印核心选项的说明，给各个 server 的 usage 用 */
+void server_usage();
+
+/* 按 g_config 创建监听 socket，失败直接退出 */
+int make_listener();
+
+/* 按 g_config 创建绑定好的 udp socket，tcp 才有的选项不设，多个线程各绑一个时要开 --reuseport */
+int make_udp_socket();
+
+/* 在 g_config.unix_path 上创建 AF_UNIX 监听 socket，路径上残留的 socket 文件会先删掉 */
+int make_unix_listener();
+
+/* 按配置创建 tcp 和 unix 的监听 socket，并打印各自的参数，顺便调高 fd 上限 */
+std::vector<int> make_listeners();
+
+/* 把监听参数打印出来，方便对比测试结果 */
+void print_config(int server_sock);
+
+/* 拿 ipv4 或者 ipv6 的 in_addr */
+const void *get_sin_addr(const sockaddr_storage *ss);
+
+/* 对端的地址，unix socket 没有地址，返回对端的 pid */
+std::string get_sock_addr(int sock);
+
+void setnonblocking(int fd);
+
+/* 把 fd 的软上限调到硬上限，上万个连接时默认的 1024 不够用，返回调整后的上限 */
+rlim_t raise_nofile_limit();
+
+#define TFO_CLIENT 1			// net.ipv4.tcp_fastopen 的位：允许 client 在 SYN 里带数据
+#define TFO_SERVER 2			// 允许 server 接受 SYN 里的数据
+
+/* 读 /proc/sys/net/ipv4/tcp_fastopen，读不到返回 -1 */
+int tcp_fastopen_sysctl();
+
+#endif
@@ -0,0 +1,595 @@
+/*
+ * stress_client.cpp
+ * echo server 的压力和长时间稳定性测试：同时开几千个连接，每个连接是一个有限长度的流，
+ * 消息大小随机，一部分流发完后半关闭，一部分流是慢读的，流结束后马上换一个新的流继续
+ *
+ * 每个流的每个字节都由流的编号和字节的偏移算出来，收到的数据逐字节核对，
+ * 丢数据、错位、串到别的连接上都能发现；服务器提前关连接或者很久没有进展也算错误
+ *
+ * 定期报告吞吐和服务器的 RSS，跟第一次报告比，看长时间运行有没有变慢或者内存涨
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <ctime>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "server_core.h"
+
+using namespace std;
+
+#define PORT "12321"				// 连接端口
+#define STRESS_CONNS 1000
+#define STRESS_MAX_MSG 16384		// 每条消息最大多少字节
+#define STRESS_MAX_STREAM (4 << 20)	// 每个流最多发多少字节，然后关掉换一个新的流
+#define STRESS_WINDOW (256 << 10)	// 发出去还没收回来的最多多少字节
+#define STRESS_HALF_CLOSE 20		// 百分之多少的流发完后先 shutdown 写端，等服务器回完再关
+#define STRESS_SLOW 5				// 百分之多少的流是慢读的
+#define STRESS_STALL 30				// 一个流多少秒没有进展算卡住
+#define STRESS_INTERVAL 10			// 每隔多少秒报告一次
+#define STRESS_TICK_MS 50			// 检查暂停和卡住的流的间隔
+#define STRESS_MAX_ERRORS_SHOWN 20	// 错误太多时只打印前面几条
+
+struct stream_t
+{
+	int fd = -1;
+	uint64_t key = 0;			// 决定这个流的每一个字节，每个新的流都不一样
+	bool connected = false;
+	bool half_close = false;	// 发完之后 shutdown 写端，等服务器关连接
+	bool shut = false;			// 已经 shutdown 写端
+	bool slow = false;
+	uint64_t paused_until = 0;	// 慢读的流暂停读到这个时间
+	uint64_t total = 0;			// 这个流一共发多少字节
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	uint64_t msg_left = 0;		// 当前这条消息还有多少没发
+	uint64_t last_progress = 0;
+	uint32_t events = 0;		// 注册在 epoll 里的事件
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* splitmix64，同样的输入总是得到同样的输出 */
+static uint64_t mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/*
+ * 流 key 从偏移 off 开始的 len 个字节，每 8 个字节由 key 和字的序号算出来，
+ * 发送和核对用的是同一个函数，字节序无所谓
+ */
+static void fill_stream(char *buf, uint64_t key, uint64_t off, size_t len)
+{
+	size_t i = 0;
+	while (i < len)
+	{
+		uint64_t word = mix(key ^ ((off + i) >> 3));
+		unsigned b = (off + i) & 7;
+		if (b == 0 && len - i >= 8)
+		{
+			memcpy(buf + i, &word, 8);
+			i += 8;
+			continue;
+		}
+		char bytes[8];
+		memcpy(bytes, &word, 8);
+		for (; b < 8 && i < len; ++b, ++i)
+			buf[i] = bytes[b];
+	}
+}
+
+int connect_server(const char *host, const char *port)
+{
+	struct addrinfo hints, *server_addr;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(host, port, &hints, &server_addr);
+	if (ret != 0)
+	{
+		cerr << "getaddrinfo ERROR: " << gai_strerror(ret) << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int sock = -1;
+	for (struct addrinfo *p = server_addr; p != NULL; p = p->ai_next)
+	{
+		sock = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+		if (sock == -1)
+			continue;
+
+		ret = connect(sock, p->ai_addr, p->ai_addrlen);
+		if (ret == 0 || errno == EINPROGRESS)
+			break;
+
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(server_addr);
+	return sock;
+}
+
+/* unix socket 的 connect 不会 EINPROGRESS，backlog 满了返回 EAGAIN，当成失败下次再连 */
+int connect_unix(const char *path)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock == -1)
+		return -1;
+	if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == -1)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* 服务器进程当前的 RSS，单位 KB，读不到返回 0 */
+uint64_t read_rss(int pid)
+{
+	ifstream status("/proc/" + to_string(pid) + "/status");
+	string line;
+	while (getline(status, line))
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			return strtoull(line.c_str() + 6, NULL, 10);
+	return 0;
+}
+
+volatile sig_atomic_t g_stop = 0;
+
+void on_signal(int sig)
+{
+	g_stop = 1;
+}
+
+struct stress_options
+{
+	const char *host = "127.0.0.1";
+	const char *port = PORT;
+	const char *unix_path = NULL;
+	int conns = STRESS_CONNS;
+	size_t max_msg = STRESS_MAX_MSG;
+	uint64_t max_stream = STRESS_MAX_STREAM;
+	uint64_t window = STRESS_WINDOW;
+	int half_close = STRESS_HALF_CLOSE;
+	int slow = STRESS_SLOW;
+	int stall = STRESS_STALL;
+	int interval = STRESS_INTERVAL;
+	int duration = 0;			// 秒，0 表示一直跑到 ctrl-c
+	int server_pid = 0;			// 不为 0 时报告这个进程的 RSS
+	uint64_t seed = 0;
+};
+
+class stresser
+{
+public:
+	stresser(const stress_options &opt)
+		: opt_(opt), streams_(opt.conns), rand_(opt.seed), next_key_(~opt.seed)
+	{
+		epollfd_ = epoll_create1(0);
+		if (epollfd_ == -1)
+		{
+			perror("epoll_create ERROR");
+			exit(EXIT_FAILURE);
+		}
+		sendbuf_.resize(opt.max_msg);
+		recvbuf_.resize(max<size_t>(opt.max_msg, 64 << 10));
+		expect_.resize(recvbuf_.size());
+	}
+
+	/* 有错误时返回 false */
+	bool run()
+	{
+		uint64_t start = now_ns();
+		uint64_t end = opt_.duration ? start + opt_.duration * 1000000000ULL : 0;
+		uint64_t next_report = start + opt_.interval * 1000000000ULL;
+		uint64_t last_report = start;
+		vector<epoll_event> evs(1024);
+
+		for (size_t i = 0; i < streams_.size(); ++i)
+			start_stream(i, start);
+
+		while (!g_stop && (end == 0 || now_ns() < end))
+		{
+			int nfds = epoll_wait(epollfd_, evs.data(), evs.size(), STRESS_TICK_MS);
+			if (nfds == -1)
+			{
+				if (errno == EINTR)
+					continue;
+				perror("epoll_wait ERROR");
+				exit(EXIT_FAILURE);
+			}
+
+			uint64_t now = now_ns();
+			for (int n = 0; n < nfds; ++n)
+				on_event(evs[n].data.u32, evs[n].events, now);
+
+			tick(now);
+			if (now >= next_report)
+			{
+				report(now - start, now - last_report);
+				last_report = now;
+				next_report += opt_.interval * 1000000000ULL;
+			}
+		}
+
+		uint64_t now = now_ns();
+		if (now > last_report + 1000000000ULL)
+			report(now - start, now - last_report);
+		cout << "total " << streams_done_ << " streams, " << total_bytes_ / 1e6 << " MB echoed in "
+			<< (now - start) / 1e9 << "s, " << errors_ << " errors, " << connect_failures_ << " connect failures" << endl;
+		return errors_ == 0;
+	}
+
+private:
+	uint64_t rand_next()
+	{
+		rand_ = mix(rand_);
+		return rand_;
+	}
+
+	bool chance(int percent)
+	{
+		return (int)(rand_next() % 100) < percent;
+	}
+
+	void start_stream(uint32_t i, uint64_t now)
+	{
+		stream_t &s = streams_[i];
+		s = stream_t();
+		s.fd = opt_.unix_path ? connect_unix(opt_.unix_path) : connect_server(opt_.host, opt_.port);
+		s.last_progress = now;
+		if (s.fd == -1)
+		{
+			// 下一个 tick 再试
+			++connect_failures_;
+			return;
+		}
+
+		// key 是随机的 64 位数，两个流的 key 异或上字序号撞到一起的概率可以忽略
+		s.key = mix(next_key_++);
+		s.connected = opt_.unix_path != NULL;
+		s.half_close = chance(opt_.half_close);
+		s.slow = chance(opt_.slow);
+		s.total = 1 + rand_next() % opt_.max_stream;
+
+		struct epoll_event ev;
+		ev.events = s.events = EPOLLIN | EPOLLOUT;
+		ev.data.u32 = i;
+		if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, s.fd, &ev) == -1)
+		{
+			perror("epoll_ctl ERROR");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	void end_stream(uint32_t i)
+	{
+		stream_t &s = streams_[i];
+		close(s.fd);
+		s.fd = -1;
+	}
+
+	void fail(uint32_t i, const string &msg)
+	{
+		stream_t &s = streams_[i];
+		if (++errors_ <= STRESS_MAX_ERRORS_SHOWN)
+			cerr << "stream " << hex << s.key << dec << ": " << msg
+				<< " (sent " << s.sent << "/" << s.total << ", received " << s.received
+				<< (s.half_close ? ", half close" : "") << (s.slow ? ", slow" : "") << ")" << endl;
+		end_stream(i);
+	}
+
+	/* 按当前状态算要等的事件，变了才改 epoll */
+	void update_events(uint32_t i)
+	{
+		stream_t &s = streams_[i];
+		uint32_t want = 0;
+		if (s.paused_until == 0)
+			want |= EPOLLIN;
+		if (!s.connected || (s.sent < s.total && s.sent - s.received < opt_.window))
+			want |= EPOLLOUT;
+		if (want == s.events)
+			return;
+
+		struct epoll_event ev;
+		ev.events = s.events = want;
+		ev.data.u32 = i;
+		if (epoll_ctl(epollfd_, EPOLL_CTL_MOD, s.fd, &ev) == -1)
+			perror("epoll_ctl mod ERROR");
+	}
+
+	void on_event(uint32_t i, uint32_t events, uint64_t now)
+	{
+		stream_t &s = streams_[i];
+		if (s.fd == -1)
+			return;
+
+		if (!s.connected)
+		{
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err)
+			{
+				++connect_failures_;
+				end_stream(i);
+				return;
+			}
+			if (!(events & (EPOLLOUT | EPOLLIN)))
+				return;
+			s.connected = true;
+			s.last_progress = now;
+		}
+
+		if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && s.paused_until == 0 && !do_recv(i, now))
+			return;
+		if ((events & EPOLLOUT) && !do_send(i, now))
+			return;
+		update_events(i);
+	}
+
+	/* 一条消息分几次 send 发完，受窗口限制，发完整个流之后半关闭 */
+	bool do_send(uint32_t i, uint64_t now)
+	{
+		stream_t &s = streams_[i];
+		while (s.sent < s.total && s.sent - s.received < opt_.window)
+		{
+			if (s.msg_left == 0)
+				s.msg_left = min<uint64_t>(1 + rand_next() % opt_.max_msg, s.total - s.sent);
+
+			size_t len = min<uint64_t>(s.msg_left, opt_.window - (s.sent - s.received));
+			fill_stream(sendbuf_.data(), s.key, s.sent, len);
+			ssize_t ret = send(s.fd, sendbuf_.data(), len, MSG_NOSIGNAL);
+			if (ret == -1)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return true;
+				fail(i, string("send ERROR: ") + strerror(errno));
+				return false;
+			}
+			s.sent += ret;
+			s.msg_left -= ret;
+			s.last_progress = now;
+		}
+
+		if (s.sent == s.total && s.half_close && !s.shut)
+		{
+			shutdown(s.fd, SHUT_WR);
+			s.shut = true;
+		}
+		return true;
+	}
+
+	/* 收到的每个字节都跟应该回来的比，流结束时换一个新的流 */
+	bool do_recv(uint32_t i, uint64_t now)
+	{
+		stream_t &s = streams_[i];
+		for (;;)
+		{
+			ssize_t ret = recv(s.fd, recvbuf_.data(), recvbuf_.size(), 0);
+			if (ret == -1)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				fail(i, string("recv ERROR: ") + strerror(errno));
+				return false;
+			}
+			if (ret == 0)
+			{
+				// 只有半关闭的流在收完所有数据之后才应该看到服务器关连接
+				if (!s.half_close || s.received < s.total)
+				{
+					fail(i, "server closed early, lost " + to_string(s.sent - s.received) + " bytes");
+					return false;
+				}
+				finish(i, now);
+				return false;
+			}
+
+			if (s.received + ret > s.sent)
+			{
+				fail(i, "received " + to_string(s.received + ret - s.sent) + " bytes more than sent");
+				return false;
+			}
+			fill_stream(expect_.data(), s.key, s.received, ret);
+			if (memcmp(recvbuf_.data(), expect_.data(), ret) != 0)
+			{
+				size_t k = 0;
+				while (recvbuf_[k] == expect_[k])
+					++k;
+				fail(i, "mismatch at byte " + to_string(s.received + k));
+				return false;
+			}
+			s.received += ret;
+			received_bytes_ += ret;
+			s.last_progress = now;
+
+			if (s.received == s.total && !s.half_close)
+			{
+				finish(i, now);
+				return false;
+			}
+
+			// 慢读的流时不时停一会不读，让服务器那边的写队列堆起来
+			if (s.slow && rand_next() % 8 == 0)
+			{
+				s.paused_until = now + (10 + rand_next() % 490) * 1000000ULL;
+				break;
+			}
+		}
+		return true;
+	}
+
+	void finish(uint32_t i, uint64_t now)
+	{
+		++streams_done_;
+		end_stream(i);
+		start_stream(i, now);
+	}
+
+	/* 恢复暂停的慢读流，重连失败的流，找出卡住的流 */
+	void tick(uint64_t now)
+	{
+		uint64_t stall_ns = opt_.stall * 1000000000ULL;
+		for (uint32_t i = 0; i < streams_.size(); ++i)
+		{
+			stream_t &s = streams_[i];
+			if (s.fd == -1)
+			{
+				start_stream(i, now);
+				continue;
+			}
+			if (s.paused_until && now >= s.paused_until)
+			{
+				s.paused_until = 0;
+				s.last_progress = now;
+				update_events(i);
+			}
+			else if (s.paused_until == 0 && now - s.last_progress > stall_ns)
+			{
+				fail(i, s.connected ? "stalled" : "connect timeout");
+			}
+		}
+	}
+
+	void report(uint64_t elapsed_ns, uint64_t period_ns)
+	{
+		double mbps = received_bytes_ / 1e6 / (period_ns / 1e9);
+		total_bytes_ += received_bytes_;
+		received_bytes_ = 0;
+		if (first_mbps_ == 0)
+			first_mbps_ = mbps;
+
+		int open = 0;
+		for (auto &s : streams_)
+			if (s.fd != -1)
+				++open;
+
+		cout << "[" << setw(6) << elapsed_ns / 1000000000 << "s] " << fixed << setprecision(1)
+			<< mbps << " MB/s (" << showpos << (mbps / first_mbps_ - 1) * 100 << noshowpos << "%)"
+			<< " streams " << streams_done_ << " open " << open << " errors " << errors_;
+		if (opt_.server_pid)
+		{
+			uint64_t rss = read_rss(opt_.server_pid);
+			if (first_rss_ == 0)
+				first_rss_ = rss;
+			cout << " rss " << rss / 1024.0 << "M (" << showpos << ((int64_t)rss - (int64_t)first_rss_) / 1024.0
+				<< noshowpos << "M)";
+		}
+		cout << defaultfloat << setprecision(6) << endl;
+	}
+
+	stress_options opt_;
+	int epollfd_;
+	vector<stream_t> streams_;
+	uint64_t rand_;
+	uint64_t next_key_;
+	vector<char> sendbuf_;
+	vector<char> recvbuf_;
+	vector<char> expect_;
+
+	uint64_t streams_done_ = 0;
+	uint64_t errors_ = 0;
+	uint64_t connect_failures_ = 0;
+	uint64_t received_bytes_ = 0;	// 这个报告周期的
+	uint64_t total_bytes_ = 0;
+	double first_mbps_ = 0;
+	uint64_t first_rss_ = 0;
+};
+
+void usage(const char *prog)
+{
+	cerr << "usage: " << prog << " [-h host] [-p port] [-u unix_path] [-c conns] [-s max_msg] [-l max_stream] [-w window]"
+		<< " [-q half_close%] [-r slow%] [-t stall] [-i interval] [-d duration] [-P server_pid] [-S seed]" << endl;
+	cerr << "  -u  connect to the server's --unix socket instead of tcp" << endl;
+	cerr << "  -c  concurrent connections, default " << STRESS_CONNS << "; start the server with a big --backlog" << endl;
+	cerr << "  -s  message sizes are random in [1, max_msg], default " << STRESS_MAX_MSG << endl;
+	cerr << "  -l  each stream sends a random length in [1, max_stream] then reconnects, default " << STRESS_MAX_STREAM << endl;
+	cerr << "  -w  bytes in flight per stream, default " << STRESS_WINDOW << endl;
+	cerr << "  -q  percent of streams that shutdown the write side when done, default " << STRESS_HALF_CLOSE << endl;
+	cerr << "  -r  percent of streams that stop reading now and then, default " << STRESS_SLOW << endl;
+	cerr << "  -t  seconds without progress before a stream counts as stalled, default " << STRESS_STALL << endl;
+	cerr << "  -i  report every interval seconds, default " << STRESS_INTERVAL << endl;
+	cerr << "  -d  stop after duration seconds, default run until ctrl-c" << endl;
+	cerr << "  -P  report the RSS of this server process" << endl;
+	cerr << "  -S  random seed, default from the clock" << endl;
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	stress_options opt;
+	opt.seed = now_ns();
+
+	int ch;
+	while ((ch = getopt(argc, argv, "h:p:u:c:s:l:w:q:r:t:i:d:P:S:")) != -1)
+	{
+		switch (ch)
+		{
+		case 'h': opt.host = optarg; break;
+		case 'p': opt.port = optarg; break;
+		case 'u': opt.unix_path = optarg; break;
+		case 'c': opt.conns = atoi(optarg); break;
+		case 's': opt.max_msg = strtoul(optarg, NULL, 10); break;
+		case 'l': opt.max_stream = strtoull(optarg, NULL, 10); break;
+		case 'w': opt.window = strtoull(optarg, NULL, 10); break;
+		case 'q': opt.half_close = atoi(optarg); break;
+		case 'r': opt.slow = atoi(optarg); break;
+		case 't': opt.stall = atoi(optarg); break;
+		case 'i': opt.interval = atoi(optarg); break;
+		case 'd': opt.duration = atoi(optarg); break;
+		case 'P': opt.server_pid = atoi(optarg); break;
+		case 'S': opt.seed = strtoull(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (opt.conns <= 0 || opt.max_msg == 0 || opt.max_stream == 0 || opt.window == 0
+		|| opt.stall <= 0 || opt.interval <= 0 || opt.duration < 0)
+		usage(argv[0]);
+
+	// 两端都是几千个连接，默认的 fd 上限不够
+	rlim_t nofile = raise_nofile_limit();
+	if ((rlim_t)opt.conns + 16 > nofile)
+	{
+		cerr << "need " << opt.conns + 16 << " fds, limit is " << nofile << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	cout << opt.conns << " connections, messages up to " << opt.max_msg << " bytes, streams up to " << opt.max_stream
+		<< " bytes, window " << opt.window << ", " << opt.half_close << "% half close, " << opt.slow << "% slow, seed "
+		<< opt.seed << endl;
+
+	stresser s(opt);
+	return s.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
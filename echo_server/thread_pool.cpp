@@ -0,0 +1,105 @@
+/*
+ * thread_pool.cpp
+ * 一把锁管空闲列表，停着的线程各自等在自己的条件变量上，交任务只叫醒一个，不会惊群
+ */
+
+#include "thread_pool.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+using namespace std;
+
+thread_pool::thread_pool(size_t stack_size, int prestart)
+	: threads_(0)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (stack_size < (size_t)PTHREAD_STACK_MIN)
+		stack_size = PTHREAD_STACK_MIN;
+	stack_size_ = (stack_size + page - 1) / page * page;
+
+	pthread_attr_init(&attr_);
+	pthread_attr_setstacksize(&attr_, stack_size_);
+	pthread_attr_setdetachstate(&attr_, PTHREAD_CREATE_DETACHED);
+
+	for (int i = 0; i < prestart; ++i)
+	{
+		if (!spawn(NULL, NULL))
+			break;
+	}
+}
+
+bool thread_pool::run(task_fn fn, void *arg)
+{
+	{
+		lock_guard<mutex> guard(lock_);
+		if (!idle_.empty())
+		{
+			worker *w = idle_.back();
+			idle_.pop_back();
+			w->fn = fn;
+			w->arg = arg;
+			w->wake.notify_one();
+			return true;
+		}
+	}
+	return spawn(fn, arg);
+}
+
+size_t thread_pool::threads()
+{
+	lock_guard<mutex> guard(lock_);
+	return threads_;
+}
+
+size_t thread_pool::idle()
+{
+	lock_guard<mutex> guard(lock_);
+	return idle_.size();
+}
+
+/* 带着第一个任务新建，fn 是 NULL 时建好就停着 */
+bool thread_pool::spawn(task_fn fn, void *arg)
+{
+	worker *w = new worker;
+	w->pool = this;
+	w->fn = fn;
+	w->arg = arg;
+
+	pthread_t thread;
+	int ret = pthread_create(&thread, &attr_, worker_main, w);
+	if (ret != 0)
+	{
+		delete w;
+		errno = ret;
+		return false;
+	}
+
+	lock_guard<mutex> guard(lock_);
+	++threads_;
+	return true;
+}
+
+void *thread_pool::worker_main(void *arg)
+{
+	worker *w = (worker*)arg;
+	thread_pool *pool = w->pool;
+	unique_lock<mutex> lock(pool->lock_);
+	for (;;)
+	{
+		if (w->fn == NULL)
+		{
+			pool->idle_.push_back(w);
+			while (w->fn == NULL)
+				w->wake.wait(lock);
+		}
+
+		task_fn fn = w->fn;
+		void *task_arg = w->arg;
+		lock.unlock();
+		fn(task_arg);
+		lock.lock();
+		w->fn = NULL;
+	}
+	return NULL;
+}
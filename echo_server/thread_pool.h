@@ -0,0 +1,62 @@
+/*
+ * thread_pool.h
+ * 阻塞模型用的线程池：一个任务占着一个线程直到跑完，比如一个连接从 accept 到关闭；
+ * 跑完的线程不退出，停在池子里等下一个任务，省掉每个连接 clone 一个线程或者 fork 一个进程，
+ * 没有空闲的线程时才新建，线程数跟着同时在跑的任务数走，不设上限
+ *
+ * 线程栈可以设得很小：栈是 mmap 出来的，RSS 只算真正碰过的页，上万个线程的地址空间也不会太大，
+ * 但任务里就不能在栈上放大数组，也不能递归太深：
+ *   thread_pool pool(64 << 10, 16);
+ *   if (!pool.run(serve, (void*)(intptr_t)client_sock))
+ *       close(client_sock);
+ */
+
+#ifndef __thread_pool_h__
+#define __thread_pool_h__
+
+#include <stddef.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+
+#define THREAD_POOL_STACK (64 << 10)
+
+class thread_pool
+{
+public:
+	typedef void (*task_fn)(void *arg);
+
+	/* stack_size 会调到 PTHREAD_STACK_MIN 以上并按页对齐，prestart 个线程先建好停着 */
+	explicit thread_pool(size_t stack_size = THREAD_POOL_STACK, int prestart = 0);
+
+	/* 交给一个停着的线程，没有就新建一个；建线程失败返回 false，errno 是 pthread_create 的错误 */
+	bool run(task_fn fn, void *arg);
+
+	size_t stack_size() const { return stack_size_; }
+	size_t threads();
+	size_t idle();
+
+private:
+	thread_pool(const thread_pool&);
+	thread_pool &operator=(const thread_pool&);
+
+	struct worker
+	{
+		thread_pool *pool;
+		task_fn fn;						// NULL 表示停着等任务
+		void *arg;
+		std::condition_variable wake;	// 每个线程一个，交任务时只叫醒拿到任务的那个
+	};
+
+	static void *worker_main(void *arg);
+	bool spawn(task_fn fn, void *arg);
+
+	size_t stack_size_;
+	pthread_attr_t attr_;
+	std::mutex lock_;
+	std::vector<worker*> idle_;			// 后停下的先用，栈和 worker 还在缓存里
+	size_t threads_;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * trace.cpp
+ * 每个线程第一次记录时分配自己的环形缓冲，之后写记录不加锁，
+ * 只有分配缓冲和导出的时候才拿锁
+ */
+
+#include "trace.h"
+
+#include <iostream>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+#define TRACE_CALIBRATE_US 20000	// 测 TSC 频率用的时间
+
+struct trace_event
+{
+	const char *name;
+	uint64_t begin;
+	uint64_t end;
+};
+
+struct trace_ring
+{
+	trace_event *events;
+	size_t mask;
+	atomic<uint64_t> head;	// 一共写过多少条，只有本线程写
+	uint64_t dumped;		// 导出到哪里了，只有导出的线程读写
+	long tid;
+};
+
+atomic<bool> g_trace_on(false);
+__thread const char *volatile t_trace_phase = NULL;
+
+static const char *g_path = NULL;
+static size_t g_records = 0;
+static double g_ns_per_tick = 1;
+static uint64_t g_base_tick = 0;		// 导出的时间从这里算起
+static mutex g_lock;
+static vector<trace_ring*> g_rings;
+static atomic<int> g_toggle(0);
+static thread_local trace_ring *t_ring = NULL;
+
+static uint64_t mono_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_init(const char *path, size_t records_per_thread)
+{
+	g_path = path;
+	g_records = 1;
+	while (g_records < records_per_thread)
+		g_records <<= 1;
+
+	// 现在的 cpu 都是 constant_tsc，频率测一次就够了
+	uint64_t ns0 = mono_ns(), tick0 = trace_now();
+	usleep(TRACE_CALIBRATE_US);
+	uint64_t ns1 = mono_ns(), tick1 = trace_now();
+	g_ns_per_tick = (double)(ns1 - ns0) / (tick1 - tick0);
+	g_base_tick = tick0;
+}
+
+static trace_ring *new_ring()
+{
+	trace_ring *ring = new trace_ring;
+	ring->events = new trace_event[g_records];
+	ring->mask = g_records - 1;
+	ring->head = 0;
+	ring->dumped = 0;
+	ring->tid = syscall(SYS_gettid);
+
+	lock_guard<mutex> guard(g_lock);
+	g_rings.push_back(ring);
+	return ring;
+}
+
+void trace_record(const char *name, uint64_t begin, uint64_t end)
+{
+	if (t_ring == NULL)
+		t_ring = new_ring();
+
+	uint64_t head = t_ring->head.load(memory_order_relaxed);
+	trace_event &ev = t_ring->events[head & t_ring->mask];
+	ev.name = name;
+	ev.begin = begin;
+	ev.end = end;
+	t_ring->head.store(head + 1, memory_order_release);
+}
+
+/* 关掉之后别的线程最多还在写一条，写满一圈时最旧的那条可能正被覆盖，跳过它 */
+static size_t dump(FILE *fp)
+{
+	int pid = getpid();
+	size_t count = 0;
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (size_t i = 0; i < g_rings.size(); ++i)
+	{
+		trace_ring *ring = g_rings[i];
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"thread %zu\"}}",
+			i ? ",\n" : "", pid, ring->tid, i);
+
+		uint64_t head = ring->head.load(memory_order_acquire);
+		uint64_t from = ring->dumped;
+		if (head - from >= g_records)
+			from = head - g_records + 1;
+		for (; from < head; ++from)
+		{
+			const trace_event &ev = ring->events[from & ring->mask];
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}",
+				ev.name, pid, ring->tid, (int64_t)(ev.begin - g_base_tick) * g_ns_per_tick / 1000,
+				(int64_t)(ev.end - ev.begin) * g_ns_per_tick / 1000);
+			++count;
+		}
+		ring->dumped = head;
+	}
+	fprintf(fp, "\n]}\n");
+	return count;
+}
+
+bool trace_toggle()
+{
+	if (g_path == NULL)
+		return false;
+
+	lock_guard<mutex> guard(g_lock);
+	if (!g_trace_on.load(memory_order_relaxed))
+	{
+		// 上次关掉之后残留的记录不要
+		for (trace_ring *ring : g_rings)
+			ring->dumped = ring->head.load(memory_order_acquire);
+		g_trace_on.store(true, memory_order_relaxed);
+		cout << "trace on" << endl;
+		return true;
+	}
+
+	g_trace_on.store(false, memory_order_relaxed);
+	FILE *fp = fopen(g_path, "w");
+	if (fp == NULL)
+	{
+		perror("trace open ERROR");
+		return false;
+	}
+	size_t count = dump(fp);
+	fclose(fp);
+	cout << "trace off, " << count << " events written to " << g_path << endl;
+	return false;
+}
+
+void trace_signal(int sig)
+{
+	g_toggle.store(1, memory_order_relaxed);
+}
+
+/* 多个线程都可能被信号打断，只让一个线程去切换 */
+void trace_check()
+{
+	if (g_toggle.load(memory_order_relaxed) && g_toggle.exchange(0))
+		trace_toggle();
+}
@@ -0,0 +1,87 @@
+/*
+ * trace.h
+ * 给 loop 的各个阶段（epoll_wait、accept、recv、send、打日志）打点，看 p99 的时间花在哪里
+ *
+ * 每个线程一个环形缓冲，只记 TSC 的起止时间和阶段名字，写满了覆盖最旧的；
+ * 关掉追踪时把所有线程的记录导出成 Chrome trace-event 的 JSON，用 chrome://tracing 或者 Perfetto 打开
+ *
+ * 没开的时候每个打点只多一次读全局变量的判断，再加上给 watchdog 记当前阶段的两次写：
+ *   TRACE_SCOPE("recv");
+ */
+
+#ifndef __trace_h__
+#define __trace_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#else
+#include <ctime>
+#endif
+
+#define TRACE_DEFAULT_RECORDS (1 << 16)		// 每个线程保留最近多少条记录
+
+extern std::atomic<bool> g_trace_on;
+
+/* 当前线程最里层的阶段，不管追踪开没开都记，loop 卡住时 watchdog 在信号处理函数里读 */
+extern __thread const char *volatile t_trace_phase;
+
+inline uint64_t trace_now()
+{
+#ifdef __x86_64__
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* 设置导出文件，并测出 TSC 的频率，要在线程启动前调用；不调用时开关没有作用 */
+void trace_init(const char *path, size_t records_per_thread = TRACE_DEFAULT_RECORDS);
+
+/* name 要是常量字符串，只保存指针 */
+void trace_record(const char *name, uint64_t begin, uint64_t end);
+
+/*
+ * 打开或者关掉追踪，关掉时把上次打开以来的记录写到文件里，返回切换之后的状态
+ * 会写文件，不能在信号处理函数里调用
+ */
+bool trace_toggle();
+
+/* 信号处理函数里只设标记，loop 里再调用 trace_check 去切换 */
+void trace_signal(int sig);
+void trace_check();
+
+class trace_scope
+{
+public:
+	explicit trace_scope(const char *name)
+		: name_(name), prev_(t_trace_phase), begin_(__builtin_expect(g_trace_on.load(std::memory_order_relaxed), 0) ? trace_now() : 0)
+	{
+		t_trace_phase = name;
+	}
+
+	~trace_scope()
+	{
+		t_trace_phase = prev_;
+		if (__builtin_expect(begin_ != 0, 0))
+			trace_record(name_, begin_, trace_now());
+	}
+
+private:
+	trace_scope(const trace_scope&);
+	trace_scope &operator=(const trace_scope&);
+
+	const char *name_;
+	const char *prev_;
+	uint64_t begin_;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif
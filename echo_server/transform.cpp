@@ -0,0 +1,119 @@
+/*
+ * transform.cpp
+ */
+
+#include "transform.h"
+
+#include <cstring>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+using namespace std;
+
+#define CRC32C_POLY 0x82f63b78		// Castagnoli 多项式，反转位序
+
+static uint32_t g_crc32c_table[256];
+
+static void crc32c_init_table()
+{
+	for (uint32_t i = 0; i < 256; ++i)
+	{
+		uint32_t crc = i;
+		for (int k = 0; k < 8; ++k)
+			crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+		g_crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c_sw(uint32_t state, const char *data, size_t len)
+{
+	uint32_t crc = ~state;
+	const uint8_t *p = (const uint8_t*)data;
+	for (size_t i = 0; i < len; ++i)
+		crc = (crc >> 8) ^ g_crc32c_table[(crc ^ p[i]) & 0xff];
+	return ~crc;
+}
+
+#ifdef __x86_64__
+/* SSE4.2 的 crc32 指令一次算 8 个字节，编译时不要求 -msse4.2，运行时检查 cpu 再用 */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t state, const char *data, size_t len)
+{
+	uint64_t crc = ~state;
+	const char *end = data + len;
+	for (; end - data >= 8; data += 8)
+	{
+		uint64_t v;
+		memcpy(&v, data, 8);
+		crc = _mm_crc32_u64(crc, v);
+	}
+	uint32_t crc32 = (uint32_t)crc;
+	for (; data < end; ++data)
+		crc32 = _mm_crc32_u8(crc32, *data);
+	return ~crc32;
+}
+#endif
+
+static uint32_t crc32c(uint32_t state, const char *data, size_t len);
+
+static transform_fn g_crc32c_impl = crc32c;
+
+/* 第一次调用时选实现，之后直接调选中的那个 */
+static uint32_t crc32c(uint32_t state, const char *data, size_t len)
+{
+	static bool inited = false;
+	if (!inited)
+	{
+		crc32c_init_table();
+		g_crc32c_impl = crc32c_sw;
+#ifdef __x86_64__
+		if (__builtin_cpu_supports("sse4.2"))
+			g_crc32c_impl = crc32c_hw;
+#endif
+		inited = true;
+	}
+	return g_crc32c_impl(state, data, len);
+}
+
+/* 逐字节的 FNV-1a，比 crc32c 慢得多，用来模拟更重的计算 */
+static uint32_t fnv1a(uint32_t state, const char *data, size_t len)
+{
+	uint32_t h = state ? state : 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+	{
+		h ^= (uint8_t)data[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static const transform_t g_transforms[] =
+{
+	{"crc32c", crc32c},
+	{"fnv1a", fnv1a},
+};
+
+const transform_t *transform_find(const char *name)
+{
+	for (auto &t : g_transforms)
+		if (strcmp(t.name, name) == 0)
+		{
+			// 在主线程里先选好实现，线程池里就不会同时初始化
+			t.fn(0, "", 0);
+			return &t;
+		}
+	return NULL;
+}
+
+const char *transform_names()
+{
+	return "crc32c fnv1a";
+}
+
+uint32_t transform_apply(const transform_t *t, uint32_t state, const char *data, size_t len, int rounds)
+{
+	for (int i = 0; i < rounds; ++i)
+		state = t->fn(state, data, len);
+	return state;
+}
@@ -0,0 +1,31 @@
+/*
+ * transform.h
+ * 模拟真实 handler 里每条消息都要做的 CPU 计算（校验、压缩之类），
+ * 数据原样回给 client，计算结果按连接串起来，连接关闭时打印出来方便核对
+ */
+
+#ifndef __transform_h__
+#define __transform_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* state 是上一段数据的结果，同一个连接的数据按顺序串起来算 */
+typedef uint32_t (*transform_fn)(uint32_t state, const char *data, size_t len);
+
+struct transform_t
+{
+	const char *name;
+	transform_fn fn;
+};
+
+/* 按名字找，找不到返回 NULL */
+const transform_t *transform_find(const char *name);
+
+/* 空格分开的所有名字，给 usage 用 */
+const char *transform_names();
+
+/* 同一段数据连着算 rounds 遍，用来调节每个字节的开销 */
+uint32_t transform_apply(const transform_t *t, uint32_t state, const char *data, size_t len, int rounds);
+
+#endif
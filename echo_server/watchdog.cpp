@@ -0,0 +1,206 @@
+/*
+ * watchdog.cpp
+ * 采样用实时信号，信号处理函数里只调 backtrace 和读写本线程的变量；
+ * backtrace 第一次调用会加载 libgcc_s，启动时先在普通上下文里调一次
+ */
+
+#include "watchdog.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <signal.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include "trace.h"
+
+using namespace std;
+
+#define WATCHDOG_SKIP_FRAMES 2		// 信号处理函数自己和内核返回用的 __restore_rt
+
+static uint64_t g_threshold_ns = 0;		// 0 表示没有启动
+static mutex g_lock;
+static vector<loop_heartbeat*> g_heartbeats;
+static __thread loop_heartbeat *t_heartbeat = NULL;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void on_sample(int sig)
+{
+	loop_heartbeat *hb = t_heartbeat;
+	if (hb == NULL)
+		return;
+	int saved = errno;
+	hb->phase = t_trace_phase;
+	hb->nframes = backtrace(hb->frames, WATCHDOG_FRAMES);
+	hb->sampled.store(hb->seq.load(memory_order_relaxed), memory_order_release);
+	errno = saved;
+}
+
+/* 这一轮到现在除去等事件以外花的时间 */
+static uint64_t busy_ns(loop_heartbeat *hb, uint64_t since, uint64_t now)
+{
+	uint64_t busy = now - since;
+	if (hb->idle_ns)
+	{
+		uint64_t idle = hb->idle_ns(hb->idle_arg) - hb->idle_at_begin.load(memory_order_relaxed);
+		busy = busy > idle ? busy - idle : 0;
+	}
+	return busy;
+}
+
+/*
+ * 让卡住的线程采一次栈，等它填好再打印；等不到说明这一轮已经结束了
+ * 直接 write 到 stderr，不用 cerr，cerr 输出前要先 flush cout，loop 正是卡在 cout 上时这里也会跟着卡住
+ */
+static void report(loop_heartbeat *hb, uint64_t seq, uint64_t busy)
+{
+	pthread_kill(hb->thread, SIGRTMIN);
+	bool sampled = false;
+	for (int i = 0; i < WATCHDOG_SAMPLE_WAIT_MS && !sampled; ++i)
+	{
+		usleep(1000);
+		sampled = hb->sampled.load(memory_order_acquire) == seq;
+	}
+
+	ostringstream msg;
+	msg << "stall: " << hb->name << " busy " << fixed << setprecision(1) << busy / 1e6 << "ms";
+	if (sampled)
+		msg << " in " << (hb->phase ? hb->phase : "(no TRACE_SCOPE)") << ", stack:\n";
+	else
+		msg << ", finished before the stack was sampled\n";
+	string text = msg.str();
+	if (write(STDERR_FILENO, text.data(), text.size()) < 0 || !sampled)
+		return;
+	if (hb->nframes > WATCHDOG_SKIP_FRAMES)
+		backtrace_symbols_fd(hb->frames + WATCHDOG_SKIP_FRAMES, hb->nframes - WATCHDOG_SKIP_FRAMES, STDERR_FILENO);
+}
+
+/* 每轮只报告一次，seq 前后读两遍确认 since 是同一轮的 */
+static void watch()
+{
+	uint64_t interval_us = g_threshold_ns / 4000;
+	if (interval_us < 1000)
+		interval_us = 1000;
+
+	vector<loop_heartbeat*> heartbeats;
+	for (;;)
+	{
+		usleep(interval_us);
+		{
+			lock_guard<mutex> guard(g_lock);
+			heartbeats = g_heartbeats;
+		}
+
+		for (loop_heartbeat *hb : heartbeats)
+		{
+			uint64_t seq = hb->seq.load(memory_order_acquire);
+			uint64_t since = hb->since.load(memory_order_acquire);
+			if (since == 0 || seq == hb->reported)
+				continue;
+			uint64_t busy = busy_ns(hb, since, now_ns());
+			if (hb->seq.load(memory_order_acquire) != seq || busy < g_threshold_ns)
+				continue;
+
+			hb->reported = seq;
+			report(hb, seq, busy);
+		}
+	}
+}
+
+void watchdog_start(uint64_t threshold_ms)
+{
+	g_threshold_ns = threshold_ms * 1000000;
+	if (g_threshold_ns == 0)
+		return;
+
+	void *frames[1];
+	backtrace(frames, 1);
+
+	// SA_RESTART，不让采样打断 loop 线程正在做的阻塞调用
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sample;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGRTMIN, &sa, NULL);
+
+	thread(watch).detach();
+	cout << "watchdog: report loop iterations longer than " << threshold_ms << "ms" << endl;
+}
+
+loop_heartbeat *watchdog_register(const string &name, watchdog_idle_fn idle_ns, void *idle_arg)
+{
+	if (g_threshold_ns == 0)
+		return NULL;
+
+	loop_heartbeat *hb = new loop_heartbeat;
+	hb->name = name;
+	hb->thread = pthread_self();
+	hb->idle_ns = idle_ns;
+	hb->idle_arg = idle_arg;
+	hb->seq = 0;
+	hb->since = 0;
+	hb->idle_at_begin = 0;
+	hb->phase = NULL;
+	hb->nframes = 0;
+	hb->sampled = 0;
+	hb->reported = 0;
+	t_heartbeat = hb;
+
+	lock_guard<mutex> guard(g_lock);
+	g_heartbeats.push_back(hb);
+	return hb;
+}
+
+void watchdog_begin(loop_heartbeat *hb, uint64_t now)
+{
+	if (hb == NULL)
+		return;
+	if (hb->idle_ns)
+		hb->idle_at_begin.store(hb->idle_ns(hb->idle_arg), memory_order_relaxed);
+	hb->seq.store(hb->seq.load(memory_order_relaxed) + 1, memory_order_release);
+	hb->since.store(now, memory_order_release);
+}
+
+void watchdog_end(loop_heartbeat *hb, uint64_t now)
+{
+	if (hb == NULL)
+		return;
+	uint64_t since = hb->since.load(memory_order_relaxed);
+	if (since == 0)
+		return;
+	uint64_t busy = busy_ns(hb, since, now);
+	if (busy >= g_threshold_ns)
+		hb->stalls.record(busy);
+	hb->since.store(0, memory_order_release);
+}
+
+void watchdog_print_stats()
+{
+	if (g_threshold_ns == 0)
+		return;
+
+	lock_guard<mutex> guard(g_lock);
+	for (loop_heartbeat *hb : g_heartbeats)
+	{
+		if (hb->stalls.count() == 0)
+		{
+			cout << hb->name << ": no stalls over " << g_threshold_ns / 1000000 << "ms" << endl;
+			continue;
+		}
+		string name = hb->name + " stall";
+		hb->stalls.print(name.c_str());
+	}
+}
@@ -0,0 +1,72 @@
+/*
+ * watchdog.h
+ * 找出卡住整个 loop 的单次操作，比如终端堵住时同步的 cout << endl，不用等 client 超时才发现
+ *
+ * 每个 loop 每轮开始处理事件时打一个时间戳，回去等事件前清掉；watchdog 线程定期看一遍，
+ * 一轮超过阈值还没处理完就算卡住，用信号让 loop 线程自己记下当前的阶段（最里层的 TRACE_SCOPE）
+ * 和调用栈，再由 watchdog 线程打印出来，loop 线程不碰 stderr；
+ * 卡住的时长在这一轮结束时记进直方图，kill -USR1 时跟别的统计一起打印
+ *
+ *   loop_heartbeat *hb = watchdog_register("loop");	// 在 loop 线程里调用，没开 watchdog 时返回 NULL
+ *   for (;;)
+ *   {
+ *       epoll_wait(...);
+ *       watchdog_begin(hb, now_ns());
+ *       ...
+ *       watchdog_end(hb, now_ns());
+ *   }
+ *
+ * libuv 的 I/O 回调在 uv_run 里面紧跟着 epoll_wait 调用，中间插不进去，就在 prepare 里结束上一轮、
+ * 开始下一轮，再传进 uv_metrics_idle_time 把等事件的时间减掉
+ */
+
+#ifndef __watchdog_h__
+#define __watchdog_h__
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <pthread.h>
+#include "histogram.h"
+
+#define WATCHDOG_FRAMES 32				// 最多采多少层调用栈
+#define WATCHDOG_SAMPLE_WAIT_MS 100		// 发信号之后最多等 loop 线程这么久
+
+/* loop 在 epoll_wait 里一共等了多少纳秒，要在别的线程也能调用 */
+typedef uint64_t (*watchdog_idle_fn)(void *arg);
+
+struct loop_heartbeat
+{
+	std::string name;
+	pthread_t thread;
+	watchdog_idle_fn idle_ns;			// 一轮里包括等事件的时间才需要，其它是 NULL
+	void *idle_arg;
+
+	std::atomic<uint64_t> seq;			// 第几轮，只有 loop 线程写
+	std::atomic<uint64_t> since;		// 这一轮开始的时间，在等事件时是 0
+	std::atomic<uint64_t> idle_at_begin;
+	histogram stalls;					// 超过阈值的轮次花的时间，只有 loop 线程写
+
+	// 信号处理函数里填，sampled 改成当时的 seq 之后 watchdog 线程才读
+	const char *phase;
+	void *frames[WATCHDOG_FRAMES];
+	int nframes;
+	std::atomic<uint64_t> sampled;
+
+	uint64_t reported;					// 上次报告的是第几轮，只有 watchdog 线程用
+};
+
+/* 启动 watchdog 线程，一轮处理超过 threshold_ms 毫秒算卡住，要在 loop 线程注册之前调用 */
+void watchdog_start(uint64_t threshold_ms);
+
+/* 在 loop 线程里调用，之后发给这个线程的信号才知道记到哪里；没有启动 watchdog 时返回 NULL */
+loop_heartbeat *watchdog_register(const std::string &name, watchdog_idle_fn idle_ns = NULL, void *idle_arg = NULL);
+
+/* now 是 CLOCK_MONOTONIC 的纳秒，一般用 loop 自己统计时已经取过的时间，hb 是 NULL 时什么也不做 */
+void watchdog_begin(loop_heartbeat *hb, uint64_t now);
+void watchdog_end(loop_heartbeat *hb, uint64_t now);
+
+/* 各个 loop 卡住的次数和时长分布 */
+void watchdog_print_stats();
+
+#endif